@@ -38,12 +38,16 @@
 #include <limits.h>
 #include <errno.h>
 #include <ctype.h>
+#include <signal.h>
 
 #include "squashfs_fs.h"
 #include "mksquashfs.h"
 #include "action.h"
 #include "mksquashfs_error.h"
 #include "fnmatch_compat.h"
+#include "arena.h"
+#include "scanner.h"
+#include "fnv.h"
 
 #define TRUE 1
 #define FALSE 0
@@ -91,6 +95,16 @@ static struct action_entry action_table[];
 
 static struct expr *parse_expr(int subexp);
 
+static void start_eval();
+
+/* whether the pathname and subpath are needed by each action list */
+static int other_paths, fragment_paths, empty_paths, prune_paths;
+
+static int run_program(struct program *, struct action_data *);
+
+static void init_action_data(struct action_data *, struct dir_info *,
+	struct dir_ent *, int *);
+
 extern char *pathname(struct dir_ent *);
 
 /*
@@ -903,7 +917,7 @@ static int eval_expr_top(struct action *action, struct action_data *action_data)
 
 		return match;
 	} else
-		return eval_expr(action->expr, action_data);
+		return run_program(&action->program, action_data);
 }
 
 
@@ -1002,13 +1016,7 @@ void eval_actions(struct dir_info *root, struct dir_ent *dir_ent)
 	struct action_data action_data;
 	int st_mode = dir_ent->inode->buf.st_mode;
 
-	action_data.name = dir_ent->name;
-	action_data.pathname = strdup(pathname(dir_ent));
-	action_data.subpath = strdup(subpathname(dir_ent));
-	action_data.buf = &dir_ent->inode->buf;
-	action_data.depth = dir_ent->our_dir->depth;
-	action_data.dir_ent = dir_ent;
-	action_data.root = root;
+	init_action_data(&action_data, root, dir_ent, &other_paths);
 
 	for (i = 0; i < other_count; i++) {
 		struct action *action = &other_spec[i];
@@ -1036,13 +1044,7 @@ void *eval_frag_actions(struct dir_info *root, struct dir_ent *dir_ent, int tail
 	int i, match;
 	struct action_data action_data;
 
-	action_data.name = dir_ent->name;
-	action_data.pathname = strdup(pathname(dir_ent));
-	action_data.subpath = strdup(subpathname(dir_ent));
-	action_data.buf = &dir_ent->inode->buf;
-	action_data.depth = dir_ent->our_dir->depth;
-	action_data.dir_ent = dir_ent;
-	action_data.root = root;
+	init_action_data(&action_data, root, dir_ent, &fragment_paths);
 
 	for (i = 0; i < fragment_count; i++) {
 		match = eval_expr_top(&fragment_spec[i], &action_data);
@@ -1103,11 +1105,15 @@ int eval_exclude_actions(char *name, char *pathname, char *subpath,
 {
 	int i, match = 0;
 	struct action_data action_data;
+	struct inode_stat stat;
+
+	start_eval();
+	get_inode_stat(&stat, buf);
 
 	action_data.name = name;
 	action_data.pathname = pathname;
 	action_data.subpath = subpath;
-	action_data.buf = buf;
+	action_data.buf = &stat;
 	action_data.depth = depth;
 	action_data.dir_ent = dir_ent;
 
@@ -1646,13 +1652,7 @@ int eval_empty_actions(struct dir_info *root, struct dir_ent *dir_ent)
 	if (dir->count != 0)
 		return 0;
 
-	action_data.name = dir_ent->name;
-	action_data.pathname = strdup(pathname(dir_ent));
-	action_data.subpath = strdup(subpathname(dir_ent));
-	action_data.buf = &dir_ent->inode->buf;
-	action_data.depth = dir_ent->our_dir->depth;
-	action_data.dir_ent = dir_ent;
-	action_data.root = root;
+	init_action_data(&action_data, root, dir_ent, &empty_paths);
 
 	for (i = 0; i < empty_count && !match; i++) {
 		data = empty_spec[i].data;
@@ -1739,18 +1739,6 @@ static char *get_comp(char **pathname)
 }
 
 
-static struct dir_ent *lookup_comp(char *comp, struct dir_info *dest)
-{
-	struct dir_ent *dir_ent;
-
-	for(dir_ent = dest->list; dir_ent; dir_ent = dir_ent->next)
-		if(strcmp(comp, dir_ent->name) == 0)
-			break;
-
-	return dir_ent;
-}
-
-
 void eval_move(struct action_data *action_data, struct move_ent *move,
 		struct dir_info *root, struct dir_ent *dir_ent, char *pathname)
 {
@@ -1793,7 +1781,7 @@ void eval_move(struct action_data *action_data, struct move_ent *move,
 		 * we've arrived at the leaf component which we are going to
 		 * rename source to
 		 */
-		comp_ent = lookup_comp(comp, dest);
+		comp_ent = lookup_name(dest, comp);
 		if (comp_ent == NULL || (comp_ent->inode->buf.st_mode & S_IFMT)
 							!= S_IFDIR)
 			break;
@@ -1890,6 +1878,8 @@ void eval_move_actions(struct dir_info *root, struct dir_ent *dir_ent)
 	struct action_data action_data;
 	struct move_ent *move = NULL;
 
+	start_eval();
+
 	action_data.name = dir_ent->name;
 	action_data.pathname = strdup(pathname(dir_ent));
 	action_data.subpath = strdup(subpathname(dir_ent));
@@ -1943,7 +1933,7 @@ void eval_move_actions(struct dir_info *root, struct dir_ent *dir_ent)
 			move->dest : dir_ent->our_dir;
 		name = (move->ops & ACTION_MOVE_RENAME) ?
 			move->name : dir_ent->name;
-		comp_ent = lookup_comp(name, dest);
+		comp_ent = lookup_name(dest, name);
 		if(comp_ent) {
 			char *conf_path = move_pathname(move);
 			ERROR("Move action: Cannot move %s to %s, "
@@ -2017,6 +2007,7 @@ static void move_file(struct move_ent *move_ent)
 		}
 
 		/* Remove the file from source directory */
+		remove_name_index(source, dir_ent);
 		for(comp_ent = source->list; comp_ent != dir_ent;
 				prev = comp_ent, comp_ent = comp_ent->next);
 
@@ -2059,14 +2050,21 @@ static void move_file(struct move_ent *move_ent)
 		 * over-ridden
 		 */
 		if(dir_ent->nonstandard_pathname == NULL &&
-						dir_ent->source_name == NULL)
-			dir_ent->source_name = dir_ent->name;
-		else
-			free(dir_ent->name);
+						dir_ent->source_name == NULL) {
+			dir_ent->source_name = strdup(dir_ent->name);
+			if(dir_ent->source_name == NULL)
+				MEM_ERROR();
+		}
 
-		dir_ent->name = move_ent->name;
+		/* if moved, it has already left the source's name index */
+		if(!(move_ent->ops & ACTION_MOVE_MOVE))
+			remove_name_index(dir_ent->our_dir, dir_ent);
+		dir_ent->name = intern_name(move_ent->name);
+		free(move_ent->name);
 	}
 
+	add_name_index(dir_ent->our_dir, dir_ent);
+
 	if(dir_ent->dir)
 		/*
 		 * dir_ent is a directory, and we have to recursively fix-up
@@ -2084,7 +2082,7 @@ void do_move_actions()
 			move_list->dest : move_list->dir_ent->our_dir;
 		char *name = (move_list->ops & ACTION_MOVE_RENAME) ?
 			move_list->name : move_list->dir_ent->name;
-		struct dir_ent *comp_ent = lookup_comp(name, dest);
+		struct dir_ent *comp_ent = lookup_name(dest, name);
 		if(comp_ent) {
 			char *conf_path = move_pathname(move_list);
 			ERROR("Move action: Cannot move %s to %s, "
@@ -2114,13 +2112,7 @@ int eval_prune_actions(struct dir_info *root, struct dir_ent *dir_ent)
 	int i, match = 0;
 	struct action_data action_data;
 
-	action_data.name = dir_ent->name;
-	action_data.pathname = strdup(pathname(dir_ent));
-	action_data.subpath = strdup(subpathname(dir_ent));
-	action_data.buf = &dir_ent->inode->buf;
-	action_data.depth = dir_ent->our_dir->depth;
-	action_data.dir_ent = dir_ent;
-	action_data.root = root;
+	init_action_data(&action_data, root, dir_ent, &prune_paths);
 
 	for (i = 0; i < prune_count && !match; i++)
 		match = eval_expr_top(&prune_spec[i], &action_data);
@@ -2765,6 +2757,393 @@ static int exec_fn(struct atom *atom, struct action_data *action_data)
 }
 
 
+/*
+ *  Pexec test specific code
+ *
+ * Exec forks and execs the command for every file it is evaluated on.  Pexec
+ * starts the command once, and writes a record for each file to its stdin,
+ * the NAME, PATHNAME and SOURCE_PATHNAME (as set by exec) each terminated by
+ * a NUL.  For each record the command writes a line to its stdout, 1 for TRUE
+ * or 0 for FALSE.
+ *
+ * If the number of processes is given, that many copies of the command are
+ * started, and records for the entries following the file in its directory
+ * are sent ahead, round robin, so the verdicts are usually already waiting
+ * when they are needed
+ */
+static int parse_pexec_args(struct test_entry *test, struct atom *atom)
+{
+	struct pexec_data *data;
+	int processes = 0;
+
+	if(atom->args == 0 || atom->args > 2) {
+		TEST_SYNTAX_ERROR(test, 0, "Expected one or two arguments\n");
+		return 0;
+	}
+
+	if(atom->args == 2) {
+		char *end;
+
+		processes = strtol(atom->argv[1], &end, 10);
+		if(*end != '\0' || processes < 1 ||
+					processes > PEXEC_MAX_PROCESSES) {
+			TEST_SYNTAX_ERROR(test, 1, "Number of processes should "
+				"be 1 .. %d\n", PEXEC_MAX_PROCESSES);
+			return 0;
+		}
+	}
+
+	data = malloc(sizeof(*data));
+	if(data == NULL)
+		MEM_ERROR();
+
+	data->command = atom->argv[0];
+	data->processes = processes ? processes : 1;
+	data->ahead = processes ? processes * PEXEC_AHEAD : 0;
+	data->next_process = 0;
+	data->process = NULL;
+	/*
+	 * The request table is indexed by head and tail modulo its size,
+	 * which must be a power of two so the mapping stays the same when
+	 * they wrap
+	 */
+	for(data->size = 1; data->size < data->ahead * 2 + 1; data->size <<= 1);
+	data->head = data->tail = 0;
+	data->request = malloc(data->size * sizeof(struct pexec_request));
+	if(data->request == NULL)
+		MEM_ERROR();
+
+	atom->data = data;
+
+	return 1;
+}
+
+
+static void start_pexec(struct pexec_data *data)
+{
+	int i;
+
+	data->process = malloc(data->processes * sizeof(struct pexec_process));
+	if(data->process == NULL)
+		MEM_ERROR();
+
+	/*
+	 * If the command exits, get EPIPE rather than being killed writing
+	 * to it
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
+	for(i = 0; i < data->processes; i++) {
+		struct pexec_process *process = &data->process[i];
+		int in[2], out[2];
+
+		if(pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1)
+			BAD_ERROR("pexec_fn pipe failed\n");
+
+		process->pid = fork();
+		if(process->pid == -1)
+			BAD_ERROR("pexec_fn fork failed\n");
+
+		if(process->pid == 0) {
+			/*
+			 * Child process
+			 * connect stdin and stdout to the pipes, and
+			 * execute the command
+			 */
+			if(dup2(in[0], STDIN_FILENO) == -1 ||
+					dup2(out[1], STDOUT_FILENO) == -1)
+				exit(EXIT_FAILURE);
+
+			execl("/bin/sh", "sh", "-c", data->command,
+							(char *) NULL);
+			exit(EXIT_FAILURE);
+		}
+
+		close(in[0]);
+		close(out[1]);
+		process->in = in[1];
+		process->out = out[0];
+		process->bytes = 0;
+	}
+}
+
+
+/*
+ * Read the next verdict from process
+ */
+static int read_verdict(struct pexec_data *data, struct pexec_process *process)
+{
+	char *nl;
+	int res, verdict;
+
+	while((nl = memchr(process->line, '\n', process->bytes)) == NULL) {
+		if(process->bytes == PEXEC_LINE_SIZE)
+			BAD_ERROR("pexec: command \"%s\" returned an invalid "
+				"verdict\n", data->command);
+
+		res = read(process->out, process->line + process->bytes,
+					PEXEC_LINE_SIZE - process->bytes);
+		if(res == -1 && errno == EINTR)
+			continue;
+		if(res == -1)
+			BAD_ERROR("pexec: read from command \"%s\" failed "
+				"because %s\n", data->command, strerror(errno));
+		if(res == 0)
+			BAD_ERROR("pexec: command \"%s\" exited before "
+				"returning a verdict\n", data->command);
+
+		process->bytes += res;
+	}
+
+	*nl = '\0';
+	if(strcmp(process->line, "1") == 0)
+		verdict = TRUE;
+	else if(strcmp(process->line, "0") == 0)
+		verdict = FALSE;
+	else
+		BAD_ERROR("pexec: command \"%s\" returned invalid verdict "
+			"\"%s\", expected 0 or 1\n", data->command,
+			process->line);
+
+	process->bytes -= nl + 1 - process->line;
+	memmove(process->line, nl + 1, process->bytes);
+
+	return verdict;
+}
+
+
+/*
+ * Get the verdict for request.  Each process replies in order, so
+ * verdicts are read and assigned to the oldest outstanding request of that
+ * process, until request has its verdict
+ */
+static int get_verdict(struct pexec_data *data, unsigned int request)
+{
+	struct pexec_request *req = &data->request[request % data->size];
+
+	while(req->verdict == -1) {
+		int verdict = read_verdict(data, &data->process[req->process]);
+		unsigned int i;
+
+		for(i = data->head; i != data->tail; i++) {
+			struct pexec_request *r = &data->request[i % data->size];
+
+			if(r->process == req->process && r->verdict == -1) {
+				r->verdict = verdict;
+				break;
+			}
+		}
+	}
+
+	return req->verdict;
+}
+
+
+static char *pexec_record(char *name, char *subpath, char *pathname,
+	int *size)
+{
+	int name_size = strlen(name) + 1;
+	int subpath_size = strlen(subpath) + 1;
+	int pathname_size = strlen(pathname) + 1;
+	char *record = malloc(name_size + subpath_size + pathname_size);
+
+	if(record == NULL)
+		MEM_ERROR();
+
+	memcpy(record, name, name_size);
+	memcpy(record + name_size, subpath, subpath_size);
+	memcpy(record + name_size + subpath_size, pathname, pathname_size);
+	*size = name_size + subpath_size + pathname_size;
+
+	return record;
+}
+
+
+/*
+ * Has a request been sent for dir_ent?  This only compares the pointer,
+ * the entry may since have been freed and its memory reused, but this only
+ * means a record isn't sent ahead
+ */
+static int sent_request(struct pexec_data *data, struct dir_ent *dir_ent)
+{
+	unsigned int i;
+
+	for(i = data->head; i != data->tail; i++)
+		if(data->request[i % data->size].dir_ent == dir_ent)
+			return TRUE;
+
+	return FALSE;
+}
+
+
+/*
+ * Find the most recent request for record, returning -1 if there isn't one
+ */
+static long long find_request(struct pexec_data *data, char *record,
+	int size)
+{
+	unsigned int i;
+
+	for(i = data->tail; i != data->head; i--) {
+		struct pexec_request *r = &data->request[(i - 1) % data->size];
+
+		if(r->size == size && memcmp(r->record, record, size) == 0)
+			return i - 1;
+	}
+
+	return -1;
+}
+
+
+/*
+ * Send record to the next process.  If the request table is full, the
+ * oldest request is first retired, reading its verdict if necessary.  The
+ * record is owned by the request table afterwards
+ */
+static unsigned int send_request(struct pexec_data *data,
+	struct dir_ent *dir_ent, char *record, int size)
+{
+	struct pexec_process *process = &data->process[data->next_process];
+	struct pexec_request *req;
+	int res, count;
+
+	if(data->tail - data->head == data->size) {
+		get_verdict(data, data->head);
+		free(data->request[data->head % data->size].record);
+		data->head ++;
+	}
+
+	for(count = 0; count < size; count += res) {
+		res = write(process->in, record + count, size - count);
+		if(res == -1 && errno == EINTR)
+			res = 0;
+		else if(res == -1)
+			BAD_ERROR("pexec: write to command \"%s\" failed "
+				"because %s\n", data->command, strerror(errno));
+	}
+
+	req = &data->request[data->tail % data->size];
+	req->dir_ent = dir_ent;
+	req->record = record;
+	req->size = size;
+	req->process = data->next_process;
+	req->verdict = -1;
+
+	data->next_process = (data->next_process + 1) % data->processes;
+
+	return data->tail ++;
+}
+
+
+/*
+ * Send record ahead, unless it has already been sent.  If this would retire
+ * request, get its verdict first
+ */
+static void send_ahead(struct pexec_data *data, struct dir_ent *dir_ent,
+	char *record, int size, long long request, int *verdict)
+{
+	if(find_request(data, record, size) != -1) {
+		free(record);
+		return;
+	}
+
+	if(*verdict == -1 && data->tail - data->head == data->size &&
+					data->head == request)
+		*verdict = get_verdict(data, request);
+
+	send_request(data, dir_ent, record, size);
+}
+
+
+/*
+ * Exclude actions are evaluated by dir_scan1() before the entry is added to
+ * the directory, and so the following entries are not yet on the list.
+ * Send ahead the entries the scanner has read but dir_scan1() hasn't
+ * reached yet instead
+ */
+static void send_ahead_scan(struct pexec_data *data, struct dir_info *dir,
+	long long request, int *verdict)
+{
+	struct scanner_dir *scan = dir->scan;
+	int i, size, res;
+
+	for(i = 0; i < data->ahead && scan->cur + i < scan->count; i++) {
+		struct scanner_entry *entry = &scan->entry[scan->cur + i];
+		char *subpath, *pathname, *record;
+
+		if(entry->error)
+			continue;
+
+		if(dir->subpath[0] != '\0')
+			res = asprintf(&subpath, "%s/%s", dir->subpath,
+								entry->name);
+		else
+			res = asprintf(&subpath, "/%s", entry->name);
+		if(res == -1)
+			BAD_ERROR("asprintf failed in send_ahead_scan\n");
+
+		res = asprintf(&pathname, "%s/%s", dir->pathname, entry->name);
+		if(res == -1)
+			BAD_ERROR("asprintf failed in send_ahead_scan\n");
+
+		record = pexec_record(entry->name, subpath, pathname, &size);
+		free(subpath);
+		free(pathname);
+
+		send_ahead(data, NULL, record, size, request, verdict);
+	}
+}
+
+
+static int pexec_fn(struct atom *atom, struct action_data *action_data)
+{
+	struct pexec_data *data = atom->data;
+	struct dir_ent *dir_ent = action_data->dir_ent;
+	long long request;
+	char *record;
+	int size, verdict = -1, i;
+
+	if(data->process == NULL)
+		start_pexec(data);
+
+	record = pexec_record(action_data->name, action_data->subpath,
+		action_data->pathname, &size);
+
+	request = find_request(data, record, size);
+	if(request == -1)
+		request = send_request(data, action_data->dir_ent, record,
+									size);
+	else
+		free(record);
+
+	/*
+	 * Send the following entries in the directory ahead, these are
+	 * likely to be asked for next.  An entry without an inode is still
+	 * being scanned (exclude actions), and the following entries come
+	 * from the scanner
+	 */
+	if(dir_ent && dir_ent->inode == NULL) {
+		if(data->ahead && dir_ent->our_dir->scan)
+			send_ahead_scan(data, dir_ent->our_dir, request,
+								&verdict);
+	} else if(dir_ent) {
+		for(i = 0, dir_ent = dir_ent->next; dir_ent && i < data->ahead;
+					dir_ent = dir_ent->next, i++) {
+			if(dir_ent->inode->root_entry ||
+						sent_request(data, dir_ent))
+				continue;
+
+			record = pexec_record(dir_ent->name,
+				subpathname(dir_ent), pathname(dir_ent), &size);
+			send_ahead(data, dir_ent, record, size, request,
+								&verdict);
+		}
+	}
+
+	return verdict == -1 ? get_verdict(data, request) : verdict;
+}
+
+
 /*
  * Symbolic link specific test code
  */
@@ -2806,7 +3185,7 @@ static struct dir_ent *follow_path(struct dir_info *dir, char *pathname)
 		}
 
 		/* Lookup comp in current directory */
-		dir_ent = lookup_comp(comp, dir);
+		dir_ent = lookup_name(dir, comp);
 		if(dir_ent == NULL)
 			/* Doesn't exist, failed to walk pathname */
 			return NULL;
@@ -2943,6 +3322,7 @@ static int parse_expr_arg1(struct test_entry *test, struct atom *atom)
 static int stat_fn(struct atom *atom, struct action_data *action_data)
 {
 	struct stat buf;
+	struct inode_stat stat_buf;
 	struct action_data eval_action;
 	int match, res;
 
@@ -2974,8 +3354,9 @@ static int stat_fn(struct atom *atom, struct action_data *action_data)
 
 	/* fill in the inode values of the file pointed to by the
 	 * symlink, but, leave everything else the same */
+	get_inode_stat(&stat_buf, &buf);
 	memcpy(&eval_action, action_data, sizeof(struct action_data));
-	eval_action.buf = &buf;
+	eval_action.buf = &stat_buf;
 
 	if(expr_log_cmnd(LOG_ENABLED)) {
 		expr_log(atom->test->name);
@@ -3057,7 +3438,7 @@ static int eval_fn(struct atom *atom, struct action_data *action_data)
 	int match;
 	char *path = atom->argv[0];
 	struct dir_ent *dir_ent = action_data->dir_ent;
-	struct stat *buf = action_data->buf;
+	struct inode_stat *buf = action_data->buf;
 	struct action_data eval_action;
 
 	/* Follow path (arg1) and evaluate the expression (arg2)
@@ -3215,7 +3596,7 @@ finish:
 static int perm_fn(struct atom *atom, struct action_data *action_data)
 {
 	struct perm_data *perm_data = atom->data;
-	struct stat *buf = action_data->buf;
+	struct inode_stat *buf = action_data->buf;
 
 	switch(perm_data->op) {
 	case PERM_EXACT:
@@ -3338,6 +3719,7 @@ static struct test_entry test_table[] = {
 	{ "false", 0, false_fn, NULL, 1, 0},
 	{ "file", 1, file_fn, parse_file_arg, 1, 0},
 	{ "exec", 1, exec_fn, NULL, 1, 0},
+	{ "pexec", -2, pexec_fn, parse_pexec_args, 1, 0},
 	{ "exists", 0, exists_fn, NULL, 0, 0},
 	{ "absolute", 0, absolute_fn, NULL, 0, 0},
 	{ "stat", 1, stat_fn, parse_expr_arg0, 1, 1},
@@ -3370,3 +3752,423 @@ static struct action_entry action_table[] = {
 	{ "noop", NOOP_ACTION, 0, ACTION_ALL, NULL, noop_action },
 	{ "", 0, -1, 0, NULL, NULL}
 };
+
+
+/*
+ * Action compiler.  The parse tree of each action is compiled into a flat
+ * program the first time actions are evaluated.  Constant true() and false()
+ * sub-expressions are folded away, and name(), pathname() and subpathname()
+ * tests are memoised per file.  Name() tests with literal patterns are
+ * looked up in the memo hash table, with the file's name, so any number of
+ * them costs one hash lookup per file rather than one fnmatch each
+ */
+static struct memo *memo_list = NULL;
+static int memo_count = 0;
+static int *memo_table = NULL;
+static int memo_table_size = 0;
+static unsigned int memo_gen = 0;
+static int compiled = FALSE;
+
+/* per file memo of the name lookup, and the subpath split into components */
+static unsigned int name_gen = 0, subpath_gen = 0;
+static int name_memo;
+static char *subpath_copy = NULL;
+static int *subpath_ends = NULL;
+static int subpath_size = 0, subpath_components = 0;
+
+
+static unsigned int memo_hash(int type, char *pattern)
+{
+	unsigned long long hash = FNV_HASH(FNV_OFFSET, type);
+
+	while(*pattern)
+		hash = FNV_HASH(hash, (unsigned char) *pattern++);
+
+	return hash & (memo_table_size - 1);
+}
+
+
+static int lookup_memo(int type, char *pattern)
+{
+	unsigned int i = memo_hash(type, pattern);
+
+	for(; memo_table[i] != -1; i = (i + 1) & (memo_table_size - 1)) {
+		struct memo *memo = &memo_list[memo_table[i]];
+
+		if(memo->type == type && strcmp(memo->pattern, pattern) == 0)
+			return memo_table[i];
+	}
+
+	return -1;
+}
+
+
+static void insert_memo(int n)
+{
+	unsigned int i = memo_hash(memo_list[n].type, memo_list[n].pattern);
+
+	for(; memo_table[i] != -1; i = (i + 1) & (memo_table_size - 1));
+
+	memo_table[i] = n;
+}
+
+
+static void grow_memo_table()
+{
+	int i;
+
+	memo_table_size = memo_table_size ? memo_table_size * 2 :
+							MEMO_TABLE_SIZE;
+	memo_table = realloc(memo_table, memo_table_size * sizeof(int));
+	if(memo_table == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < memo_table_size; i++)
+		memo_table[i] = -1;
+
+	for(i = 0; i < memo_count; i++)
+		insert_memo(i);
+}
+
+
+static int literal_pattern(char *pattern)
+{
+	/* '(' catches the extended +(...), @(...) and !(...) patterns */
+	return strpbrk(pattern, "*?[\\(") == NULL;
+}
+
+
+/*
+ * Return the memo for the string test, creating it if this is the first
+ * test with this pattern
+ */
+static int get_memo(int type, char *pattern)
+{
+	int n = memo_table ? lookup_memo(type, pattern) : -1;
+
+	if(n != -1)
+		return n;
+
+	if(memo_count * 4 >= memo_table_size * 3)
+		grow_memo_table();
+
+	memo_list = realloc(memo_list, (memo_count + 1) * sizeof(struct memo));
+	if(memo_list == NULL)
+		MEM_ERROR();
+
+	memo_list[memo_count].type = type;
+	memo_list[memo_count].pattern = pattern;
+	memo_list[memo_count].literal = literal_pattern(pattern);
+	memo_list[memo_count].components = count_components(pattern);
+	memo_list[memo_count].gen = 0;
+	insert_memo(memo_count);
+
+	return memo_count ++;
+}
+
+
+/*
+ * Split the file's subpath into components the same way get_start() does,
+ * recording where each ends
+ */
+static void split_subpath(char *subpath)
+{
+	int size = strlen(subpath) + 1;
+	char *path;
+
+	if(size > subpath_size) {
+		subpath_copy = realloc(subpath_copy, size);
+		subpath_ends = realloc(subpath_ends, size * sizeof(int));
+		if(subpath_copy == NULL || subpath_ends == NULL)
+			MEM_ERROR();
+		subpath_size = size;
+	}
+
+	memcpy(subpath_copy, subpath, size);
+
+	for(path = subpath_copy, subpath_components = 0; *path != '\0';
+						subpath_components ++) {
+		while (*path == '/')
+			path ++;
+
+		while (*path != '\0' && *path != '/')
+			path ++;
+
+		subpath_ends[subpath_components] = path - subpath_copy;
+	}
+}
+
+
+static int subpathname_match(struct memo *memo, char *subpath)
+{
+	int n = memo->components, match, end;
+	char c;
+
+	if(subpath_gen != memo_gen) {
+		split_subpath(subpath);
+		subpath_gen = memo_gen;
+	}
+
+	if(n > subpath_components)
+		return fnmatch(memo->pattern, subpath_copy,
+					FNM_PATHNAME|FNM_EXTMATCH) == 0;
+
+	end = n ? subpath_ends[n - 1] : 0;
+	c = subpath_copy[end];
+	subpath_copy[end] = '\0';
+	match = fnmatch(memo->pattern, subpath_copy,
+					FNM_PATHNAME|FNM_EXTMATCH) == 0;
+	subpath_copy[end] = c;
+
+	return match;
+}
+
+
+static int eval_memo(int n, struct action_data *action_data)
+{
+	struct memo *memo = &memo_list[n];
+
+	if(memo->gen == memo_gen)
+		return memo->match;
+
+	switch(memo->type) {
+	case MEMO_NAME:
+		if(memo->literal) {
+			if(name_gen != memo_gen) {
+				name_memo = lookup_memo(MEMO_NAME,
+							action_data->name);
+				name_gen = memo_gen;
+			}
+			memo->match = name_memo == n;
+		} else
+			memo->match = fnmatch(memo->pattern, action_data->name,
+					FNM_PATHNAME|FNM_EXTMATCH) == 0;
+		break;
+	case MEMO_PATHNAME:
+		if(memo->literal)
+			memo->match = strcmp(memo->pattern,
+						action_data->subpath) == 0;
+		else
+			memo->match = fnmatch(memo->pattern,
+						action_data->subpath,
+						FNM_PATHNAME|FNM_EXTMATCH) == 0;
+		break;
+	default:
+		memo->match = subpathname_match(memo, action_data->subpath);
+	}
+
+	memo->gen = memo_gen;
+	return memo->match;
+}
+
+
+static int emit(struct program *program, int op, int arg, struct atom *atom)
+{
+	if(program->count == program->size) {
+		program->size = program->size ? program->size * 2 : 16;
+		program->ins = realloc(program->ins, program->size *
+						sizeof(struct instruction));
+		if(program->ins == NULL)
+			MEM_ERROR();
+	}
+
+	program->ins[program->count].op = op;
+	program->ins[program->count].arg = arg;
+	program->ins[program->count].atom = atom;
+
+	return program->count ++;
+}
+
+
+static int compile_atom(struct program *program, struct atom *atom)
+{
+	int (*fn)(struct atom *, struct action_data *) = atom->test->fn;
+
+	if(fn == true_fn)
+		return TRUE;
+
+	if(fn == false_fn)
+		return FALSE;
+
+	if(fn == name_fn)
+		emit(program, INS_MEMO, get_memo(MEMO_NAME, atom->argv[0]),
+									NULL);
+	else if(fn == pathname_fn)
+		emit(program, INS_MEMO, get_memo(MEMO_PATHNAME,
+						atom->argv[0]), NULL);
+	else if(fn == subpathname_fn)
+		emit(program, INS_MEMO, get_memo(MEMO_SUBPATHNAME,
+						atom->argv[0]), NULL);
+	else
+		emit(program, INS_TEST, 0, atom);
+
+	if(fn == pathname_fn || fn == subpathname_fn || fn == file_fn ||
+			fn == exec_fn || fn == pexec_fn || fn == stat_fn)
+		program->paths = TRUE;
+
+	return COMPILED_CODE;
+}
+
+
+/*
+ * Compile expr, returning COMPILED_CODE, or TRUE/FALSE if the expression
+ * is constant, in which case no code is emitted.  Sub-expressions are
+ * only folded away when the original evaluation order wouldn't evaluate
+ * them either, so tests with side effects (exec) are still run
+ */
+static int compile_expr(struct program *program, struct expr *expr)
+{
+	int lhs, rhs, jump, op;
+
+	switch(expr->type) {
+	case ATOM_TYPE:
+		return compile_atom(program, &expr->atom);
+	case UNARY_TYPE:
+		lhs = compile_expr(program, expr->unary_op.expr);
+		if(lhs != COMPILED_CODE)
+			return !lhs;
+
+		emit(program, INS_NOT, 0, NULL);
+		return COMPILED_CODE;
+	}
+
+	/*
+	 * For && the rhs is evaluated if lhs is TRUE, for || if lhs is FALSE.
+	 * Otherwise the result is the value of lhs
+	 */
+	op = expr->expr_op.op == TOK_AND;
+	lhs = compile_expr(program, expr->expr_op.lhs);
+	if(lhs == !op)
+		return lhs;
+
+	if(lhs == op)
+		return compile_expr(program, expr->expr_op.rhs);
+
+	jump = emit(program, op ? INS_JUMP_FALSE : INS_JUMP_TRUE, 0, NULL);
+	rhs = compile_expr(program, expr->expr_op.rhs);
+
+	if(rhs == COMPILED_CODE)
+		program->ins[jump].arg = program->count;
+	else {
+		/*
+		 * rhs is constant.  If it is the value that can't change the
+		 * result (TRUE for &&), the result is lhs, otherwise it is
+		 * rhs, but lhs still has to be evaluated
+		 */
+		program->count --;
+		if(rhs != op)
+			emit(program, INS_CONST, rhs, NULL);
+	}
+
+	return COMPILED_CODE;
+}
+
+
+static int compile_list(struct action *spec_list, int count)
+{
+	int i, paths = FALSE;
+
+	for(i = 0; i < count; i++) {
+		struct program *program = &spec_list[i].program;
+		int res;
+
+		program->ins = NULL;
+		program->count = program->size = 0;
+		program->paths = FALSE;
+
+		res = compile_expr(program, spec_list[i].expr);
+		if(res != COMPILED_CODE)
+			emit(program, INS_CONST, res, NULL);
+
+		/* logging prints the subpath */
+		paths |= program->paths || spec_list[i].verbose;
+	}
+
+	return paths;
+}
+
+
+static void compile_actions()
+{
+	other_paths = compile_list(other_spec, other_count);
+	fragment_paths = compile_list(fragment_spec, fragment_count);
+	empty_paths = compile_list(empty_spec, empty_count);
+	prune_paths = compile_list(prune_spec, prune_count);
+	compile_list(exclude_spec, exclude_count);
+	compile_list(move_spec, move_count);
+
+	compiled = TRUE;
+}
+
+
+/*
+ * Called before the actions are evaluated on a file.  Compiles the actions
+ * the first time, and discards the memoised tests of the previous file
+ */
+static void start_eval()
+{
+	if(!compiled)
+		compile_actions();
+
+	memo_gen ++;
+}
+
+
+static int run_program(struct program *program,
+	struct action_data *action_data)
+{
+	struct instruction *ins = program->ins, *end = ins + program->count;
+	int acc = FALSE;
+
+	while(ins < end) {
+		switch(ins->op) {
+		case INS_TEST:
+			acc = ins->atom->test->fn(ins->atom, action_data);
+			break;
+		case INS_MEMO:
+			acc = eval_memo(ins->arg, action_data);
+			break;
+		case INS_NOT:
+			acc = !acc;
+			break;
+		case INS_CONST:
+			acc = ins->arg;
+			break;
+		case INS_JUMP_FALSE:
+			if(!acc) {
+				ins = program->ins + ins->arg;
+				continue;
+			}
+			break;
+		case INS_JUMP_TRUE:
+			if(acc) {
+				ins = program->ins + ins->arg;
+				continue;
+			}
+			break;
+		}
+
+		ins ++;
+	}
+
+	return acc;
+}
+
+
+/*
+ * Fill in action_data for dir_ent.  The pathname and subpath are only
+ * worked out if paths is set, that is, the actions need them
+ */
+static void init_action_data(struct action_data *action_data,
+	struct dir_info *root, struct dir_ent *dir_ent, int *paths)
+{
+	start_eval();
+
+	action_data->name = dir_ent->name;
+	action_data->pathname = *paths ? strdup(pathname(dir_ent)) : NULL;
+	action_data->subpath = *paths ? strdup(subpathname(dir_ent)) : NULL;
+	action_data->buf = &dir_ent->inode->buf;
+	action_data->depth = dir_ent->our_dir->depth;
+	action_data->dir_ent = dir_ent;
+	action_data->root = root;
+}
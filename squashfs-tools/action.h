@@ -213,12 +213,63 @@ struct action_data {
 	char *name;
 	char *pathname;
 	char *subpath;
-	struct stat *buf;
+	struct inode_stat *buf;
 	struct dir_ent *dir_ent;
 	struct dir_info *root;
 };
 
 
+/*
+ * Compiled expression definitions.  The expression tree of each action is
+ * compiled into a flat program, which evaluates the instructions in order,
+ * leaving the result in an accumulator
+ */
+#define INS_TEST		0	/* acc = atom test */
+#define INS_MEMO		1	/* acc = memoised string test arg */
+#define INS_NOT			2	/* acc = !acc */
+#define INS_CONST		3	/* acc = arg */
+#define INS_JUMP_FALSE		4	/* if acc is FALSE, jump to arg */
+#define INS_JUMP_TRUE		5	/* if acc is TRUE, jump to arg */
+
+/* result of compiling an expression, either code or a constant */
+#define COMPILED_CODE		-1
+
+struct instruction {
+	int op;
+	int arg;
+	struct atom *atom;
+};
+
+struct program {
+	struct instruction *ins;
+	int count;
+	int size;
+	/* the program needs action_data pathname and subpath */
+	int paths;
+};
+
+/*
+ * The name(), pathname() and subpathname() tests only depend on the file's
+ * name and subpath, which don't change while the actions are evaluated on a
+ * file.  Tests with the same pattern share one memo, so each is evaluated at
+ * most once per file, however many actions use it
+ */
+#define MEMO_NAME		0
+#define MEMO_PATHNAME		1
+#define MEMO_SUBPATHNAME	2
+#define MEMO_TABLE_SIZE		256
+
+struct memo {
+	int type;
+	char *pattern;
+	/* pattern has no wildcards, and so can be compared */
+	int literal;
+	/* number of pathname components in a subpathname pattern */
+	int components;
+	unsigned int gen;
+	int match;
+};
+
 struct action {
 	int type;
 	struct action_entry *action;
@@ -227,6 +278,7 @@ struct action {
 	struct expr *expr;
 	void *data;
 	int verbose;
+	struct program program;
 };
 
 
@@ -304,6 +356,46 @@ struct perm_data {
 };
 
 
+/*
+ * Pexec test function specific definitions
+ */
+#define PEXEC_MAX_PROCESSES	64
+/* records sent ahead per process */
+#define PEXEC_AHEAD		4
+#define PEXEC_LINE_SIZE		64
+
+struct pexec_process {
+	int pid;
+	/* records are written to in, verdicts are read from out */
+	int in;
+	int out;
+	char line[PEXEC_LINE_SIZE];
+	int bytes;
+};
+
+struct pexec_request {
+	struct dir_ent *dir_ent;
+	char *record;
+	int size;
+	int process;
+	/* -1 until the verdict has been read */
+	int verdict;
+};
+
+struct pexec_data {
+	char *command;
+	int processes;
+	int ahead;
+	int next_process;
+	struct pexec_process *process;
+	/* requests sent, head is the oldest, tail the next to be sent */
+	struct pexec_request *request;
+	int size;
+	unsigned int head;
+	unsigned int tail;
+};
+
+
 /*
  * External function definitions
  */
@@ -0,0 +1,376 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * arena.c
+ *
+ * Memory for the in-memory tree.  With 100 million files the tree is
+ * the largest thing Mksquashfs holds in memory, and a separate malloc
+ * for every name, directory entry, inode and block list costs a lot in
+ * malloc overhead alone.  Instead these are carved out of large chunks.
+ * Names are interned, so the many files called "Makefile" or "index.html"
+ * share one copy, and block lists of files kept for duplicate checking are
+ * packed one after another into a slab.
+ *
+ * All of this is only used by the main thread.
+ *
+ * If the tree is too big for memory it can be spilled (-spill option).  The
+ * chunks are then allocated from a scratch file mapped shared into memory
+ * rather than from malloc, and so cold parts of the tree, and the file
+ * records and hash chains used for duplicate checking, are paged out to the
+ * file by the kernel rather than being swapped or getting Mksquashfs
+ * OOM-killed.  To bound the resident set, the segments other than the one
+ * being allocated from are periodically dropped from memory, and they are
+ * faulted back in from the scratch file if they're used again.  Other threads
+ * can safely read the tree while this is done.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "squashfs_fs.h"
+#include "mksquashfs.h"
+#include "mksquashfs_error.h"
+#include "arena.h"
+#include "fnv.h"
+
+#define FALSE 0
+#define TRUE 1
+
+struct arena_stats arena_stats;
+
+static struct arena name_arena, slab_arena;
+
+/* open addressed table of the interned names */
+static char **intern_table = NULL;
+static unsigned int intern_size = 0, intern_count = 0;
+static int intern_finished = FALSE;
+
+/* the spill file, and the mapped segments of it */
+struct spill_segment {
+	char		*addr;
+	long long	size;
+};
+
+static int spill_fd = -1;
+static long long spill_limit, spill_trimmed = 0;
+static int spill_dirs = 0;
+static struct spill_segment *segment = NULL;
+static int segments = 0;
+static char *segment_ptr = NULL;
+static long long segment_left = 0;
+
+
+/*
+ * Estimate of what malloc (glibc) uses to satisfy a request of size bytes,
+ * used to report what the tree would have cost without the arena
+ */
+long long malloc_size(long long size)
+{
+	size = (size + sizeof(size_t) + 15) & ~15LL;
+
+	return size < 32 ? 32 : size;
+}
+
+
+/*
+ * Drop all but the segment being allocated from out of memory, the
+ * contents are safe in the page cache or spill file
+ */
+static void trim_segments()
+{
+	int i;
+
+	for(i = 0; i < segments - 1; i++)
+		madvise(segment[i].addr, segment[i].size, MADV_DONTNEED);
+
+	spill_trimmed = arena_stats.spill_bytes;
+	spill_dirs = 0;
+	arena_stats.spill_trims ++;
+}
+
+
+static void new_segment(long long size)
+{
+	long long page = sysconf(_SC_PAGESIZE);
+	char *addr;
+	int res;
+
+	size = size > SPILL_SEGMENT_SIZE ? (size + page - 1) & ~(page - 1) :
+							SPILL_SEGMENT_SIZE;
+
+	res = posix_fallocate(spill_fd, arena_stats.spill_bytes, size);
+	if(res)
+		BAD_ERROR("Failed to extend spill file because %s\n",
+			strerror(res));
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spill_fd,
+		arena_stats.spill_bytes);
+	if(addr == MAP_FAILED)
+		BAD_ERROR("Failed to mmap spill file because %s\n",
+			strerror(errno));
+
+	segment = realloc(segment, (segments + 1) *
+		sizeof(struct spill_segment));
+	if(segment == NULL)
+		MEM_ERROR();
+
+	segment[segments].addr = addr;
+	segment[segments ++].size = size;
+	segment_ptr = addr;
+	segment_left = size;
+	arena_stats.spill_bytes += size;
+
+	if(arena_stats.spill_bytes - spill_trimmed >= spill_limit / 2)
+		trim_segments();
+}
+
+
+static void *get_memory(long long size)
+{
+	void *ptr;
+
+	if(spill_fd == -1) {
+		ptr = malloc(size);
+		if(ptr == NULL)
+			MEM_ERROR();
+		return ptr;
+	}
+
+	size = (size + 7) & ~7LL;
+	if(size > segment_left)
+		new_segment(size);
+
+	ptr = segment_ptr;
+	segment_ptr += size;
+	segment_left -= size;
+
+	return ptr;
+}
+
+
+/*
+ * Spill the tree to filename, keeping about limit bytes of it in memory.
+ * Filename must not exist, and it is unlinked immediately, so it
+ * disappears whatever way Mksquashfs exits
+ */
+int arena_spill(char *filename, long long limit)
+{
+	spill_fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(spill_fd == -1)
+		return FALSE;
+
+	unlink(filename);
+	spill_limit = limit;
+
+	return TRUE;
+}
+
+
+/*
+ * Called when a directory has been finished with, and the part of the tree
+ * below it is cold
+ */
+void arena_trim()
+{
+	if(spill_fd == -1)
+		return;
+
+	if(arena_stats.spill_bytes - spill_trimmed >= spill_limit / 2 ||
+					++ spill_dirs >= SPILL_TRIM_DIRS)
+		trim_segments();
+}
+
+
+void *arena_alloc(struct arena *arena, int size, int align)
+{
+	int pad = (align - ((unsigned long) arena->ptr & (align - 1))) &
+								(align - 1);
+	void *ptr;
+
+	if(size > ARENA_LARGE) {
+		arena->bytes += size;
+		return get_memory(size);
+	}
+
+	if(arena->ptr == NULL || size + pad > arena->left) {
+		arena->ptr = get_memory(ARENA_CHUNK_SIZE);
+		arena->left = ARENA_CHUNK_SIZE;
+		arena->bytes += ARENA_CHUNK_SIZE;
+		pad = 0;
+	}
+
+	ptr = arena->ptr + pad;
+	arena->ptr += size + pad;
+	arena->left -= size + pad;
+
+	return ptr;
+}
+
+
+void *pool_alloc(struct pool *pool)
+{
+	void *ptr = pool->free;
+
+	if(ptr)
+		pool->free = *(void **) ptr;
+	else
+		ptr = arena_alloc(&pool->arena, pool->size, sizeof(void *));
+
+	if(++ pool->count > pool->peak)
+		pool->peak = pool->count;
+
+	return ptr;
+}
+
+
+void pool_free(struct pool *pool, void *ptr)
+{
+	*(void **) ptr = pool->free;
+	pool->free = ptr;
+	pool->count --;
+}
+
+
+static unsigned long long name_hash(char *name)
+{
+	unsigned long long hash = FNV_OFFSET;
+
+	while(*name)
+		hash = FNV_HASH(hash, (unsigned char) *name++);
+
+	return hash;
+}
+
+
+static void intern_insert(char **table, unsigned int size, char *name)
+{
+	unsigned int i = name_hash(name) & (size - 1);
+
+	while(table[i])
+		i = (i + 1) & (size - 1);
+
+	table[i] = name;
+}
+
+
+static void intern_grow()
+{
+	unsigned int i, size = intern_size ? intern_size * 2 :
+							INTERN_TABLE_SIZE;
+	char **table = calloc(size, sizeof(char *));
+
+	if(table == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < intern_size; i++)
+		if(intern_table[i])
+			intern_insert(table, size, intern_table[i]);
+
+	free(intern_table);
+	intern_table = table;
+	intern_size = size;
+
+	if(size * sizeof(char *) > arena_stats.intern_table_bytes)
+		arena_stats.intern_table_bytes = size * sizeof(char *);
+}
+
+
+static char *store_name(char *name, int size)
+{
+	char *copy = arena_alloc(&name_arena, size, 1);
+
+	memcpy(copy, name, size);
+	arena_stats.unique_names ++;
+	arena_stats.name_bytes += size;
+
+	return copy;
+}
+
+
+/*
+ * Return the shared copy of name.  The caller still owns name
+ */
+char *intern_name(char *name)
+{
+	int size = strlen(name) + 1;
+	unsigned int i;
+
+	arena_stats.names ++;
+	arena_stats.name_malloc_bytes += malloc_size(size);
+
+	if(intern_finished)
+		return store_name(name, size);
+
+	if(intern_count * 4 >= intern_size * 3)
+		intern_grow();
+
+	i = name_hash(name) & (intern_size - 1);
+	for(; intern_table[i]; i = (i + 1) & (intern_size - 1))
+		if(strcmp(intern_table[i], name) == 0)
+			return intern_table[i];
+
+	intern_count ++;
+	return intern_table[i] = store_name(name, size);
+}
+
+
+/*
+ * Directory scanning has finished, and few if any names will be added after
+ * this.  The table isn't worth its memory any more.  Names added after this
+ * are still stored in the arena, they just aren't shared
+ */
+void intern_finish()
+{
+	free(intern_table);
+	intern_table = NULL;
+	intern_size = intern_count = 0;
+	intern_finished = TRUE;
+}
+
+
+/*
+ * Copy block_list into the slab.  The slab is never freed, so this is only
+ * for block lists that live until the filesystem is written
+ */
+unsigned int *slab_block_list(unsigned int *block_list, int blocks)
+{
+	int size = blocks * sizeof(unsigned int);
+	unsigned int *copy;
+
+	if(blocks == 0)
+		return NULL;
+
+	copy = arena_alloc(&slab_arena, size, sizeof(unsigned int));
+	memcpy(copy, block_list, size);
+
+	arena_stats.block_lists ++;
+	arena_stats.block_list_bytes += size;
+	arena_stats.block_list_malloc_bytes += malloc_size(size);
+
+	return copy;
+}
@@ -0,0 +1,86 @@
+#ifndef ARENA_H
+#define ARENA_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * arena.h
+ */
+
+#define ARENA_CHUNK_SIZE	(1024 * 1024)
+
+/* allocations larger than this are malloced, rather than wasting a chunk */
+#define ARENA_LARGE		(ARENA_CHUNK_SIZE / 16)
+
+/* initial size of the name intern table, must be a power of 2 */
+#define INTERN_TABLE_SIZE	1024
+
+/*
+ * When spilling, the scratch file is mapped in segments of this size, and
+ * the resident set is trimmed at least every SPILL_TRIM_DIRS directories
+ */
+#define SPILL_SEGMENT_SIZE	(16 * 1024 * 1024)
+#define SPILL_MIN_MEM		(4 * SPILL_SEGMENT_SIZE)
+#define SPILL_TRIM_DIRS		4096
+
+struct arena {
+	char		*ptr;
+	int		left;
+	long long	bytes;
+};
+
+/* fixed size objects, allocated from an arena, with a free list */
+struct pool {
+	int		size;
+	void		*free;
+	long long	count;
+	long long	peak;
+	struct arena	arena;
+};
+
+struct arena_stats {
+	/* names passed to intern_name(), and those actually stored */
+	long long	names;
+	long long	unique_names;
+	long long	name_bytes;
+	/* what the names would have cost if strdup'ed */
+	long long	name_malloc_bytes;
+	long long	intern_table_bytes;
+	/* block lists stored in the slab */
+	long long	block_lists;
+	long long	block_list_bytes;
+	long long	block_list_malloc_bytes;
+	/* size of the spill file, and the number of times it was trimmed */
+	long long	spill_bytes;
+	long long	spill_trims;
+};
+
+#define POOL_INIT(type) { sizeof(type), NULL, 0, 0, { NULL, 0, 0 } }
+
+extern struct arena_stats arena_stats;
+extern void *arena_alloc(struct arena *, int, int);
+extern void *pool_alloc(struct pool *);
+extern void pool_free(struct pool *, void *);
+extern char *intern_name(char *);
+extern void intern_finish();
+extern unsigned int *slab_block_list(unsigned int *, int);
+extern long long malloc_size(long long);
+extern int arena_spill(char *, long long);
+extern void arena_trim();
+#endif
@@ -424,6 +424,8 @@ static struct file_buffer *_cache_get(struct cache *cache, long long index,
 	entry->locked = FALSE;
 	entry->wait_on_unlock = FALSE;
 	entry->error = FALSE;
+	entry->transcode = FALSE;
+	entry->verbatim = FALSE;
 	if(hash) {
 		entry->index = index;
 		insert_cache_hash_table(cache, entry);
@@ -554,6 +556,9 @@ struct file_buffer *cache_get_nowait(struct cache *cache, long long index)
 		entry->locked = TRUE;
 		entry->wait_on_unlock = FALSE;
 		entry->error = FALSE;
+		entry->transcode = FALSE;
+		entry->verbatim = FALSE;
+	entry->verbatim = FALSE;
 		entry->index = index;
 		insert_cache_hash_table(cache, entry);
 	}
@@ -92,7 +92,7 @@ struct file_buffer {
 	long long file_size;
 	union {
 		long long block;
-		unsigned short checksum;
+		unsigned long long hash;
 	};
 	struct cache *cache;
 	union {
@@ -101,6 +101,7 @@ struct file_buffer {
 	};
 	union {
 		struct tar_file *tar_file;
+		struct compressor *image_comp;
 		struct file_buffer *hash_prev;
 	};
 	union {
@@ -122,6 +123,8 @@ struct file_buffer {
 	char wait_on_unlock;
 	char noD;
 	char duplicate;
+	char transcode;
+	char verbatim;
 	char data[0] __attribute__((aligned));
 };
 
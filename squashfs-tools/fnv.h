@@ -0,0 +1,34 @@
+#ifndef FNV_H
+#define FNV_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * fnv.h
+ */
+
+/*
+ * 64 bit FNV-1a hash, used by the hash tables, and to identify duplicate
+ * fragments, xattrs and blocks.  Start with FNV_OFFSET, and add each byte
+ * with FNV_HASH
+ */
+#define FNV_OFFSET		0xcbf29ce484222325ULL
+#define FNV_PRIME		0x100000001b3ULL
+#define FNV_HASH(hash, byte)	(((hash) ^ (byte)) * FNV_PRIME)
+#endif
@@ -0,0 +1,531 @@
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * image.c
+ *
+ * Use existing Squashfs images as sources.  The directory tree of each
+ * image is read into memory with libsquashfs-read, and the reader thread
+ * later streams file data out of the image.  This allows an image to be
+ * rebuilt with a different compressor, block size or options without
+ * extracting it first.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "squashfs_fs.h"
+#include "mksquashfs.h"
+#include "mksquashfs_error.h"
+#include "progressbar.h"
+#include "compressor.h"
+#include "xattr.h"
+#include "squashfs_read.h"
+#include "image.h"
+
+#define TRUE 1
+#define FALSE 0
+
+extern int source;
+extern char **source_path;
+extern int root_uid_opt, root_gid_opt, root_time_opt;
+extern unsigned int root_uid, root_gid, root_time;
+
+/* Is Mksquashfs reading Squashfs images as sources? */
+int image_sources = FALSE;
+
+/* Are the images layers to be merged (flattened) into one filesystem? */
+int image_flatten = FALSE;
+
+#define WHITEOUT_PREFIX		".wh."
+#define WHITEOUT_OPAQUE		".wh..wh..opq"
+#define OVERLAY_OPAQUE		"trusted.overlay.opaque"
+
+
+static struct image_source *open_image(char *filename)
+{
+	struct image_source *source = malloc(sizeof(struct image_source));
+	int id;
+
+	if(source == NULL)
+		MEM_ERROR();
+
+	source->fs = squashfs_read_open(filename, 0, 0);
+	if(source->fs == NULL)
+		BAD_ERROR("Failed to read Squashfs image %s because %s\n",
+			filename, errno == EINVAL ? "it isn't a Squashfs 4.0 "
+			"filesystem" : strerror(errno));
+
+	id = squashfs_read_compression(source->fs);
+	source->comp = lookup_compressor_id(id);
+	source->filename = filename;
+	source->block_size = squashfs_read_block_size(source->fs);
+
+	/*
+	 * Compressed blocks can only be copied unchanged if they were
+	 * compressed with the same compressor and block size
+	 */
+	source->verbatim = comp->id == id && block_size == source->block_size;
+
+	return source;
+}
+
+
+static struct inode_info *image_inode(struct image_source *source,
+	int index, long long ref)
+{
+	struct squashfs_read_stat st;
+	struct inode_info *inode;
+	struct stat buf;
+
+	if(squashfs_read_stat(source->fs, ref, &st) == -1)
+		BAD_ERROR("Failed to read inode from Squashfs image %s "
+			"because %s\n", source->filename, strerror(errno));
+
+	memset(&buf, 0, sizeof(buf));
+	buf.st_mode = st.mode;
+	buf.st_uid = st.uid;
+	buf.st_gid = st.gid;
+	buf.st_mtime = st.mtime;
+	buf.st_nlink = st.nlink;
+	buf.st_rdev = st.rdev;
+	buf.st_dev = index + 1;
+	buf.st_ino = st.inode_number;
+	if(!S_ISDIR(st.mode))
+		buf.st_size = st.size;
+
+	if(S_ISLNK(st.mode)) {
+		char *symlink = malloc(st.size + 1);
+		ssize_t byte;
+
+		if(symlink == NULL)
+			MEM_ERROR();
+
+		byte = squashfs_read_readlink(source->fs, ref, symlink,
+								st.size);
+		if(byte == -1)
+			BAD_ERROR("Failed to read symlink from Squashfs image "
+				"%s because %s\n", source->filename,
+				strerror(errno));
+
+		symlink[byte] = '\0';
+		inode = lookup_inode3(&buf, NULL, symlink, byte + 1);
+		free(symlink);
+	} else
+		inode = lookup_inode(&buf);
+
+	/* If this is a hard link, the inode will already be set up */
+	if(inode->image == FALSE) {
+		inode->image_file = malloc(sizeof(struct image_file));
+		if(inode->image_file == NULL)
+			MEM_ERROR();
+
+		inode->image_file->source = source;
+		inode->image_file->inode = ref;
+		inode->image = TRUE;
+	}
+
+	return inode;
+}
+
+
+/*
+ * Remove <dir_ent> from <dir>, and free it, and the directory it points to
+ * unless <keep_dir> is set.  Unlinking an entry means searching the list
+ * for its predecessor, and so in directories large enough to have a name
+ * index the entry is instead removed from the index, and marked (our_dir
+ * NULL) to be swept from the list once the directory is complete.  Small
+ * directories are searched by list, and so are unlinked at once
+ */
+static void remove_dir_entry(struct dir_info *dir, struct dir_ent *dir_ent,
+	int keep_dir)
+{
+	if(S_ISDIR(dir_ent->inode->buf.st_mode)) {
+		if(!keep_dir)
+			free_dir(dir_ent->dir);
+		dir->directory_count --;
+	}
+
+	dir->count --;
+
+	if(dir->name_index) {
+		remove_name_index(dir, dir_ent);
+		dir_ent->our_dir = NULL;
+	} else {
+		struct dir_ent *prev = NULL, *cur = dir->list;
+
+		for(; cur != dir_ent; prev = cur, cur = cur->next);
+
+		if(prev)
+			prev->next = dir_ent->next;
+		else
+			dir->list = dir_ent->next;
+
+		free_dir_entry(dir_ent);
+	}
+}
+
+
+/*
+ * Unlink and free the entries marked by remove_dir_entry(), in one pass
+ */
+static void sweep_dir(struct dir_info *dir)
+{
+	struct dir_ent **dir_ent = &dir->list;
+
+	while(*dir_ent) {
+		struct dir_ent *cur = *dir_ent;
+
+		if(cur->our_dir == NULL) {
+			*dir_ent = cur->next;
+			free_dir_entry(cur);
+		} else
+			dir_ent = &cur->next;
+	}
+}
+
+
+/*
+ * When flattening, an entry belongs to an earlier layer if its inode
+ * was read from a different image
+ */
+static inline int lower_entry(struct dir_ent *dir_ent,
+	struct image_source *source)
+{
+	return dir_ent->inode->image_file->source != source;
+}
+
+
+/*
+ * Remove the entry <name> in <dir> if it came from an earlier layer, or if
+ * <name> is NULL all such entries, used to implement whiteouts of single
+ * names, and opaque directories
+ */
+static void whiteout(struct dir_info *dir, struct image_source *source,
+	char *name)
+{
+	struct dir_ent *dir_ent;
+
+	if(name) {
+		dir_ent = lookup_name(dir, name);
+		if(dir_ent && lower_entry(dir_ent, source))
+			remove_dir_entry(dir, dir_ent, FALSE);
+		return;
+	}
+
+	for(dir_ent = dir->list; dir_ent;) {
+		struct dir_ent *next = dir_ent->next;
+
+		if(dir_ent->our_dir && lower_entry(dir_ent, source))
+			remove_dir_entry(dir, dir_ent, FALSE);
+
+		dir_ent = next;
+	}
+}
+
+
+/*
+ * Is the entry an overlayfs style whiteout, a character device with
+ * device number 0/0?
+ */
+static int whiteout_device(struct image_source *source,
+	struct squashfs_read_dirent *ent)
+{
+	struct squashfs_read_stat st;
+
+	if(!S_ISCHR(ent->type))
+		return FALSE;
+
+	if(squashfs_read_stat(source->fs, ent->inode, &st) == -1)
+		BAD_ERROR("Failed to read inode from Squashfs image %s "
+			"because %s\n", source->filename, strerror(errno));
+
+	return st.rdev == 0;
+}
+
+
+/*
+ * Is the directory an overlayfs style opaque directory, which hides the
+ * contents of the directory in earlier layers?
+ */
+static int opaque_dir(struct image_source *source, long long ref)
+{
+	struct squashfs_read_xattr *xattrs;
+	int i, count, opaque = FALSE;
+
+	count = squashfs_read_xattrs(source->fs, ref, &xattrs);
+	if(count == -1)
+		return FALSE;
+
+	for(i = 0; i < count; i++)
+		if(strcmp(xattrs[i].name, OVERLAY_OPAQUE) == 0 &&
+				xattrs[i].vsize == 1 &&
+				*((char *) xattrs[i].value) == 'y')
+			opaque = TRUE;
+
+	squashfs_read_free_xattrs(xattrs, count);
+	return opaque;
+}
+
+
+/*
+ * Does the image directory <ref> contain the opaque whiteout marker?
+ * Directories are sorted, so stop once past where it would be
+ */
+static int opaque_marker(struct image_source *source, long long ref)
+{
+	struct squashfs_read_dirent ent;
+	struct squashfs_read_dir *sdir;
+	int res, cmp = 1;
+
+	sdir = squashfs_read_opendir(source->fs, ref);
+	if(sdir == NULL)
+		BAD_ERROR("Failed to read directory from Squashfs image %s "
+			"because %s\n", source->filename, strerror(errno));
+
+	while((res = squashfs_read_readdir(sdir, &ent)) == 1 &&
+			(cmp = strcmp(ent.name, WHITEOUT_OPAQUE)) < 0);
+
+	if(res == -1)
+		BAD_ERROR("Failed to read directory from Squashfs image %s "
+			"because %s\n", source->filename, strerror(errno));
+
+	squashfs_read_closedir(sdir);
+	return res == 1 && cmp == 0;
+}
+
+
+/*
+ * Add the contents of the image directory <ref> to <dir>, creating <dir>
+ * if it is NULL.  Entries which clash with an existing entry are renamed,
+ * as happens with multiple source directories.  If flattening, the
+ * clashing entry is instead replaced, or merged if both are directories
+ */
+static struct dir_info *add_image_dir(struct dir_info *dir,
+	struct image_source *source, int index, long long ref, char *subpath,
+	struct pathnames *paths, int depth)
+{
+	struct squashfs_read_dirent ent;
+	struct squashfs_read_dir *sdir;
+	int res;
+
+	if(dir == NULL)
+		dir = create_dir("", subpath, depth);
+	else if(image_flatten && opaque_marker(source, ref))
+		/*
+		 * Whiteout the earlier layers before merging, an entry
+		 * sorting before the marker would otherwise be merged
+		 */
+		whiteout(dir, source, NULL);
+
+	sdir = squashfs_read_opendir(source->fs, ref);
+	if(sdir == NULL)
+		BAD_ERROR("Failed to read directory from Squashfs image %s "
+			"because %s\n", source->filename, strerror(errno));
+
+	while((res = squashfs_read_readdir(sdir, &ent)) == 1) {
+		struct pathnames *new = NULL;
+		struct dir_info *sub = NULL;
+		struct dir_ent *dir_ent;
+		struct inode_info *inode;
+		char *name = strdup(ent.name);
+		int pass = 1;
+
+		if(name == NULL)
+			MEM_ERROR();
+
+		if(old_exclude == FALSE && excluded(name, paths, &new)) {
+			dir->excluded ++;
+			free(name);
+			continue;
+		}
+
+		if(image_flatten) {
+			struct dir_ent *old;
+
+			if(strcmp(name, WHITEOUT_OPAQUE) == 0)
+				/* already handled by opaque_marker() */
+				goto skip;
+
+			if(strncmp(name, WHITEOUT_PREFIX,
+					strlen(WHITEOUT_PREFIX)) == 0) {
+				whiteout(dir, source, name +
+						strlen(WHITEOUT_PREFIX));
+				goto skip;
+			}
+
+			if(whiteout_device(source, &ent)) {
+				whiteout(dir, source, name);
+				goto skip;
+			}
+
+			old = lookup_name(dir, name);
+			if(old && S_ISDIR(ent.type) &&
+					S_ISDIR(old->inode->buf.st_mode) &&
+					!opaque_dir(source, ent.inode)) {
+				/*
+				 * Merge the directories, the later layer
+				 * supplies the directory attributes
+				 */
+				sub = old->dir;
+				remove_dir_entry(dir, old, TRUE);
+			} else if(old)
+				remove_dir_entry(dir, old, FALSE);
+		} else while(lookup_name(dir, name)) {
+			ERROR("Source directory entry %s already used! - "
+				"trying ", name);
+			free(name);
+			res = asprintf(&name, "%s_%d", ent.name, pass++);
+			if(res == -1)
+				BAD_ERROR("asprintf failed in add_image_dir\n");
+			ERROR("%s\n", name);
+		}
+
+		dir_ent = create_dir_entry(name, NULL, NULL, dir);
+		free(name);
+		inode = image_inode(source, index, ent.inode);
+
+		if(S_ISDIR(ent.type)) {
+			sub = add_image_dir(sub, source, index, ent.inode,
+				subpathname(dir_ent), new, depth + 1);
+
+			add_dir_entry(dir_ent, sub, inode);
+			dir->directory_count ++;
+		} else
+			add_dir_entry(dir_ent, NULL, inode);
+
+		free(new);
+		continue;
+
+skip:
+		free(name);
+		free(new);
+	}
+
+	if(res == -1)
+		BAD_ERROR("Failed to read directory from Squashfs image %s "
+			"because %s\n", source->filename, strerror(errno));
+
+	squashfs_read_closedir(sdir);
+
+	if(image_flatten && dir->name_index)
+		sweep_dir(dir);
+
+	return dir;
+}
+
+
+squashfs_inode process_image_sources(int progress)
+{
+	struct image_source *image = NULL;
+	struct dir_ent *dir_ent;
+	struct stat buf;
+	int i;
+
+	root_dir = NULL;
+	for(i = 0; i < source; i++) {
+		image = open_image(source_path[i]);
+		root_dir = add_image_dir(root_dir, image, i,
+			squashfs_read_root(image->fs), "", paths, 1);
+	}
+
+	/* Create root directory dir_ent and associated inode, and connect
+	 * it to the root directory dir_info structure */
+	dir_ent = create_dir_entry("", NULL, "", scan1_opendir("", "", 0));
+
+	if(source == 1 || image_flatten) {
+		/*
+		 * Single image, the root directory is the image's root.  If
+		 * flattening, the last layer supplies the root directory
+		 */
+		dir_ent->inode = image_inode(image, source - 1,
+					squashfs_read_root(image->fs));
+	} else {
+		/*
+		 * dummy top level directory, multiple images specified on
+		 * command line
+		 */
+		memset(&buf, 0, sizeof(buf));
+		buf.st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFDIR;
+		buf.st_uid = getuid();
+		buf.st_gid = getgid();
+		buf.st_mtime = time(NULL);
+		dir_ent->inode = lookup_inode(&buf);
+		dir_ent->inode->dummy_root_dir = TRUE;
+	}
+
+	if(root_mode_opt)
+		dir_ent->inode->buf.st_mode = root_mode | S_IFDIR;
+	if(root_uid_opt)
+		dir_ent->inode->buf.st_uid = root_uid;
+	if(root_gid_opt)
+		dir_ent->inode->buf.st_gid = root_gid;
+	if(root_time_opt)
+		dir_ent->inode->buf.st_mtime = root_time;
+
+	dir_ent->dir = root_dir;
+	root_dir->dir_ent = dir_ent;
+
+	return do_directory_scans(dir_ent, progress);
+}
+
+
+#ifdef XATTR_SUPPORT
+int read_xattrs_from_image(struct inode_info *inode,
+	struct xattr_list **xattr_list)
+{
+	struct image_file *file = inode->image_file;
+	struct squashfs_read_xattr *xattrs;
+	struct xattr_list *list;
+	int i, count;
+
+	count = squashfs_read_xattrs(file->source->fs, file->inode, &xattrs);
+	if(count == -1) {
+		ERROR_START("Failed to read xattrs from Squashfs image %s "
+			"because %s", file->source->filename, strerror(errno));
+		ERROR_EXIT(".  Ignoring\n");
+		return 0;
+	}
+
+	if(count == 0)
+		return 0;
+
+	list = malloc(count * sizeof(struct xattr_list));
+	if(list == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < count; i++) {
+		list[i].type = xattr_get_prefix(&list[i], xattrs[i].name);
+		list[i].value = xattrs[i].value;
+		list[i].vsize = xattrs[i].vsize;
+		free(xattrs[i].name);
+	}
+
+	free(xattrs);
+	*xattr_list = list;
+	return count;
+}
+#endif
@@ -0,0 +1,52 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * image.h
+ */
+
+struct image_source {
+	struct squashfs_read_fs	*fs;
+	struct compressor	*comp;
+	char			*filename;
+	unsigned int		block_size;
+	/* compressed data blocks can be copied to the output unchanged */
+	char			verbatim;
+};
+
+struct image_file {
+	struct image_source	*source;
+	long long		inode;
+};
+
+#define IS_IMAGE(a)	(a->image)
+
+extern int image_sources;
+extern int image_flatten;
+extern squashfs_inode process_image_sources(int progress);
+
+#ifdef XATTR_SUPPORT
+extern int xattr_get_prefix(struct xattr_list *, char *);
+extern int read_xattrs_from_image(struct inode_info *, struct xattr_list **);
+#else
+#define read_xattrs_from_image(a, b) 0
+#endif
+#endif
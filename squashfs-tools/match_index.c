@@ -0,0 +1,196 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * match_index.c
+ *
+ * Index of the pathname components at one level of the exclude/extract
+ * trees used by Mksquashfs and Unsquashfs.  Matching a name against every
+ * component with fnmatch() or regexec() costs as much as there are
+ * components, which is slow with exclude files of tens of thousands of
+ * entries.  Most of these are literal names, and these are put into a
+ * hash table, so they're all matched by one lookup of the name.  Only the
+ * real wildcard and regex patterns are left to be matched one by one.
+ *
+ * This is shared by Mksquashfs and Unsquashfs, and so doesn't report errors
+ * itself, failed allocations are returned to the caller.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "match_index.h"
+#include "fnv.h"
+
+#define FALSE 0
+#define TRUE 1
+
+static unsigned int match_hash(char *name, int size)
+{
+	unsigned long long hash = FNV_OFFSET;
+
+	while(*name)
+		hash = FNV_HASH(hash, (unsigned char) *name++);
+
+	return hash & (size - 1);
+}
+
+
+/*
+ * Does pattern literally match one name?  Wildcards and extended
+ * wildcards (+(...) etc.) need one of "*?[(", and a backslash escape is
+ * treated as a pattern too.  Regexes are unanchored, so only ^name$
+ * matches exactly one name
+ */
+static int literal(char *pattern, int type)
+{
+	int len;
+
+	switch(type) {
+	case MATCH_LITERAL:
+		return TRUE;
+	case MATCH_WILDCARD:
+		return strpbrk(pattern, "*?[\\(") == NULL;
+	default:
+		len = strlen(pattern);
+		return len >= 2 && pattern[0] == '^' && pattern[len - 1] == '$'
+			&& strcspn(pattern + 1, ".[]()*+?{}|^$\\") == len - 2;
+	}
+}
+
+
+static void insert_entry(struct match_index *index, char *key, int n)
+{
+	unsigned int i = match_hash(key, index->size);
+
+	for(; index->table[i].key; i = (i + 1) & (index->size - 1));
+
+	index->table[i].key = key;
+	index->table[i].n = n;
+}
+
+
+static int grow_table(struct match_index *index)
+{
+	struct match_entry *old = index->table;
+	int i, old_size = index->size;
+
+	index->size = old_size ? old_size * 2 : 16;
+	index->table = calloc(index->size, sizeof(struct match_entry));
+	if(index->table == NULL)
+		return FALSE;
+
+	for(i = 0; i < old_size; i++)
+		if(old[i].key)
+			insert_entry(index, old[i].key, old[i].n);
+
+	free(old);
+	return TRUE;
+}
+
+
+/*
+ * Create an index for up to patterns patterns.  Returns NULL if out of
+ * memory
+ */
+struct match_index *match_index_create(int patterns)
+{
+	struct match_index *index = malloc(sizeof(struct match_index));
+
+	if(index == NULL)
+		return NULL;
+
+	index->table = NULL;
+	index->size = index->literals = index->wilds = 0;
+	index->wild = malloc(patterns * sizeof(int));
+	if(index->wild == NULL && patterns) {
+		free(index);
+		return NULL;
+	}
+
+	return index;
+}
+
+
+/*
+ * Add pattern, the n'th component.  Patterns must be unique, as they
+ * are in the exclude/extract trees.  Returns FALSE if out of memory
+ */
+int match_index_add(struct match_index *index, char *pattern, int n,
+	int type)
+{
+	char *key;
+
+	if(!literal(pattern, type)) {
+		index->wild[index->wilds ++] = n;
+		return TRUE;
+	}
+
+	/* the name matched by ^name$ */
+	if(type == MATCH_REGEX)
+		key = strndup(pattern + 1, strlen(pattern) - 2);
+	else
+		key = strdup(pattern);
+	if(key == NULL)
+		return FALSE;
+
+	/* keep the table at most 3/4 full */
+	if((index->literals + 1) * 4 > index->size * 3 && !grow_table(index)) {
+		free(key);
+		return FALSE;
+	}
+
+	insert_entry(index, key, n);
+	index->literals ++;
+	return TRUE;
+}
+
+
+/*
+ * Return the literal pattern matching name, or -1 if there isn't one.
+ * The wild patterns still have to be checked by the caller
+ */
+int match_index_lookup(struct match_index *index, char *name)
+{
+	unsigned int i;
+
+	if(index->literals == 0)
+		return -1;
+
+	for(i = match_hash(name, index->size); index->table[i].key;
+				i = (i + 1) & (index->size - 1))
+		if(strcmp(index->table[i].key, name) == 0)
+			return index->table[i].n;
+
+	return -1;
+}
+
+
+void match_index_free(struct match_index *index)
+{
+	int i;
+
+	for(i = 0; i < index->size; i++)
+		free(index->table[i].key);
+
+	free(index->table);
+	free(index->wild);
+	free(index);
+}
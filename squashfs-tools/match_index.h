@@ -0,0 +1,50 @@
+#ifndef MATCH_INDEX_H
+#define MATCH_INDEX_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * match_index.h
+ */
+
+/* how the patterns are matched */
+#define MATCH_LITERAL	0
+#define MATCH_WILDCARD	1
+#define MATCH_REGEX	2
+
+struct match_entry {
+	char	*key;
+	int	n;
+};
+
+struct match_index {
+	/* literal patterns, hashed by the name they match */
+	struct match_entry	*table;
+	int			size;
+	int			literals;
+	/* patterns which have to be matched one by one */
+	int			*wild;
+	int			wilds;
+};
+
+extern struct match_index *match_index_create(int);
+extern int match_index_add(struct match_index *, char *, int, int);
+extern int match_index_lookup(struct match_index *, char *);
+extern void match_index_free(struct match_index *);
+#endif
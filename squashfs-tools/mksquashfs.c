@@ -71,8 +71,13 @@
 #include "read_fs.h"
 #include "restore.h"
 #include "process_fragments.h"
+#include "arena.h"
 #include "fnmatch_compat.h"
 #include "tar.h"
+#include "image.h"
+#include "scanner.h"
+#include "match_index.h"
+#include "fnv.h"
 
 int delete = FALSE;
 int quiet = FALSE;
@@ -84,6 +89,12 @@ int comp_opts = FALSE;
 int no_xattrs = XATTR_DEF;
 int noX = FALSE;
 int duplicate_checking = TRUE;
+
+/*
+ * byte compare duplicate fragments with matching hashes, rather than
+ * relying on the hash (which isn't collision resistant)
+ */
+int fragment_verify = TRUE;
 int noF = FALSE;
 int no_fragments = FALSE;
 int always_use_fragments = FALSE;
@@ -130,7 +141,26 @@ unsigned int cache_bytes = 0, cache_size = 0, inode_count = 0;
 /* inode lookup table */
 squashfs_inode *inode_lookup_table = NULL;
 
-struct inode_info *inode_info[INODE_HASH_SIZE];
+/*
+ * Hardlink table, open addressed and keyed on (st_dev, st_ino).  Only
+ * inodes which can be hardlinked (non-directories) are entered
+ */
+static struct inode_info **hardlink_table = NULL;
+static unsigned int hardlink_table_size = 0, hardlink_table_count = 0;
+
+/* directory entries and (non symlink) inodes are allocated from these */
+static struct pool dir_ent_pool = POOL_INIT(struct dir_ent);
+static struct pool inode_pool = POOL_INIT(struct inode_info);
+
+/* file records kept for duplicate checking */
+static struct pool file_pool = POOL_INIT(struct file_info);
+
+/* report the memory used by the in-memory tree */
+int mem_report = FALSE;
+
+/* spill the in-memory tree to this file, keeping spill_mem resident */
+char *spill_file = NULL;
+long long spill_mem = 1024LL * 1024 * 1024;
 
 /* hash tables used to do fast duplicate searches in duplicate check */
 struct file_info **dupl_frag;
@@ -194,6 +224,15 @@ int block_device = FALSE;
 /* flag indicating whether files are sorted using sort list(s) */
 int sorted = FALSE;
 
+/* read files in the order they're stored on the source disk(s) */
+int physical_read = FALSE;
+
+/* and store them in the filesystem in that order */
+int physical_sort = FALSE;
+
+/* bytes to prefetch ahead of the reader, -1 is the read queue size */
+long long prefetch_size = -1;
+
 /* save destination file name for deleting on error */
 char *destination_file = NULL;
 
@@ -246,6 +285,7 @@ int clamping = TRUE;
 
 /* user options that control parallelisation */
 int processors = -1;
+int pseudo_processes = 0;
 int bwriter_size;
 
 /* compression operations */
@@ -293,13 +333,13 @@ char *option_table[] = { "comp", "b", "mkfs-time", "fstime", "all-time", "root-m
 	"recovery-path", "throttle", "limit", "processors", "mem", "offset",
 	"o", "log", "a", "va", "ta", "fa", "af", "vaf", "taf", "faf",
 	"read-queue", "write-queue", "fragment-queue", "root-time", "root-uid",
-	"root-gid", NULL
+	"root-gid", "spill", "spill-mem", "pseudo-processes", "prefetch", NULL
 };
 
 char *sqfstar_option_table[] = { "comp", "b", "mkfs-time", "fstime", "all-time",
 	"root-mode", "force-uid", "force-gid", "throttle", "limit",
 	"processors", "mem", "offset", "o", "root-time", "root-uid",
-	"root-gid", NULL
+	"root-gid", "spill", "spill-mem", NULL
 };
 
 static char *read_from_disk(long long start, unsigned int avail_bytes);
@@ -323,15 +363,15 @@ static struct dir_ent *scan1_encomp_readdir(struct dir_info *dir);
 static struct file_info *add_non_dup(long long file_size, long long bytes,
 	unsigned int blocks, long long sparse, unsigned int *block_list, long long start,
 	struct fragment *fragment, unsigned short checksum,
-	unsigned short fragment_checksum, int checksum_flag, int checksum_frag_flag,
+	unsigned long long fragment_hash, int checksum_flag, int hash_frag_flag,
 	int blocks_dup, int frag_dup, int bl_hash);
 long long generic_write_table(long long, void *, int, void *, int);
 void restorefs();
 struct dir_info *scan1_opendir(char *pathname, char *subpath, int depth);
 static void write_filesystem_tables(struct squashfs_super_block *sBlk);
-unsigned short get_checksum_mem(char *buff, int bytes);
 static void check_usable_phys_mem(int total_mem);
 static void print_summary();
+static void print_mem_report();
 void write_destination(int fd, long long byte, long long bytes, void *buff);
 
 
@@ -886,7 +926,7 @@ squashfs_inode create_inode(struct dir_info *dir_info,
 	long long start_block, unsigned int offset, unsigned int *block_list,
 	struct fragment *fragment, struct directory *dir_in, long long sparse)
 {
-	struct stat *buf = &dir_ent->inode->buf;
+	struct inode_stat *buf = &dir_ent->inode->buf;
 	union squashfs_inode_header inode_header;
 	struct squashfs_base_inode_header *base = &inode_header.base;
 	void *inode;
@@ -1465,24 +1505,24 @@ finished:
 }
 
 
-static unsigned short get_fragment_checksum(struct file_info *file)
+static unsigned long long get_fragment_hash(struct file_info *file)
 {
 	struct file_buffer *frag_buffer;
 	struct append_file *append;
 	int res, index = file->fragment->index;
-	unsigned short checksum;
+	unsigned long long hash;
 
 	if(index == SQUASHFS_INVALID_FRAG)
 		return 0;
 
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &dup_mutex);
 	pthread_mutex_lock(&dup_mutex);
-	res = file->have_frag_checksum;
-	checksum = file->fragment_checksum;
+	res = file->have_frag_hash;
+	hash = file->fragment_hash;
 	pthread_cleanup_pop(1);
 
 	if(res)
-		return checksum;
+		return hash;
 
 	frag_buffer = get_fragment(file->fragment);
 
@@ -1491,22 +1531,49 @@ static unsigned short get_fragment_checksum(struct file_info *file)
 	for(append = file_mapping[index]; append; append = append->next) {
 		int offset = append->file->fragment->offset;
 		int size = append->file->fragment->size;
-		unsigned short cksum =
-			get_checksum_mem(frag_buffer->data + offset, size);
+		unsigned long long fhash =
+			get_hash_mem(frag_buffer->data + offset, size);
 
 		if(file == append->file)
-			checksum = cksum;
+			hash = fhash;
 
 		pthread_mutex_lock(&dup_mutex);
-		append->file->fragment_checksum = cksum;
-		append->file->have_frag_checksum = TRUE;
+		append->file->fragment_hash = fhash;
+		append->file->have_frag_hash = TRUE;
 		pthread_mutex_unlock(&dup_mutex);
 	}
 
 	cache_block_put(frag_buffer);
 	pthread_cleanup_pop(0);
 
-	return checksum;
+	return hash;
+}
+
+
+/*
+ * Check whether the fragment of <file> is a duplicate of the fragment data
+ * in <buffer>.  The fragment hashes rule out non-matching fragments, and the
+ * fragment block is only read and decompressed to byte compare fragments
+ * with matching hashes.  With -no-fragment-verify the hash decides
+ */
+static int fragment_matches(struct file_info *file, struct file_buffer *buffer)
+{
+	struct file_buffer *frag_buffer;
+	int res;
+
+	if(buffer->size != file->fragment->size ||
+				buffer->hash != get_fragment_hash(file))
+		return FALSE;
+
+	if(!fragment_verify)
+		return TRUE;
+
+	frag_buffer = get_fragment(file->fragment);
+	res = memcmp(buffer->data, frag_buffer->data + file->fragment->offset,
+		buffer->size);
+	cache_block_put(frag_buffer);
+
+	return res == 0;
 }
 
 
@@ -1819,9 +1886,18 @@ static unsigned short get_checksum_disk(long long start, long long l,
 }
 
 
-unsigned short get_checksum_mem(char *buff, int bytes)
+/*
+ * Compute 64 bit fragment hash over the data
+ */
+unsigned long long get_hash_mem(char *buff, int bytes)
 {
-	return get_checksum(buff, bytes, 0);
+	unsigned char *b = (unsigned char *) buff;
+	unsigned long long hash = FNV_OFFSET;
+
+	while(bytes --)
+		hash = FNV_HASH(hash, *b++);
+
+	return hash;
 }
 
 
@@ -1843,8 +1919,10 @@ void add_file(long long start, long long file_size, long long file_bytes,
 	int blocks_dup = FALSE, frag_dup = FALSE;
 	int bl_hash = 0;
 
-	if(!duplicate_checking || file_size == 0)
+	if(!duplicate_checking || file_size == 0) {
+		free(block_list);
 		return;
+	}
 
 	if(blocks) {
 		bl_hash = block_hash(block_list[0], blocks);
@@ -1858,13 +1936,17 @@ void add_file(long long start, long long file_size, long long file_bytes,
 		if(dupl_ptr) {
 			/* Our blocks have already been added. If we don't
 			 * have a fragment, then we've finished checking  */
-			if(fragment == SQUASHFS_INVALID_FRAG)
+			if(fragment == SQUASHFS_INVALID_FRAG) {
+				free(block_list);
 				return;
+			}
 
 			/* This entry probably created both the blocks and
 			 * the tail-end fragment, and so check for that */
-			if((fragment == dupl_ptr->fragment->index) && (offset == dupl_ptr->fragment->offset) && (bytes == dupl_ptr->fragment->size))
+			if((fragment == dupl_ptr->fragment->index) && (offset == dupl_ptr->fragment->offset) && (bytes == dupl_ptr->fragment->size)) {
+				free(block_list);
 				return;
+			}
 
 			/* Remember our blocks are duplicate, and continue
 			 * looking for the tail-end fragment */
@@ -1882,8 +1964,10 @@ void add_file(long long start, long long file_size, long long file_bytes,
 		if(dupl_ptr) {
 			/* Our tail-end fragment entry has already been added.
 			 * If there's no blocks or they're dup, then we're done here */
-			if(blocks == 0 || blocks_dup)
+			if(blocks == 0 || blocks_dup) {
+				free(block_list);
 				return;
+			}
 
 			/* Remember our tail-end fragment entry is duplicate */
 			frag_dup = TRUE;
@@ -1950,8 +2034,8 @@ static int pre_duplicate(long long file_size, struct inode_info *inode, struct f
 static struct file_info *create_non_dup(long long file_size, long long bytes,
 	unsigned int blocks, long long sparse, unsigned int *block_list,
 	long long start,struct fragment *fragment,unsigned short checksum,
-	unsigned short fragment_checksum, int checksum_flag,
-	int checksum_frag_flag)
+	unsigned long long fragment_hash, int checksum_flag,
+	int hash_frag_flag)
 {
 	struct file_info *dupl_ptr = malloc(sizeof(struct file_info));
 
@@ -1966,8 +2050,8 @@ static struct file_info *create_non_dup(long long file_size, long long bytes,
 	dupl_ptr->start = start;
 	dupl_ptr->fragment = fragment;
 	dupl_ptr->checksum = checksum;
-	dupl_ptr->fragment_checksum = fragment_checksum;
-	dupl_ptr->have_frag_checksum = checksum_frag_flag;
+	dupl_ptr->fragment_hash = fragment_hash;
+	dupl_ptr->have_frag_hash = hash_frag_flag;
 	dupl_ptr->have_checksum = checksum_flag;
 	dupl_ptr->block_next = NULL;
 	dupl_ptr->frag_next = NULL;
@@ -1980,25 +2064,26 @@ static struct file_info *create_non_dup(long long file_size, long long bytes,
 static struct file_info *add_non_dup(long long file_size, long long bytes,
 	unsigned int blocks, long long sparse, unsigned int *block_list,
 	long long start,struct fragment *fragment,unsigned short checksum,
-	unsigned short fragment_checksum, int checksum_flag,
-	int checksum_frag_flag, int blocks_dup, int frag_dup, int bl_hash)
+	unsigned long long fragment_hash, int checksum_flag,
+	int hash_frag_flag, int blocks_dup, int frag_dup, int bl_hash)
 {
-	struct file_info *dupl_ptr = malloc(sizeof(struct file_info));
+	struct file_info *dupl_ptr = pool_alloc(&file_pool);
 	int fragment_size = fragment->size;
 
-	if(dupl_ptr == NULL)
-		MEM_ERROR();
+	/* This lives until the filesystem is written, move the block list into
+	 * the slab */
+	dupl_ptr->block_list = slab_block_list(block_list, blocks);
+	free(block_list);
 
 	dupl_ptr->file_size = file_size;
 	dupl_ptr->bytes = bytes;
 	dupl_ptr->blocks = blocks;
 	dupl_ptr->sparse = sparse;
-	dupl_ptr->block_list = block_list;
 	dupl_ptr->start = start;
 	dupl_ptr->fragment = fragment;
 	dupl_ptr->checksum = checksum;
-	dupl_ptr->fragment_checksum = fragment_checksum;
-	dupl_ptr->have_frag_checksum = checksum_frag_flag;
+	dupl_ptr->fragment_hash = fragment_hash;
+	dupl_ptr->have_frag_hash = hash_frag_flag;
 	dupl_ptr->have_checksum = checksum_flag;
 	dupl_ptr->block_next = NULL;
 	dupl_ptr->frag_next = NULL;
@@ -2028,27 +2113,16 @@ static struct file_info *add_non_dup(long long file_size, long long bytes,
 static struct file_info *frag_duplicate(struct file_buffer *file_buffer, int *duplicate)
 {
 	struct file_info *dupl_ptr;
-	struct file_buffer *buffer;
 	struct file_info *dupl_start = file_buffer->dupl_start;
 	long long file_size = file_buffer->file_size;
-	unsigned short checksum = file_buffer->checksum;
-	int res;
+	unsigned long long hash = file_buffer->hash;
 
 	if(file_buffer->duplicate)
 		dupl_ptr = dupl_start;
 	else {
-		for(dupl_ptr = dupl_frag[file_size]; dupl_ptr && dupl_ptr != dupl_start; dupl_ptr = dupl_ptr->frag_next) {
-			if(file_size == dupl_ptr->fragment->size) {
-				if(get_fragment_checksum(dupl_ptr) == checksum) {
-					buffer = get_fragment(dupl_ptr->fragment);
-					res = memcmp(file_buffer->data, buffer->data +
-						dupl_ptr->fragment->offset, file_size);
-					cache_block_put(buffer);
-					if(res == 0)
-						break;
-				}
-			}
-		}
+		for(dupl_ptr = dupl_frag[file_size]; dupl_ptr && dupl_ptr != dupl_start; dupl_ptr = dupl_ptr->frag_next)
+			if(fragment_matches(dupl_ptr, file_buffer))
+				break;
 
 		if(!dupl_ptr || dupl_ptr == dupl_start) {
 			*duplicate = FALSE;
@@ -2059,8 +2133,8 @@ static struct file_info *frag_duplicate(struct file_buffer *file_buffer, int *du
 	if(dupl_ptr->file_size == file_size) {
 		/* File only has a fragment, and so this is an exact match */
 		TRACE("Found duplicate file, fragment %u, size %d, offset %d, "
-			"checksum 0x%x\n", dupl_ptr->fragment->index, file_size,
-			dupl_ptr->fragment->offset, checksum);
+			"hash 0x%llx\n", dupl_ptr->fragment->index, file_size,
+			dupl_ptr->fragment->offset, hash);
 		*duplicate = TRUE;
 		return dupl_ptr;
 	} else {
@@ -2079,7 +2153,7 @@ static struct file_info *frag_duplicate(struct file_buffer *file_buffer, int *du
 		if(dup == NULL)
 			MEM_ERROR();
 
-		dup->file = create_non_dup(file_size, 0, 0, 0, NULL, 0, dupl_ptr->fragment, 0, checksum, TRUE, TRUE);
+		dup->file = create_non_dup(file_size, 0, 0, 0, NULL, 0, dupl_ptr->fragment, 0, hash, TRUE, TRUE);
 		dup->next = NULL;
 		dupl_ptr->dup = dup;
 		*duplicate = FALSE;
@@ -2095,8 +2169,7 @@ static struct file_info *duplicate(int *dupf, int *block_dup, long long file_siz
 	struct file_info *dupl_ptr, *block_dupl = NULL, *frag_dupl = NULL, *file;
 	struct dup_info *dup;
 	int frag_bytes = file_buffer ? file_buffer->size : 0;
-	unsigned short fragment_checksum = file_buffer ?
-		file_buffer->checksum : 0;
+	unsigned long long fragment_hash = file_buffer ? file_buffer->hash : 0;
 	unsigned short checksum = 0;
 	char checksum_flag = FALSE;
 	struct fragment *fragment;
@@ -2213,19 +2286,11 @@ static struct file_info *duplicate(int *dupf, int *block_dup, long long file_siz
 			 * has a matching tail-end fragment (i.e. it is a completely
 			 * duplicate file).  So save time and have a look now.
 			 */
-			if(frag_bytes == dupl_ptr->fragment->size && fragment_checksum == get_fragment_checksum(dupl_ptr)) {
-				/* Checksums match, so now we need to do a byte by byte comparison */
-				struct file_buffer *frag_buffer = get_fragment(dupl_ptr->fragment);
-				int res = memcmp(file_buffer->data, frag_buffer->data + dupl_ptr->fragment->offset, frag_bytes);
-
-				cache_block_put(frag_buffer);
-
-				if(res == 0) {
-					/* Yes, the fragment matches.  We're now finished.
-					 * Return the duplicate */
-					*dupf = *block_dup = TRUE;
-					return dupl_ptr;
-				}
+			if(frag_bytes && fragment_matches(dupl_ptr, file_buffer)) {
+				/* Yes, the fragment matches.  We're now finished.
+				 * Return the duplicate */
+				*dupf = *block_dup = TRUE;
+				return dupl_ptr;
 			}
 
 			/* No, the fragment didn't match.  Remember the file with
@@ -2239,27 +2304,19 @@ static struct file_info *duplicate(int *dupf, int *block_dup, long long file_siz
 	/* Look for a possible duplicate fragment */
 	if(frag_bytes) {
 		for(dupl_ptr = dupl_frag[frag_bytes]; dupl_ptr; dupl_ptr = dupl_ptr->frag_next) {
-			if(frag_bytes == dupl_ptr->fragment->size && fragment_checksum == get_fragment_checksum(dupl_ptr)) {
-				/* Checksums match, so now we need to do a byte by byte comparison */
-				struct file_buffer *frag_buffer = get_fragment(dupl_ptr->fragment);
-				int res = memcmp(file_buffer->data, frag_buffer->data + dupl_ptr->fragment->offset, frag_bytes);
-
-				cache_block_put(frag_buffer);
-
-				if(res == 0) {
-					/* Yes, the fragment matches.  This file may have
-					 * a matching block list and fragment, in which case
-					 * we're finished. */
-					if(block_dupl && block_dupl->start == dupl_ptr->start) {
-						*dupf = *block_dup = TRUE;
-						return dupl_ptr;
-					}
-
-					/* Block list doesn't match.  We can construct a hybrid
-					 * from these two partially matching files */
-					frag_dupl = dupl_ptr;
-					break;
+			if(fragment_matches(dupl_ptr, file_buffer)) {
+				/* Yes, the fragment matches.  This file may have
+				 * a matching block list and fragment, in which case
+				 * we're finished. */
+				if(block_dupl && block_dupl->start == dupl_ptr->start) {
+					*dupf = *block_dup = TRUE;
+					return dupl_ptr;
 				}
+
+				/* Block list doesn't match.  We can construct a hybrid
+				 * from these two partially matching files */
+				frag_dupl = dupl_ptr;
+				break;
 			}
 		}
 	}
@@ -2271,7 +2328,7 @@ static struct file_info *duplicate(int *dupf, int *block_dup, long long file_siz
 		fragment = get_and_fill_fragment(file_buffer, dir_ent, TRUE);
 
 		return add_non_dup(file_size, bytes, blocks, sparse, block_list, start, fragment, checksum,
-			fragment_checksum, checksum_flag, file_buffer != NULL, FALSE, FALSE, bl_hash);
+			fragment_hash, checksum_flag, file_buffer != NULL, FALSE, FALSE, bl_hash);
 	}
 
 	/* At this point, we may have
@@ -2316,13 +2373,18 @@ static struct file_info *duplicate(int *dupf, int *block_dup, long long file_siz
 	if(block_dupl) {
 		start = block_dupl->start;
 		block_list = block_dupl->block_list;
+	} else {
+		unsigned int *slab = slab_block_list(block_list, blocks);
+
+		free(block_list);
+		block_list = slab;
 	}
 
 	*dupf = FALSE;
 	*block_dup = block_dupl != NULL;
 
 	file = create_non_dup(file_size, bytes, blocks, sparse, block_list, start, fragment, checksum,
-		fragment_checksum, checksum_flag, file_buffer != NULL);
+		fragment_hash, checksum_flag, file_buffer != NULL);
 
 	if(!block_dupl || (frag_bytes && !frag_dupl)) {
 		/* Partial duplicate, had to store some extra data for this file,
@@ -2418,23 +2480,55 @@ static void *deflator(void *arg)
 {
 	struct file_buffer *write_buffer = cache_get_nohash(bwriter_buffer);
 	void *stream = NULL;
+	char *buffer = NULL;
 	int res;
 
 	res = compressor_init(comp, &stream, block_size, 1);
 	if(res)
 		BAD_ERROR("deflator:: compressor_init failed\n");
 
+	if(image_sources) {
+		buffer = malloc(block_size);
+		if(buffer == NULL)
+			MEM_ERROR();
+	}
+
 	while(1) {
 		struct file_buffer *file_buffer = queue_get(to_deflate);
 
-		if(sparse_files && all_zero(file_buffer)) { 
+		if(file_buffer->transcode) {
+			/* Compressed block read from a Squashfs image source,
+			 * decompress it before recompressing */
+			int error;
+
+			res = compressor_uncompress(file_buffer->image_comp,
+				buffer, file_buffer->data, file_buffer->size,
+				block_size, &error);
+			if(res != file_buffer->c_byte)
+				BAD_ERROR("deflator:: failed to decompress block "
+					"from Squashfs image, image corrupt?\n");
+
+			memcpy(file_buffer->data, buffer, res);
+			file_buffer->size = res;
+			file_buffer->transcode = FALSE;
+		}
+
+		if(!file_buffer->verbatim && sparse_files &&
+						all_zero(file_buffer)) { 
 			file_buffer->c_byte = 0;
 			seq_queue_put(to_main, file_buffer);
 		} else {
-			write_buffer->c_byte = mangle2(stream,
-				write_buffer->data, file_buffer->data,
-				file_buffer->size, block_size,
-				file_buffer->noD, 1);
+			if(file_buffer->verbatim) {
+				/* Block read from a Squashfs image source,
+				 * already compressed by the same compressor */
+				memcpy(write_buffer->data, file_buffer->data,
+					file_buffer->size);
+				write_buffer->c_byte = file_buffer->c_byte;
+			} else
+				write_buffer->c_byte = mangle2(stream,
+					write_buffer->data, file_buffer->data,
+					file_buffer->size, block_size,
+					file_buffer->noD, 1);
 			write_buffer->sequence = file_buffer->sequence;
 			write_buffer->file_size = file_buffer->file_size;
 			write_buffer->block = file_buffer->block;
@@ -2574,7 +2668,7 @@ static struct file_info *write_file_frag(struct dir_ent *dir_ent,
 {
 	int size = file_buffer->file_size;
 	struct fragment *fragment;
-	unsigned short checksum = file_buffer->checksum;
+	unsigned long long hash = file_buffer->hash;
 	struct file_info *file;
 
 	file = frag_duplicate(file_buffer, duplicate_file);
@@ -2582,10 +2676,10 @@ static struct file_info *write_file_frag(struct dir_ent *dir_ent,
 		fragment = get_and_fill_fragment(file_buffer, dir_ent, FALSE);
 
 		if(duplicate_checking)
-			file = add_non_dup(size, 0, 0, 0, NULL, 0, fragment, 0, checksum,
+			file = add_non_dup(size, 0, 0, 0, NULL, 0, fragment, 0, hash,
 				TRUE, TRUE, FALSE, FALSE, 0);
 		else
-			file = create_non_dup(size, 0, 0, 0, NULL, 0, fragment, 0, checksum,
+			file = create_non_dup(size, 0, 0, 0, NULL, 0, fragment, 0, hash,
 				TRUE, TRUE);
 	}
 
@@ -2669,11 +2763,11 @@ static struct file_info *write_file_process(int *status, struct dir_ent *dir_ent
 		int bl_hash = block ? block_hash(block_list[0], block) : 0;
 
 		file = add_non_dup(read_size, file_bytes, block, sparse, block_list, start, fragment,
-			0, fragment_buffer ? fragment_buffer->checksum : 0,
+			0, fragment_buffer ? fragment_buffer->hash : 0,
 			FALSE, TRUE, FALSE, FALSE, bl_hash);
 	} else
 		file = create_non_dup(read_size, file_bytes, block, sparse, block_list, start, fragment,
-			0, fragment_buffer ? fragment_buffer->checksum : 0,
+			0, fragment_buffer ? fragment_buffer->hash : 0,
 			FALSE, TRUE);
 
 	cache_block_put(fragment_buffer);
@@ -2924,11 +3018,11 @@ static struct file_info *write_file_blocks(int *status, struct dir_ent *dir_ent,
 
 	if(duplicate_checking)
 		file = add_non_dup(read_size, file_bytes, blocks, sparse, block_list,
-			start, fragment, 0, fragment_buffer ? fragment_buffer->checksum : 0,
+			start, fragment, 0, fragment_buffer ? fragment_buffer->hash : 0,
 			FALSE, TRUE, FALSE, FALSE, bl_hash);
 	else
 		file = create_non_dup(read_size, file_bytes, blocks, sparse, block_list, start, fragment,
-			0, fragment_buffer ? fragment_buffer->checksum : 0, FALSE, TRUE);
+			0, fragment_buffer ? fragment_buffer->hash : 0, FALSE, TRUE);
 
 	cache_block_put(fragment_buffer);
 	file_count ++;
@@ -3073,6 +3167,77 @@ static char *basename_r()
 }
 
 
+static inline unsigned int inode_hash(unsigned long long dev,
+	unsigned long long ino)
+{
+	unsigned long long hash = (ino ^ (dev * 0x9e3779b97f4a7c15ULL)) *
+							0xbf58476d1ce4e5b9ULL;
+
+	return (hash ^ (hash >> 31)) & (hardlink_table_size - 1);
+}
+
+
+static void insert_inode(struct inode_info *inode)
+{
+	unsigned int i = inode_hash(inode->buf.st_dev, inode->buf.st_ino);
+
+	while(hardlink_table[i])
+		i = (i + 1) & (hardlink_table_size - 1);
+
+	hardlink_table[i] = inode;
+}
+
+
+static void grow_hardlink_table()
+{
+	struct inode_info **old = hardlink_table;
+	unsigned int i, size = hardlink_table_size;
+
+	hardlink_table_size = size ? size * 2 : HARDLINK_TABLE_SIZE;
+	hardlink_table = calloc(hardlink_table_size, sizeof(struct inode_info *));
+	if(hardlink_table == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < size; i++)
+		if(old[i])
+			insert_inode(old[i]);
+
+	free(old);
+}
+
+
+/*
+ * Remove inode from the hardlink table.  With linear probing a slot can't
+ * simply be emptied, the entries after it in the run which hash at or
+ * before it are moved back to fill the gap
+ */
+static void remove_inode(struct inode_info *inode)
+{
+	unsigned int mask = hardlink_table_size - 1;
+	unsigned int i = inode_hash(inode->buf.st_dev, inode->buf.st_ino), j;
+
+	while(hardlink_table[i] != inode)
+		i = (i + 1) & mask;
+
+	hardlink_table[i] = NULL;
+
+	for(j = (i + 1) & mask; hardlink_table[j]; j = (j + 1) & mask) {
+		unsigned int k = inode_hash(hardlink_table[j]->buf.st_dev,
+						hardlink_table[j]->buf.st_ino);
+
+		/* can the entry at j move to i, that is, is k not
+		 * cyclically in (i, j] */
+		if(i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			hardlink_table[i] = hardlink_table[j];
+			hardlink_table[j] = NULL;
+			i = j;
+		}
+	}
+
+	hardlink_table_count --;
+}
+
+
 static inline void dec_nlink_inode(struct dir_ent *dir_ent)
 {
 	if(dir_ent->inode == NULL || dir_ent->inode->root_entry)
@@ -3081,40 +3246,73 @@ static inline void dec_nlink_inode(struct dir_ent *dir_ent)
 	if(dir_ent->inode->nlink == 1) {
 		/* Delete this inode, as the last or only reference
 		 * to it is going away */
-		struct stat *buf = &dir_ent->inode->buf;
-		int ino_hash = INODE_HASH(buf->st_dev, buf->st_ino);
-		struct inode_info *inode = inode_info[ino_hash];
-		struct inode_info *prev = NULL;
-
-		while(inode && inode != dir_ent->inode) {
-			prev = inode;
-			inode = inode->next;
-		}
+		struct inode_stat *buf = &dir_ent->inode->buf;
 
-		if(inode) {
-			if(prev)
-				prev->next = inode->next;
-			else
-				inode_info[ino_hash] = inode->next;
-		}
+		if(dir_ent->inode->hashed)
+			remove_inode(dir_ent->inode);
 
 		/* Decrement the progress bar */
 		if((buf->st_mode & S_IFMT) == S_IFREG)
 			progress_bar_size(-((buf->st_size + block_size - 1)
 								 >> block_log));
 
-		free(dir_ent->inode);
+		if(dir_ent->inode->pooled)
+			pool_free(&inode_pool, dir_ent->inode);
+		else
+			free(dir_ent->inode);
 		dir_ent->inode = NULL;
 	} else
 		dir_ent->inode->nlink --;
 }
 
 
-static struct inode_info *lookup_inode3(struct stat *buf, struct pseudo_dev *pseudo,
+/*
+ * Inodes with a symlink are malloced, the rest come from inode_pool
+ */
+struct inode_info *alloc_inode(int bytes)
+{
+	struct inode_info *inode;
+
+	if(bytes == 0) {
+		inode = pool_alloc(&inode_pool);
+		inode->pooled = TRUE;
+		return inode;
+	}
+
+	inode = malloc(sizeof(struct inode_info) + bytes);
+	if(inode == NULL)
+		MEM_ERROR();
+
+	inode->pooled = FALSE;
+	return inode;
+}
+
+
+void get_inode_stat(struct inode_stat *dest, struct stat *buf)
+{
+	memset(dest, 0, sizeof(struct inode_stat));
+	dest->st_dev = buf->st_dev;
+	dest->st_ino = buf->st_ino;
+	dest->st_rdev = buf->st_rdev;
+	dest->st_size = buf->st_size;
+	dest->st_blocks = buf->st_blocks;
+	dest->st_mtime = buf->st_mtime;
+	dest->st_mode = buf->st_mode;
+	dest->st_uid = buf->st_uid;
+	dest->st_gid = buf->st_gid;
+	dest->st_nlink = buf->st_nlink;
+}
+
+
+struct inode_info *lookup_inode3(struct stat *statbuf, struct pseudo_dev *pseudo,
 	char *symlink, int bytes)
 {
-	int ino_hash = INODE_HASH(buf->st_dev, buf->st_ino);
+	struct inode_stat stat, *buf = &stat;
 	struct inode_info *inode;
+	int hashed;
+	unsigned int i;
+
+	get_inode_stat(buf, statbuf);
 
 	/*
 	 * Look-up inode in hash table, if it already exists we have a
@@ -3122,9 +3320,15 @@ static struct inode_info *lookup_inode3(struct stat *buf, struct pseudo_dev *pse
 	 * Don't do the look-up for directories because Unix/Linux doesn't
 	 * allow hard-links to directories.
 	 */
-	if ((buf->st_mode & S_IFMT) != S_IFDIR && !no_hardlinks) {
-		for(inode = inode_info[ino_hash]; inode; inode = inode->next) {
-			if(memcmp(buf, &inode->buf, sizeof(struct stat)) == 0) {
+	hashed = (buf->st_mode & S_IFMT) != S_IFDIR && !no_hardlinks;
+	if(hashed) {
+		if(hardlink_table_count * 4 >= hardlink_table_size * 3)
+			grow_hardlink_table();
+
+		i = inode_hash(buf->st_dev, buf->st_ino);
+		for(; hardlink_table[i]; i = (i + 1) & (hardlink_table_size - 1)) {
+			inode = hardlink_table[i];
+			if(memcmp(buf, &inode->buf, sizeof(struct inode_stat)) == 0) {
 				inode->nlink ++;
 				return inode;
 			}
@@ -3135,13 +3339,10 @@ static struct inode_info *lookup_inode3(struct stat *buf, struct pseudo_dev *pse
 		progress_bar_size((buf->st_size + block_size - 1)
 							 >> block_log);
 
-	inode = malloc(sizeof(struct inode_info) + bytes);
-	if(inode == NULL)
-		MEM_ERROR();
-
+	inode = alloc_inode(bytes);
 	if(bytes)
 		memcpy(&inode->symlink, symlink, bytes);
-	memcpy(&inode->buf, buf, sizeof(struct stat));
+	inode->buf = *buf;
 	inode->read = FALSE;
 	inode->root_entry = FALSE;
 	inode->pseudo = pseudo;
@@ -3150,6 +3351,11 @@ static struct inode_info *lookup_inode3(struct stat *buf, struct pseudo_dev *pse
 	inode->inode_number = 0;
 	inode->dummy_root_dir = FALSE;
 	inode->tarfile = FALSE;
+	inode->image = FALSE;
+	inode->image_file = NULL;
+	inode->xattr_list = NULL;
+	inode->xattrs = -1;
+	inode->physical = 0;
 
 	/*
 	 * Copy filesystem wide defaults into inode, these filesystem
@@ -3161,9 +3367,13 @@ static struct inode_info *lookup_inode3(struct stat *buf, struct pseudo_dev *pse
 	inode->always_use_fragments = always_use_fragments;
 	inode->noD = noD;
 	inode->noF = noF;
+	inode->hashed = hashed;
 
-	inode->next = inode_info[ino_hash];
-	inode_info[ino_hash] = inode;
+	if(hashed) {
+		/* i is the empty slot the look-up finished at */
+		hardlink_table[i] = inode;
+		hardlink_table_count ++;
+	}
 
 	return inode;
 }
@@ -3205,18 +3415,158 @@ struct dir_info *create_dir(char *pathname, char *subpath, int depth)
 	dir->list = NULL;
 	dir->depth = depth;
 	dir->excluded = 0;
+	dir->name_index = NULL;
+	dir->name_index_size = 0;
 
 	return dir;
 }
 
 
+static inline unsigned int name_hash(struct dir_info *dir, char *name)
+{
+	unsigned long long hash = FNV_OFFSET;
+
+	while(*name)
+		hash = FNV_HASH(hash, (unsigned char) *name++);
+
+	return hash & (dir->name_index_size - 1);
+}
+
+
+/*
+ * Every entry is indexed, including entries with the same name.  Those are
+ * kept in the order they were inserted, most recent first, so a lookup
+ * finds the same entry as a search of the list, and removing it exposes
+ * the entry it hid
+ */
+static void insert_name(struct dir_info *dir, struct dir_ent *dir_ent)
+{
+	unsigned int i = name_hash(dir, dir_ent->name);
+
+	for(; dir->name_index[i]; i = (i + 1) & (dir->name_index_size - 1))
+		if(strcmp(dir->name_index[i]->name, dir_ent->name) == 0) {
+			struct dir_ent *older = dir->name_index[i];
+
+			dir->name_index[i] = dir_ent;
+			dir_ent = older;
+		}
+
+	dir->name_index[i] = dir_ent;
+}
+
+
+/*
+ * (Re)build the name index of dir, sized for at least twice the number of
+ * entries.  The entries are inserted in reverse list order, so the first
+ * of any duplicate names in the list is found first
+ */
+static void build_name_index(struct dir_info *dir, unsigned int count)
+{
+	struct dir_ent *dir_ent, **ents;
+	unsigned int i;
+
+	for(dir->name_index_size = NAME_INDEX_THRESHOLD * 2;
+			dir->name_index_size < count * 2;
+			dir->name_index_size *= 2);
+
+	free(dir->name_index);
+	dir->name_index = calloc(dir->name_index_size, sizeof(struct dir_ent *));
+	ents = malloc(dir->count * sizeof(struct dir_ent *));
+	if(dir->name_index == NULL || ents == NULL)
+		MEM_ERROR();
+
+	for(i = 0, dir_ent = dir->list; dir_ent; dir_ent = dir_ent->next)
+		ents[i++] = dir_ent;
+	while(i)
+		insert_name(dir, ents[--i]);
+	free(ents);
+}
+
+
+/*
+ * Add dir_ent to the name index of dir, if it has one.  Called whenever an
+ * entry is added to the list, or an entry in the list is renamed
+ */
+void add_name_index(struct dir_info *dir, struct dir_ent *dir_ent)
+{
+	if(dir->name_index == NULL)
+		return;
+
+	if(dir->count * 4 > dir->name_index_size * 3)
+		build_name_index(dir, dir->count);
+
+	insert_name(dir, dir_ent);
+}
+
+
+/*
+ * Remove dir_ent from the name index of dir, if it has one.  As with the
+ * hardlink table the run after the emptied slot is shifted back to fill
+ * the gap.  Called before an entry is removed from the list, or renamed
+ */
+void remove_name_index(struct dir_info *dir, struct dir_ent *dir_ent)
+{
+	unsigned int mask = dir->name_index_size - 1, i, j;
+
+	if(dir->name_index == NULL)
+		return;
+
+	for(i = name_hash(dir, dir_ent->name); dir->name_index[i] != dir_ent;
+							i = (i + 1) & mask)
+		if(dir->name_index[i] == NULL)
+			BAD_ERROR("remove_name_index: entry not in index\n");
+
+	dir->name_index[i] = NULL;
+
+	for(j = (i + 1) & mask; dir->name_index[j]; j = (j + 1) & mask) {
+		unsigned int k = name_hash(dir, dir->name_index[j]->name);
+
+		if(i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			dir->name_index[i] = dir->name_index[j];
+			dir->name_index[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+
+void free_name_index(struct dir_info *dir)
+{
+	free(dir->name_index);
+	dir->name_index = NULL;
+	dir->name_index_size = 0;
+}
+
+
+/*
+ * Look up name in dir.  Small directories are searched linearly, but adding
+ * n entries to a directory, checking each isn't already there, is O(n^2),
+ * and so once a directory reaches NAME_INDEX_THRESHOLD entries it gets a
+ * hash index, which is then kept up to date as entries are added and
+ * removed.  The list is unaffected, so sort_directory() etc. work as before
+ */
 struct dir_ent *lookup_name(struct dir_info *dir, char *name)
 {
-	struct dir_ent *dir_ent = dir->list;
+	struct dir_ent *dir_ent;
+	unsigned int i;
 
-	for(; dir_ent && strcmp(dir_ent->name, name) != 0;
+	if(dir->name_index == NULL) {
+		if(dir->count < NAME_INDEX_THRESHOLD) {
+			for(dir_ent = dir->list; dir_ent &&
+					strcmp(dir_ent->name, name) != 0;
 					dir_ent = dir_ent->next);
 
+			return dir_ent;
+		}
+
+		build_name_index(dir, dir->count);
+	}
+
+	for(i = name_hash(dir, name); (dir_ent = dir->name_index[i]);
+				i = (i + 1) & (dir->name_index_size - 1))
+		if(strcmp(dir_ent->name, name) == 0)
+			break;
+
 	return dir_ent;
 }
 
@@ -3224,11 +3574,9 @@ struct dir_ent *lookup_name(struct dir_info *dir, char *name)
 struct dir_ent *create_dir_entry(char *name, char *source_name,
 	char *nonstandard_pathname, struct dir_info *dir)
 {
-	struct dir_ent *dir_ent = malloc(sizeof(struct dir_ent));
-	if(dir_ent == NULL)
-		MEM_ERROR();
+	struct dir_ent *dir_ent = pool_alloc(&dir_ent_pool);
 
-	dir_ent->name = name;
+	dir_ent->name = intern_name(name);
 	dir_ent->source_name = source_name;
 	dir_ent->nonstandard_pathname = nonstandard_pathname;
 	dir_ent->our_dir = dir;
@@ -3252,6 +3600,7 @@ void add_dir_entry(struct dir_ent *dir_ent, struct dir_info *sub_dir,
 	dir_ent->next = dir->list;
 	dir->list = dir_ent;
 	dir->count++;
+	add_name_index(dir, dir_ent);
 }
 
 
@@ -3269,9 +3618,6 @@ static inline void add_dir_entry2(char *name, char *source_name,
 
 void free_dir_entry(struct dir_ent *dir_ent)
 {
-	if(dir_ent->name)
-		free(dir_ent->name);
-
 	if(dir_ent->source_name)
 		free(dir_ent->source_name);
 
@@ -3282,7 +3628,7 @@ void free_dir_entry(struct dir_ent *dir_ent)
 	 * to update the inode nlink count */
 	dec_nlink_inode(dir_ent);
 
-	free(dir_ent);
+	pool_free(&dir_ent_pool, dir_ent);
 }
 
 
@@ -3334,6 +3680,9 @@ squashfs_inode do_directory_scans(struct dir_ent *dir_ent, int progress)
 	if(empty_actions())
 		dir_scan5(root_dir);
 
+	/* The tree is complete, names are no longer looked up to share them */
+	intern_finish();
+
  	/*
 	 * Sort directories and compute the inode numbers
 	 */
@@ -3347,6 +3696,9 @@ squashfs_inode do_directory_scans(struct dir_ent *dir_ent, int progress)
 		generate_file_priorities(root_dir, 0,
 			&root_dir->dir_ent->inode->buf);
 
+	if(physical_sort)
+		sort_physical();
+
 	if(appending) {
 		sigset_t sigmask;
 
@@ -3464,6 +3816,8 @@ squashfs_inode dir_scan(int directory, int progress)
 {
 	int single = !keep_as_directory && source == 1;
 
+	scanner_init(processors, !no_xattrs, physical_read);
+
 	if(single && directory)
 		return scan_single(source_path[0], progress);
 	else
@@ -3486,12 +3840,14 @@ struct dir_info *scan1_opendir(char *pathname, char *subpath, int depth)
 		MEM_ERROR();
 
 	if(pathname[0] != '\0') {
-		dir->linuxdir = opendir(pathname);
-		if(dir->linuxdir == NULL) {
+		dir->scan = scanner_get(pathname);
+		if(dir->scan->error) {
+			scanner_free(dir->scan);
 			free(dir);
 			return NULL;
 		}
-	}
+	} else
+		dir->scan = NULL;
 
 	dir->pathname = strdup(pathname);
 	dir->subpath = strdup(subpath);
@@ -3501,6 +3857,8 @@ struct dir_info *scan1_opendir(char *pathname, char *subpath, int depth)
 	dir->list = NULL;
 	dir->depth = depth;
 	dir->excluded = 0;
+	dir->name_index = NULL;
+	dir->name_index_size = 0;
 
 	return dir;
 }
@@ -3509,6 +3867,7 @@ struct dir_info *scan1_opendir(char *pathname, char *subpath, int depth)
 static struct dir_ent *scan1_encomp_readdir(struct dir_info *dir)
 {
 	static int index = 0;
+	struct dir_ent *dir_ent;
 
 	if(dir->count < old_root_entries) {
 		int i;
@@ -3535,7 +3894,7 @@ static struct dir_ent *scan1_encomp_readdir(struct dir_info *dir)
 		}
 		dir_name = strdup(dir_name);
 		for(;;) {
-			struct dir_ent *dir_ent = dir->list;
+			dir_ent = dir->list;
 
 			for(; dir_ent && strcmp(dir_ent->name, dir_name) != 0;
 				dir_ent = dir_ent->next);
@@ -3557,8 +3916,10 @@ static struct dir_ent *scan1_encomp_readdir(struct dir_info *dir)
 		if(one_file_system && source > 1)
 			cur_dev = source_dev[index];
 
-		return create_dir_entry(dir_name, basename,
+		dir_ent = create_dir_entry(dir_name, basename,
 			strdup(source_path[index ++]), dir);
+		free(dir_name);
+		return dir_ent;
 	}
 	return NULL;
 }
@@ -3566,7 +3927,8 @@ static struct dir_ent *scan1_encomp_readdir(struct dir_info *dir)
 
 static struct dir_ent *scan1_single_readdir(struct dir_info *dir)
 {
-	struct dirent *d_name;
+	struct scanner_entry *entry;
+	struct dir_ent *dir_ent;
 	int i;
 
 	if(dir->count < old_root_entries) {
@@ -3578,13 +3940,13 @@ static struct dir_ent *scan1_single_readdir(struct dir_info *dir)
 		}
 	}
 
-	if((d_name = readdir(dir->linuxdir)) != NULL) {
+	if((entry = scanner_readdir(dir->scan)) != NULL) {
 		char *basename = NULL;
-		char *dir_name = strdup(d_name->d_name);
+		char *dir_name = strdup(entry->name);
 		int pass = 1, res;
 
 		for(;;) {
-			struct dir_ent *dir_ent = dir->list;
+			dir_ent = dir->list;
 
 			for(; dir_ent && strcmp(dir_ent->name, dir_name) != 0;
 				dir_ent = dir_ent->next);
@@ -3596,13 +3958,15 @@ static struct dir_ent *scan1_single_readdir(struct dir_info *dir)
 				basename = dir_name;
 			else
 				free(dir_name);
-			res = asprintf(&dir_name, "%s_%d", d_name->d_name, pass++);
+			res = asprintf(&dir_name, "%s_%d", entry->name, pass++);
 			if(res == -1)
 				BAD_ERROR("asprintf failed in "
 					"scan1_single_readdir\n");
 			ERROR("%s\n", dir_name);
 		}
-		return create_dir_entry(dir_name, basename, NULL, dir);
+		dir_ent = create_dir_entry(dir_name, basename, NULL, dir);
+		free(dir_name);
+		return dir_ent;
 	}
 
 	return NULL;
@@ -3611,18 +3975,137 @@ static struct dir_ent *scan1_single_readdir(struct dir_info *dir)
 
 static struct dir_ent *scan1_readdir(struct dir_info *dir)
 {
-	struct dirent *d_name = readdir(dir->linuxdir);
+	struct scanner_entry *entry = scanner_readdir(dir->scan);
 
-	return d_name ?
-		create_dir_entry(strdup(d_name->d_name), NULL, NULL, dir) :
+	return entry ?
+		create_dir_entry(entry->name, NULL, NULL, dir) :
 		NULL;
 }
 
 
 static void scan1_freedir(struct dir_info *dir)
 {
-	if(dir->pathname[0] != '\0')
-		closedir(dir->linuxdir);
+	if(dir->scan) {
+		scanner_free(dir->scan);
+		dir->scan = NULL;
+	}
+}
+
+
+/*
+ * Stat the entry just returned by the readdir function.  Directories read
+ * by the scanner have already been stat'ed, only the top level sources
+ * need to be looked up here
+ */
+static int scan1_lstat(struct dir_info *dir, char *filename, struct stat *buf)
+{
+	struct scanner_entry *entry;
+
+	if(dir->scan == NULL)
+		return lstat(filename, buf);
+
+	entry = SCANNER_ENTRY(dir->scan);
+	if(entry->error) {
+		errno = entry->error;
+		return -1;
+	}
+
+	*buf = entry->buf;
+	return 0;
+}
+
+
+/*
+ * Hand over any xattrs and physical offset read by the scanner to the inode.
+ * If the inode is a hard link to one already seen it will already have them
+ */
+static struct inode_info *scan1_inode(struct dir_info *dir, char *filename,
+	struct inode_info *inode)
+{
+	struct scanner_entry *entry;
+
+	if(dir->scan == NULL) {
+		if(physical_read && S_ISREG(inode->buf.st_mode))
+			inode->physical = physical_offset(AT_FDCWD, filename);
+		return inode;
+	}
+
+	entry = SCANNER_ENTRY(dir->scan);
+	inode->physical = entry->physical;
+	if(inode->xattrs == -1) {
+		inode->xattr_list = entry->xattr_list;
+		inode->xattrs = entry->xattrs;
+		entry->xattr_list = NULL;
+		entry->xattrs = -1;
+	}
+
+	return inode;
+}
+
+
+static int scan1_readlink(struct dir_info *dir, char *filename, char *buff,
+	int size)
+{
+	struct scanner_entry *entry;
+
+	if(dir->scan == NULL)
+		return readlink(filename, buff, size);
+
+	entry = SCANNER_ENTRY(dir->scan);
+	if(entry->symlink_size == -1)
+		errno = entry->symlink_error;
+	else if(entry->symlink_size > 0 && entry->symlink_size < size)
+		memcpy(buff, entry->symlink, entry->symlink_size);
+
+	return entry->symlink_size;
+}
+
+
+/*
+ * Queue the sub-directories of <dir> which dir_scan1() will descend into
+ * to be read ahead by the scanner threads.  Directories excluded by
+ * exclude actions can only be determined when dir_scan1() reaches them,
+ * and are discarded then
+ */
+static void scan1_queue(struct dir_info *dir, struct pathnames *paths)
+{
+	struct scanner_dir *scan = dir->scan;
+	char *filename;
+	int i;
+
+	if(scan == NULL)
+		return;
+
+	/*
+	 * Queue in reverse, the scanner threads take the most recently
+	 * queued directory first
+	 */
+	for(i = scan->count - 1; i >= 0; i--) {
+		struct scanner_entry *entry = &scan->entry[i];
+		struct pathnames *new = NULL;
+		int res;
+
+		if(entry->error || !S_ISDIR(entry->buf.st_mode))
+			continue;
+
+		if(one_file_system && entry->buf.st_dev != cur_dev)
+			continue;
+
+		if(old_exclude && old_excluded(NULL, &entry->buf))
+			continue;
+
+		if(!old_exclude && excluded(entry->name, paths, &new))
+			continue;
+
+		free(new);
+
+		res = asprintf(&filename, "%s/%s", dir->pathname, entry->name);
+		if(res == -1)
+			BAD_ERROR("asprintf failed in scan1_queue\n");
+
+		scanner_queue(filename);
+		free(filename);
+	}
 }
 
 
@@ -3639,6 +4122,8 @@ static struct dir_info *dir_scan1(char *filename, char *subpath,
 		return NULL;
 	}
 
+	scan1_queue(dir, paths);
+
 	while((dir_ent = _readdir(dir))) {
 		struct dir_info *sub_dir;
 		struct stat buf;
@@ -3652,7 +4137,7 @@ static struct dir_info *dir_scan1(char *filename, char *subpath,
 			continue;
 		}
 
-		if(lstat(filename, &buf) == -1) {
+		if(scan1_lstat(dir, filename, &buf) == -1) {
 			ERROR_START("Cannot stat dir/file %s because %s",
 				filename, strerror(errno));
 			ERROR_EXIT(", ignoring\n");
@@ -3699,6 +4184,8 @@ static struct dir_info *dir_scan1(char *filename, char *subpath,
 			
 			if(eval_exclude_actions(dir_name, filename, subpath,
 							&buf, depth, dir_ent)) {
+				if(S_ISDIR(buf.st_mode))
+					scanner_discard(filename);
 				add_excluded(dir);
 				free_dir_entry(dir_ent);
 				continue;
@@ -3715,7 +4202,8 @@ static struct dir_info *dir_scan1(char *filename, char *subpath,
 			if(sub_dir) {
 				dir->directory_count ++;
 				add_dir_entry(dir_ent, sub_dir,
-							lookup_inode(&buf));
+					scan1_inode(dir, filename,
+					lookup_inode(&buf)));
 			} else
 				free_dir_entry(dir_ent);
 			break;
@@ -3723,10 +4211,10 @@ static struct dir_info *dir_scan1(char *filename, char *subpath,
 			int byte;
 			static char buff[65536]; /* overflow safe */
 
-			byte = readlink(filename, buff, 65536);
+			byte = scan1_readlink(dir, filename, buff, 65536);
 			if(byte == -1) {
-				ERROR_START("Failed to read symlink %s",
-								filename);
+				ERROR_START("Failed to read symlink %s because "
+					"%s", filename, strerror(errno));
 				ERROR_EXIT(", ignoring\n");
 			} else if(byte == 65536) {
 				ERROR_START("Symlink %s is greater than 65536 "
@@ -3736,13 +4224,15 @@ static struct dir_info *dir_scan1(char *filename, char *subpath,
 				/* readlink doesn't 0 terminate the returned
 				 * path */
 				buff[byte] = '\0';
-				add_dir_entry(dir_ent, NULL, lookup_inode3(&buf,
-							 NULL, buff, byte + 1));
+				add_dir_entry(dir_ent, NULL, scan1_inode(dir,
+					filename, lookup_inode3(&buf, NULL,
+					buff, byte + 1)));
 			}
 			break;
 		}
 		default:
-			add_dir_entry(dir_ent, NULL, lookup_inode(&buf));
+			add_dir_entry(dir_ent, NULL,
+				scan1_inode(dir, filename, lookup_inode(&buf)));
 		}
 
 		free(new);
@@ -3779,7 +4269,7 @@ static void dir_scan2(struct dir_info *dir, struct pseudo *pseudo)
 	
 	while((dir_ent = scan2_readdir(dir, dir_ent)) != NULL) {
 		struct inode_info *inode_info = dir_ent->inode;
-		struct stat *buf = &inode_info->buf;
+		struct inode_stat *buf = &inode_info->buf;
 		char *name = dir_ent->name;
 
 		eval_actions(root_dir, dir_ent);
@@ -3791,7 +4281,7 @@ static void dir_scan2(struct dir_info *dir, struct pseudo *pseudo)
 	while((pseudo_ent = pseudo_readdir(pseudo)) != NULL) {
 		dir_ent = lookup_name(dir, pseudo_ent->name);
 		if(pseudo_ent->dev->type == 'm' || pseudo_ent->dev->type == 'M') {
-			struct stat *buf;
+			struct inode_stat *buf;
 			if(dir_ent == NULL) {
 				ERROR_START("Pseudo modify file \"%s\" does "
 					"not exist in source filesystem.",
@@ -3922,6 +4412,7 @@ void free_dir(struct dir_info *dir)
 
 	free(dir->pathname);
 	free(dir->subpath);
+	free(dir->name_index);
 	free(dir);
 }
 	
@@ -3957,6 +4448,7 @@ static void dir_scan4(struct dir_info *dir, int symlink)
 			dir->count --;
 
 			/* remove dir_ent from list */
+			remove_name_index(dir, dir_ent);
 			dir_ent = dir_ent->next;
 			if(prev)
 				prev->next = dir_ent;
@@ -4005,9 +4497,11 @@ static void dir_scan5(struct dir_info *dir)
 				 */
 				free(dir_ent->dir->pathname);
 				free(dir_ent->dir->subpath);
+				free(dir_ent->dir->name_index);
 				free(dir_ent->dir);
 
 				/* remove dir_ent from list */
+				remove_name_index(dir, dir_ent);
 				dir_ent = dir_ent->next;
 				if(prev)
 					prev->next = dir_ent;
@@ -4130,6 +4624,8 @@ static void dir_scan6(struct dir_info *dir)
 	struct dir_ent *dir_ent;
 	unsigned int byte_count = 0;
 
+	/* no more lookups */
+	free_name_index(dir);
 	sort_directory(dir);
 
 	for(dir_ent = dir->list; dir_ent; dir_ent = dir_ent->next) {
@@ -4204,7 +4700,7 @@ static void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 	scan7_init_dir(&dir);
 	
 	while((dir_ent = scan7_readdir(&dir, dir_info, dir_ent)) != NULL) {
-		struct stat *buf = &dir_ent->inode->buf;
+		struct inode_stat *buf = &dir_ent->inode->buf;
 
 		update_info(dir_ent);
 
@@ -4350,6 +4846,7 @@ static void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 		*inode);
 
 	scan7_freedir(&dir);
+	arena_trim();
 }
 
 
@@ -4361,7 +4858,7 @@ static void handle_root_entries(struct dir_info *dir)
 		for(i = 0; i < old_root_entries; i++) {
 			if(old_root_entry[i].inode.type == SQUASHFS_DIR_TYPE)
 				dir->directory_count ++;
-			add_dir_entry2(strdup(old_root_entry[i].name), NULL,
+			add_dir_entry2(old_root_entry[i].name, NULL,
 				NULL, NULL, &old_root_entry[i].inode, dir);
 		}
 	}
@@ -4409,6 +4906,7 @@ static struct dir_info *add_source(struct dir_info *sdir, char *source,
 	struct pathnames *new = NULL;
 	struct dir_info *dir = sdir;
 	struct stat buf;
+	struct inode_stat stat;
 	char *name, *newsubpath = NULL;
 	int res;
 
@@ -4476,7 +4974,8 @@ static struct dir_info *add_source(struct dir_info *sdir, char *source,
 			BAD_ERROR("Source %s conflicts with name in filesystem "
 						"being appended to\n", name);
 
-		res = memcmp(&buf, &(entry->inode->buf), sizeof(buf));
+		get_inode_stat(&stat, &buf);
+		res = memcmp(&stat, &(entry->inode->buf), sizeof(stat));
 		if(res)
 			BAD_ERROR("Can't have two different sources with same "
 								"pathname\n");
@@ -4551,6 +5050,8 @@ static struct dir_info *add_source(struct dir_info *sdir, char *source,
 			goto failed_early;
 
 		entry = create_dir_entry(name, NULL, file, dir);
+		free(name);
+		name = entry->name;
 
 		if(exclude_actions()) {
 			newsubpath = subpathname(entry);
@@ -5117,10 +5618,46 @@ static void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 }
 
 
+static void add_lookup_entry(struct inode_info *inode)
+{
+	unsigned int inode_number = get_inode_no(inode);
+
+	/* The empty action will produce orphaned inodes.  These
+	 * because they are orphaned will not be allocated an inode
+	 * number in dir_scan6(), so skip any with the default dummy
+	 * inode number of 0 */
+	if(inode_number == 0)
+		return;
+
+	SQUASHFS_SWAP_LONG_LONGS(&inode->inode,
+		&inode_lookup_table[inode_number - 1], 1);
+}
+
+
+/*
+ * Walk the tree filling in the inode lookup table, hardlinked inodes are
+ * simply filled in more than once.  Original root entries from the
+ * filesystem being appended to are already in the table
+ */
+static void fill_inode_lookup_table(struct dir_info *dir)
+{
+	struct dir_ent *dir_ent;
+
+	for(dir_ent = dir->list; dir_ent; dir_ent = dir_ent->next) {
+		if(dir_ent->inode == NULL || dir_ent->inode->root_entry)
+			continue;
+
+		add_lookup_entry(dir_ent->inode);
+
+		if(dir_ent->dir)
+			fill_inode_lookup_table(dir_ent->dir);
+	}
+}
+
+
 static long long write_inode_lookup_table()
 {
-	int i, lookup_bytes = SQUASHFS_LOOKUP_BYTES(inode_count);
-	unsigned int inode_number;
+	int lookup_bytes = SQUASHFS_LOOKUP_BYTES(inode_count);
 	void *it;
 
 	if(inode_count == sinode_count)
@@ -5131,27 +5668,8 @@ static long long write_inode_lookup_table()
 		MEM_ERROR();
 	inode_lookup_table = it;
 
-	for(i = 0; i < INODE_HASH_SIZE; i ++) {
-		struct inode_info *inode;
-
-		for(inode = inode_info[i]; inode; inode = inode->next) {
-
-			inode_number = get_inode_no(inode);
-
-			/* The empty action will produce orphaned inode
-			 * entries in the inode_info[] table.  These
-			 * entries because they are orphaned will not be
-			 * allocated an inode number in dir_scan5(), so
-			 * skip any entries with the default dummy inode
-			 * number of 0 */
-			if(inode_number == 0)
-				continue;
-
-			SQUASHFS_SWAP_LONG_LONGS(&inode->inode,
-				&inode_lookup_table[inode_number - 1], 1);
-
-		}
-	}
+	add_lookup_entry(root_dir->dir_ent->inode);
+	fill_inode_lookup_table(root_dir);
 
 skip_inode_hash_table:
 	return generic_write_table(lookup_bytes, inode_lookup_table, 0, NULL,
@@ -5193,6 +5711,11 @@ static void free_path(struct pathname *paths)
 		}
 	}
 
+	if(paths->lookup)
+		match_index_free(paths->lookup);
+	if(paths->index)
+		match_index_free(paths->index);
+	free(paths->name);
 	free(paths);
 }
 
@@ -5211,11 +5734,15 @@ static struct pathname *add_path(struct pathname *paths, char *target, char *all
 
 		paths->names = 0;
 		paths->name = NULL;
+		paths->index = NULL;
+		paths->lookup = match_index_create(0);
+		if(paths->lookup == NULL)
+			MEM_ERROR();
 	}
 
-	for(i = 0; i < paths->names; i++)
-		if(strcmp(paths->name[i].name, targname) == 0)
-			break;
+	i = match_index_lookup(paths->lookup, targname);
+	if(i == -1)
+		i = paths->names;
 
 	if(i == paths->names) {
 		/* allocate new name entry */
@@ -5225,6 +5752,14 @@ static struct pathname *add_path(struct pathname *paths, char *target, char *all
 		if(paths->name == NULL)
 			MEM_ERROR();
 		paths->name[i].name = targname;
+		if(!match_index_add(paths->lookup, targname, i, MATCH_LITERAL))
+			MEM_ERROR();
+
+		/* rebuilt the next time the names are matched */
+		if(paths->index) {
+			match_index_free(paths->index);
+			paths->index = NULL;
+		}
 		paths->name[i].paths = NULL;
 		if(use_regex) {
 			paths->name[i].preg = malloc(sizeof(regex_t));
@@ -5305,28 +5840,57 @@ static struct pathnames *add_subdir(struct pathnames *paths, struct pathname *pa
 }
 
 
-static int excluded_match(char *name, struct pathname *path, struct pathnames **new)
+static void index_path(struct pathname *path)
 {
 	int i;
 
-	for(i = 0; i < path->names; i++) {
+	path->index = match_index_create(path->names);
+	if(path->index == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < path->names; i++)
+		if(!match_index_add(path->index, path->name[i].name, i,
+				use_regex ? MATCH_REGEX : MATCH_WILDCARD))
+			MEM_ERROR();
+}
+
+
+static int excluded_entry(struct path_entry *entry, struct pathnames **new)
+{
+	if(entry->paths == NULL || new == NULL)
+		/* match on a leaf component, any subdirectories
+		 * in the filesystem should be excluded */
+		return TRUE;
+
+	/* match on a non-leaf component, add any
+	 * subdirectories to the new set of
+	 * subdirectories to scan for this name */
+	*new = add_subdir(*new, entry->paths);
+	return FALSE;
+}
+
+
+static int excluded_match(char *name, struct pathname *path, struct pathnames **new)
+{
+	int i, n;
+
+	if(path->index == NULL)
+		index_path(path);
+
+	/* any literal name is found with one lookup */
+	n = match_index_lookup(path->index, name);
+	if(n != -1 && excluded_entry(&path->name[n], new))
+		return TRUE;
+
+	for(i = 0; i < path->index->wilds; i++) {
+		struct path_entry *entry = &path->name[path->index->wild[i]];
 		int match = use_regex ?
-			regexec(path->name[i].preg, name, (size_t) 0,
-					NULL, 0) == 0 :
-			fnmatch(path->name[i].name, name,
+			regexec(entry->preg, name, (size_t) 0, NULL, 0) == 0 :
+			fnmatch(entry->name, name,
 				FNM_PATHNAME|FNM_PERIOD|FNM_EXTMATCH) == 0;
 
-		if(match) {
-			 if(path->name[i].paths == NULL || new == NULL)
-				/* match on a leaf component, any subdirectories
-			 	* in the filesystem should be excluded */
-				return TRUE;
-			else
-				/* match on a non-leaf component, add any
-				 * subdirectories to the new set of
-				 * subdirectories to scan for this name */
-				*new = add_subdir(*new, path->name[i].paths);
-		}
+		if(match && excluded_entry(entry, new))
+			return TRUE;
 	}
 
 	return FALSE;
@@ -5925,6 +6489,15 @@ static void print_options(FILE *stream, char *name, int total_mem)
 	fprintf(stream, "-tarstyle\t\talternative name for -no-strip\n");
 	fprintf(stream, "-cpiostyle\t\tact like cpio, and read files from standard in (stdin)\n");
 	fprintf(stream, "-cpiostyle0\t\tlike -cpiostyle, but filenames are null terminated\n");
+	fprintf(stream, "-images\t\t\tsources are Squashfs images, add their contents rather\n");
+	fprintf(stream, "\t\t\tthan the image files.  Compressed blocks are copied\n");
+	fprintf(stream, "\t\t\tunchanged if the compressor and block size are the same.\n");
+	fprintf(stream, "\t\t\tExcludes need -wildcards or -regex\n");
+	fprintf(stream, "-flatten\t\tsources are Squashfs image layers, merge them in order\n");
+	fprintf(stream, "\t\t\tinto one filesystem.  Files in later layers replace\n");
+	fprintf(stream, "\t\t\tfiles in earlier layers, and whiteouts (.wh.<name>,\n");
+	fprintf(stream, "\t\t\t.wh..wh..opq and 0/0 character devices) delete them.\n");
+	fprintf(stream, "\t\t\tImplies -images\n");
 	fprintf(stream, "-comp <comp>\t\tselect <comp> compression\n");
 	fprintf(stream, "\t\t\tCompressors available:\n");
 	display_compressors(stream, "\t\t\t", COMP_DEFAULT);
@@ -5958,6 +6531,10 @@ static void print_options(FILE *stream, char *name, int total_mem)
 	fprintf(stream, "-always-use-fragments\tuse fragment blocks for files larger ");
 	fprintf(stream, "than block size\n");
 	fprintf(stream, "-no-duplicates\t\tdo not perform duplicate checking\n");
+	fprintf(stream, "-no-fragment-verify\tidentify duplicate fragments by ");
+	fprintf(stream, "their hash alone,\n\t\t\tnot byte comparing them.  ");
+	fprintf(stream, "Faster, but a hash collision\n\t\t\twill silently ");
+	fprintf(stream, "corrupt the filesystem\n");
 	fprintf(stream, "-no-hardlinks\t\tdo not hardlink files, instead store duplicates\n");
 	fprintf(stream, "-all-root\t\tmake all files owned by root\n");
 	fprintf(stream, "-root-time <time>\tset root directory time to <time>\n");
@@ -6011,6 +6588,12 @@ static void print_options(FILE *stream, char *name, int total_mem)
 	fprintf(stream, "-sort <sort_file>\tsort files according to priorities in ");
 	fprintf(stream, "<sort_file>.  One\n\t\t\tfile or dir with priority per ");
 	fprintf(stream, "line.  Priority -32768 to\n\t\t\t32767, default priority 0\n");
+	fprintf(stream, "-physical-read\t\tread files in the order they are stored on ");
+	fprintf(stream, "the source\n\t\t\tdisk, to reduce seeking.  The order ");
+	fprintf(stream, "of files in the\n\t\t\tfilesystem is unchanged\n");
+	fprintf(stream, "-physical-sort\t\tsort files into the order they are stored ");
+	fprintf(stream, "on the source\n\t\t\tdisk.  If -sort is also given, files ");
+	fprintf(stream, "with the same\n\t\t\tpriority are sorted\n");
 	fprintf(stream, "-ef <exclude_file>\tlist of exclude dirs/files.  ");
 	fprintf(stream, "One per line\n");
 	fprintf(stream, "-wildcards\t\tAllow extended shell wildcards (globbing) to be ");
@@ -6047,6 +6630,25 @@ static void print_options(FILE *stream, char *name, int total_mem)
 	fprintf(stream, "consumption\n\t\t\tof Mksquashfs (alternative to -throttle)\n");
 	fprintf(stream, "-processors <number>\tUse <number> processors.  By default ");
 	fprintf(stream, "will use number of\n\t\t\tprocessors available\n");
+	fprintf(stream, "-pseudo-processes <n>\trun up to <n> dynamic pseudo file ");
+	fprintf(stream, "commands at once,\n\t\t\tahead of the reader.  Their output ");
+	fprintf(stream, "is taken from the\n\t\t\tread queue memory.  By default ");
+	fprintf(stream, "each command is run\n\t\t\twhen its file is read\n");
+	fprintf(stream, "-prefetch <size>\tprefetch up to <size> of the files to ");
+	fprintf(stream, "be read into\n\t\t\tthe page cache ahead of the reader.  ");
+	fprintf(stream, "Default is the\n\t\t\tread queue size\n");
+	fprintf(stream, "\t\t\tOptionally a suffix of K, M or G can be given to ");
+	fprintf(stream, "specify\n\t\t\tKbytes, Mbytes or Gbytes respectively\n");
+	fprintf(stream, "-no-prefetch\t\tdon't prefetch files ahead of the reader\n");
+	fprintf(stream, "-mem-report\t\treport the memory used by the in-memory ");
+	fprintf(stream, "directory tree\n");
+	fprintf(stream, "-spill <file>\t\tspill the in-memory directory tree to ");
+	fprintf(stream, "scratch file\n\t\t\t<file>, for trees too big for ");
+	fprintf(stream, "memory.  <file> must not exist\n");
+	fprintf(stream, "-spill-mem <size>\tkeep <size> of the spilled tree ");
+	fprintf(stream, "resident.  Default 1G\n");
+	fprintf(stream, "\t\t\tOptionally a suffix of K, M or G can be given to ");
+	fprintf(stream, "specify\n\t\t\tKbytes, Mbytes or Gbytes respectively\n");
 	fprintf(stream, "-mem <size>\t\tUse <size> physical memory.  Currently set ");
 	fprintf(stream, "to %dM\n", total_mem);
 	fprintf(stream, "\t\t\tOptionally a suffix of K, M or G can be given to ");
@@ -6117,6 +6719,10 @@ static void print_sqfstar_options(FILE *stream, char *name, int total_mem)
 	fprintf(stream, "-no-fragments\t\tdo not use fragments\n");
 	fprintf(stream, "-no-tailends\t\tdon't pack tail ends into fragments\n");
 	fprintf(stream, "-no-duplicates\t\tdo not perform duplicate checking\n");
+	fprintf(stream, "-no-fragment-verify\tidentify duplicate fragments by ");
+	fprintf(stream, "their hash alone,\n\t\t\tnot byte comparing them.  ");
+	fprintf(stream, "Faster, but a hash collision\n\t\t\twill silently ");
+	fprintf(stream, "corrupt the filesystem\n");
 	fprintf(stream, "-no-hardlinks\t\tdo not hardlink files, instead store duplicates\n");
 	fprintf(stream, "-all-root\t\tmake all files owned by root\n");
 	fprintf(stream, "-root-time <time>\tset root directory time to <time>\n");
@@ -6149,6 +6755,15 @@ static void print_sqfstar_options(FILE *stream, char *name, int total_mem)
 	fprintf(stream, "consumption\n\t\t\tof Mksquashfs (alternative to -throttle)\n");
 	fprintf(stream, "-processors <number>\tUse <number> processors.  By default ");
 	fprintf(stream, "will use number of\n\t\t\tprocessors available\n");
+	fprintf(stream, "-mem-report\t\treport the memory used by the in-memory ");
+	fprintf(stream, "directory tree\n");
+	fprintf(stream, "-spill <file>\t\tspill the in-memory directory tree to ");
+	fprintf(stream, "scratch file\n\t\t\t<file>, for trees too big for ");
+	fprintf(stream, "memory.  <file> must not exist\n");
+	fprintf(stream, "-spill-mem <size>\tkeep <size> of the spilled tree ");
+	fprintf(stream, "resident.  Default 1G\n");
+	fprintf(stream, "\t\t\tOptionally a suffix of K, M or G can be given to ");
+	fprintf(stream, "specify\n\t\t\tKbytes, Mbytes or Gbytes respectively\n");
 	fprintf(stream, "-mem <size>\t\tUse <size> physical memory.  Currently set ");
 	fprintf(stream, "to %dM\n", total_mem);
 	fprintf(stream, "\t\t\tOptionally a suffix of K, M or G can be given to ");
@@ -6273,6 +6888,59 @@ static void print_summary()
 }
 
 
+static void print_mem_bytes(char *what, long long bytes, long long entries)
+{
+	printf("\t%-30s%10.2f bytes per entry (%.2f Kbytes)\n", what,
+		entries ? (double) bytes / entries : 0.0, bytes / 1024.0);
+}
+
+
+/*
+ * Report the memory used by the in-memory tree, and an estimate of what it
+ * would have used with a separately malloced struct stat, name, directory
+ * entry and block list per file
+ */
+static void print_mem_report()
+{
+	long long entries = dir_ent_pool.peak;
+	long long inodes = inode_pool.peak;
+	long long old_inode = malloc_size(sizeof(struct inode_info) -
+		sizeof(struct inode_stat) + sizeof(struct stat));
+	long long before, after;
+
+	before = entries * malloc_size(sizeof(struct dir_ent)) +
+		arena_stats.name_malloc_bytes + inodes * old_inode +
+		arena_stats.block_list_malloc_bytes +
+		file_pool.peak * malloc_size(sizeof(struct file_info));
+	after = entries * sizeof(struct dir_ent) + arena_stats.name_bytes +
+		inodes * sizeof(struct inode_info) +
+		arena_stats.block_list_bytes +
+		file_pool.peak * sizeof(struct file_info);
+
+	printf("\nIn-memory tree (peak):\n");
+	printf("\t%lld directory entries, %lld inodes, %lld block lists\n",
+		entries, inodes, arena_stats.block_lists);
+	printf("\t%lld names, %lld stored after interning\n",
+		arena_stats.names, arena_stats.unique_names);
+	print_mem_bytes("Directory entries", entries * sizeof(struct dir_ent),
+		entries);
+	print_mem_bytes("Names", arena_stats.name_bytes, entries);
+	print_mem_bytes("Inodes", inodes * sizeof(struct inode_info),
+		entries);
+	print_mem_bytes("Block lists", arena_stats.block_list_bytes, entries);
+	print_mem_bytes("File records", file_pool.peak *
+		sizeof(struct file_info), entries);
+	print_mem_bytes("Total", after, entries);
+	print_mem_bytes("Total before compaction", before, entries);
+	printf("\tName intern table %.2f Kbytes, freed after scanning\n",
+		arena_stats.intern_table_bytes / 1024.0);
+	if(spill_file)
+		printf("\tSpilled %.2f Mbytes to %s, trimmed %lld times\n",
+			arena_stats.spill_bytes / (1024.0 * 1024.0), spill_file,
+			arena_stats.spill_trims);
+}
+
+
 int option_with_arg(char *string, char *table[])
 {
 	int i;
@@ -6527,6 +7195,28 @@ print_sqfstar_compressor_options:
 					argv[0]);
 				exit(1);
 			}
+		} else if(strcmp(argv[i], "-mem-report") == 0)
+			mem_report = TRUE;
+		else if(strcmp(argv[i], "-spill") == 0) {
+			if(++i == dest_index) {
+				ERROR("%s: -spill missing filename\n",
+					argv[0]);
+				exit(1);
+			}
+			spill_file = argv[i];
+		} else if(strcmp(argv[i], "-spill-mem") == 0) {
+			if((++i == dest_index) ||
+				!parse_numberll(argv[i], &spill_mem, 1)) {
+				ERROR("%s: -spill-mem missing or invalid size\n",
+					argv[0]);
+				exit(1);
+			}
+			if(spill_mem < SPILL_MIN_MEM) {
+				ERROR("%s: -spill-mem should be %d Mbytes or "
+					"larger\n", argv[0],
+					SPILL_MIN_MEM / (1024 * 1024));
+				exit(1);
+			}
 		} else if(strcmp(argv[i], "-mem") == 0) {
 			long long number;
 
@@ -6578,6 +7268,12 @@ print_sqfstar_compressor_options:
 		} else if(strcmp(argv[i], "-no-duplicates") == 0)
 			duplicate_checking = FALSE;
 
+		else if(strcmp(argv[i], "-fragment-verify") == 0)
+			fragment_verify = TRUE;
+
+		else if(strcmp(argv[i], "-no-fragment-verify") == 0)
+			fragment_verify = FALSE;
+
 		else if(strcmp(argv[i], "-no-fragments") == 0)
 			no_fragments = TRUE;
 
@@ -6803,6 +7499,12 @@ print_sqfstar_compressor_options:
 	for(i = dest_index + 1; i < argc; i++)
 		add_exclude(argv[i]);
 
+	if(spill_file && !arena_spill(spill_file, spill_mem)) {
+		ERROR("%s: Failed to create spill file %s because %s\n",
+			argv[0], spill_file, strerror(errno));
+		exit(1);
+	}
+
 	initialise_threads(readq, fragq, bwriteq, fwriteq, delete,
 		destination_file);
 
@@ -6905,6 +7607,9 @@ print_sqfstar_compressor_options:
 	if(!quiet)
 		print_summary();
 
+	if(mem_report)
+		print_mem_report();
+
 	if(logging)
 		fclose(log_fd);
 
@@ -7020,7 +7725,11 @@ int main(int argc, char *argv[])
 			tarfile = TRUE;
 			always_use_fragments = TRUE;
 			exportable = FALSE;
-		} else if(strcmp(argv[i], "-one-file-system") == 0)
+		} else if(strcmp(argv[i], "-images") == 0)
+			image_sources = TRUE;
+		else if(strcmp(argv[i], "-flatten") == 0)
+			image_sources = image_flatten = TRUE;
+		else if(strcmp(argv[i], "-one-file-system") == 0)
 			one_file_system = TRUE;
 		else if(strcmp(argv[i], "-recovery-path") == 0) {
 			if(++i == argc) {
@@ -7302,7 +8011,34 @@ print_compressor_options:
 					argv[0]);
 				exit(1);
 			}
-		} else if(strcmp(argv[i], "-read-queue") == 0) {
+		} else if(strcmp(argv[i], "-pseudo-processes") == 0) {
+			if((++i == argc) ||
+					!parse_num(argv[i], &pseudo_processes)) {
+				ERROR("%s: -pseudo-processes missing or invalid "
+					"number\n", argv[0]);
+				exit(1);
+			}
+			if(pseudo_processes < 1) {
+				ERROR("%s: -pseudo-processes should be 1 or "
+					"larger\n", argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-prefetch") == 0) {
+			if((++i == argc) ||
+				!parse_numberll(argv[i], &prefetch_size, 1)) {
+				ERROR("%s: -prefetch missing or invalid size\n",
+					argv[0]);
+				exit(1);
+			}
+			if(prefetch_size < 1024 * 1024) {
+				ERROR("%s: -prefetch should be 1 Mbyte or "
+					"larger\n", argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-no-prefetch") == 0)
+			prefetch_size = 0;
+
+		else if(strcmp(argv[i], "-read-queue") == 0) {
 			if((++i == argc) || !parse_num(argv[i], &readq)) {
 				ERROR("%s: -read-queue missing or invalid "
 					"queue size\n", argv[0]);
@@ -7337,6 +8073,28 @@ print_compressor_options:
 					"megabyte or larger\n", argv[0]);
 				exit(1);
 			}
+		} else if(strcmp(argv[i], "-mem-report") == 0)
+			mem_report = TRUE;
+		else if(strcmp(argv[i], "-spill") == 0) {
+			if(++i == argc) {
+				ERROR("%s: -spill missing filename\n",
+					argv[0]);
+				exit(1);
+			}
+			spill_file = argv[i];
+		} else if(strcmp(argv[i], "-spill-mem") == 0) {
+			if((++i == argc) ||
+				!parse_numberll(argv[i], &spill_mem, 1)) {
+				ERROR("%s: -spill-mem missing or invalid size\n",
+					argv[0]);
+				exit(1);
+			}
+			if(spill_mem < SPILL_MIN_MEM) {
+				ERROR("%s: -spill-mem should be %d Mbytes or "
+					"larger\n", argv[0],
+					SPILL_MIN_MEM / (1024 * 1024));
+				exit(1);
+			}
 		} else if(strcmp(argv[i], "-mem") == 0) {
 			long long number;
 
@@ -7388,6 +8146,12 @@ print_compressor_options:
 		} else if(strcmp(argv[i], "-no-duplicates") == 0)
 			duplicate_checking = FALSE;
 
+		else if(strcmp(argv[i], "-fragment-verify") == 0)
+			fragment_verify = TRUE;
+
+		else if(strcmp(argv[i], "-no-fragment-verify") == 0)
+			fragment_verify = FALSE;
+
 		else if(strcmp(argv[i], "-no-fragments") == 0)
 			no_fragments = TRUE;
 
@@ -7402,7 +8166,13 @@ print_compressor_options:
 				ERROR("%s: -sort missing filename\n", argv[0]);
 				exit(1);
 			}
-		} else if(strcmp(argv[i], "-all-root") == 0 ||
+		} else if(strcmp(argv[i], "-physical-read") == 0)
+			physical_read = TRUE;
+
+		else if(strcmp(argv[i], "-physical-sort") == 0)
+			physical_read = physical_sort = TRUE;
+
+		else if(strcmp(argv[i], "-all-root") == 0 ||
 				strcmp(argv[i], "-root-owned") == 0)
 			global_uid = global_gid = 0;
 
@@ -7546,6 +8316,19 @@ print_compressor_options:
 	if(tarfile && get_pseudo())
 		BAD_ERROR("Pseudo files are unsupported when reading tar files\n");
 
+	/* If -images option is set, then the sources are Squashfs images,
+	 * and their contents are added rather than the image files */
+	if(image_sources && (tarfile || tarstyle || cpiostyle))
+		BAD_ERROR("-images is incompatible with -tar, -tarstyle and "
+			"-cpiostyle[0] options\n");
+
+	if(image_sources && source == 0)
+		BAD_ERROR("No source images specified\n");
+
+	if(image_sources && any_actions())
+		BAD_ERROR("Actions are unsupported when reading Squashfs "
+			"images\n");
+
 	/*
 	 * The -noI option implies -noId for backwards compatibility, so reset noId
 	 * if both have been specified
@@ -7592,6 +8375,15 @@ print_compressor_options:
 			EXIT_MKSQUASHFS();
 		}
 
+		/* ensure a source image isn't overwritten by the output */
+		if(image_sources && stat(destination_file, &buf) == 0 &&
+				buf.st_dev == source_buf.st_dev &&
+				buf.st_ino == source_buf.st_ino) {
+			ERROR("Source image %s is the destination\n",
+				source_path[i]);
+			exit(1);
+		}
+
 		if(one_file_system) {
 			if(source > 1)
 				source_dev[i] = source_buf.st_dev;
@@ -7638,6 +8430,15 @@ print_compressor_options:
 			EXIT_MKSQUASHFS();
 		}
 
+		if(image_sources && !delete) {
+			ERROR("Appending is not supported reading Squashfs "
+				"images\n");
+			ERROR("To force Mksquashfs to write to this %s "
+				"use -noappend\n", S_ISBLK(buf.st_mode) ?
+				"block device" : "file");
+			EXIT_MKSQUASHFS();
+		}
+
 		if(S_ISBLK(buf.st_mode)) {
 			if((fd = open(destination_file, O_RDWR)) == -1) {
 				perror("Could not open block device as "
@@ -7661,6 +8462,20 @@ print_compressor_options:
 		}
 	}
 
+	/*
+	 * Old style excludes match source files by device and inode number,
+	 * which files inside Squashfs images don't have
+	 */
+	if(image_sources && old_exclude) {
+		for(i = option_offset; i < argc; i++)
+			if(strcmp(argv[i], "-ef") == 0 ||
+						strcmp(argv[i], "-e") == 0)
+				BAD_ERROR("-images only supports excludes with "
+					"-wildcards or -regex\n");
+			else if(option_with_arg(argv[i], option_table))
+				i++;
+	}
+
 	/*
 	 * process the exclude files - must be done afer destination file has
 	 * been possibly created
@@ -7696,6 +8511,10 @@ print_compressor_options:
 				BAD_ERROR("Sorting files is unsupported when "
 					"reading tar files\n");
 
+			if(image_sources)
+				BAD_ERROR("Sorting files is unsupported when "
+					"reading Squashfs images\n");
+
 			res = read_sort_file(argv[++i], source, source_path);
 			if(res == FALSE)
 				BAD_ERROR("Failed to read sort file\n");
@@ -7705,6 +8524,18 @@ print_compressor_options:
 		else if(option_with_arg(argv[i], option_table))
 			i++;
 
+	if(physical_sort) {
+		if(tarfile)
+			BAD_ERROR("Sorting files is unsupported when reading tar "
+				"files\n");
+
+		if(image_sources)
+			BAD_ERROR("Sorting files is unsupported when reading "
+				"Squashfs images\n");
+
+		sorted ++;
+	}
+
 	if(!delete) {
 	        comp = read_super(fd, &sBlk, destination_file);
 	        if(comp == NULL) {
@@ -7730,6 +8561,28 @@ print_compressor_options:
 		comp_opts = SQUASHFS_COMP_OPTS(sBlk.flags);
 	}
 
+	if(spill_file && !arena_spill(spill_file, spill_mem)) {
+		ERROR("%s: Failed to create spill file %s because %s\n",
+			argv[0], spill_file, strerror(errno));
+		exit(1);
+	}
+
+	/*
+	 * The output of the dynamic pseudo file commands run ahead is held
+	 * in memory until it is read, take it out of the read queue
+	 */
+	if(pseudo_processes) {
+		int spool = pseudo_spool_size(pseudo_processes);
+
+		if(spool >= readq)
+			BAD_ERROR("-pseudo-processes %d needs %d Mbytes for "
+				"command output, more than the read queue "
+				"(%d Mbytes).  Use fewer processes, or a larger "
+				"-mem or -read-queue\n", pseudo_processes,
+				spool, readq);
+		readq -= spool;
+	}
+
 	initialise_threads(readq, fragq, bwriteq, fwriteq, delete,
 		destination_file);
 
@@ -7917,6 +8770,8 @@ print_compressor_options:
 
 	if(tarfile)
 		inode = process_tar_file(progress);
+	else if(image_sources)
+		inode = process_image_sources(progress);
 	else if(tarstyle || cpiostyle)
 		inode = process_source(progress);
 	else if(!source)
@@ -7972,6 +8827,9 @@ print_compressor_options:
 	if(!quiet)
 		print_summary();
 
+	if(mem_report)
+		print_mem_report();
+
 	if(logging)
 		fclose(log_fd);
 
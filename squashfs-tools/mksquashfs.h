@@ -35,7 +35,10 @@ struct dir_info {
 	char			dir_is_ldir;
 	struct dir_ent		*dir_ent;
 	struct dir_ent		*list;
-	DIR			*linuxdir;
+	struct scanner_dir	*scan;
+	/* hash index of list by name, built by lookup_name() */
+	struct dir_ent		**name_index;
+	unsigned int		name_index_size;
 };
 
 struct dir_ent {
@@ -48,14 +51,48 @@ struct dir_ent {
 	struct dir_ent		*next;
 };
 
+/*
+ * The parts of struct stat Mksquashfs uses.  The members have the same names
+ * as struct stat, so code can work on either.  St_mtime is a macro for
+ * the seconds field of a timespec on Linux and macOS, hence the anonymous
+ * structures
+ */
+struct inode_stat {
+	unsigned long long	st_dev;
+	unsigned long long	st_ino;
+	unsigned long long	st_rdev;
+	long long		st_size;
+	long long		st_blocks;
+#ifndef st_mtime
+	time_t			st_mtime;
+#elif defined(__APPLE__)
+	struct { time_t tv_sec; } st_mtimespec;
+#else
+	struct { time_t tv_sec; } st_mtim;
+#endif
+	unsigned int		st_mode;
+	unsigned int		st_uid;
+	unsigned int		st_gid;
+	unsigned int		st_nlink;
+};
+
 struct inode_info {
-	struct stat		buf;
-	struct inode_info	*next;
+	struct inode_stat	buf;
 	struct pseudo_dev	*pseudo;
 	struct tar_file		*tar_file;
+	struct image_file	*image_file;
+	/* xattrs read by the scanner threads, xattrs is -1 if not read */
+	struct xattr_list	*xattr_list;
 	squashfs_inode		inode;
+	/* physical offset of the file on the source disk, 0 if not known */
+	long long		physical;
 	unsigned int		inode_number;
 	unsigned int		nlink;
+	int			xattrs;
+	/* allocated from inode_pool, rather than malloced with a symlink */
+	char			pooled;
+	/* in the hardlink table */
+	char			hashed;
 	char			dummy_root_dir;
 	char			type;
 	char			read;
@@ -65,6 +102,7 @@ struct inode_info {
 	char			noD;
 	char			noF;
 	char			tarfile;
+	char			image;
 	char			symlink[0];
 };
 
@@ -82,8 +120,8 @@ struct file_info {
 	struct dup_info		*dup;
 	unsigned int		blocks;
 	unsigned short		checksum;
-	unsigned short		fragment_checksum;
-	char			have_frag_checksum;
+	unsigned long long	fragment_hash;
+	char			have_frag_hash;
 	char			have_checksum;
 };
 
@@ -153,9 +191,13 @@ struct append_file {
 /* in memory directory data */
 #define I_COUNT_SIZE		128
 #define DIR_ENTRIES		32
-#define INODE_HASH_SIZE		65536
-#define INODE_HASH_MASK		(INODE_HASH_SIZE - 1)
-#define INODE_HASH(dev, ino)	(ino & INODE_HASH_MASK)
+/* initial size of the hardlink table, must be a power of 2 */
+#define HARDLINK_TABLE_SIZE	65536
+/*
+ * lookup_name() searches directories with fewer entries than this linearly,
+ * larger directories get a name index
+ */
+#define NAME_INDEX_THRESHOLD	64
 
 struct cached_dir_index {
 	struct squashfs_dir_index	index;
@@ -188,6 +230,10 @@ struct exclude_info {
 struct pathname {
 	int names;
 	struct path_entry *name;
+	/* the names, to find duplicates when adding */
+	struct match_index *lookup;
+	/* built the first time the names are matched */
+	struct match_index *index;
 };
 
 struct pathnames {
@@ -218,6 +264,8 @@ extern struct compressor *comp;
 extern int block_size;
 extern int block_log;
 extern int sorted;
+extern int physical_read;
+extern long long prefetch_size;
 extern int noF;
 extern int noD;
 extern int old_exclude;
@@ -225,13 +273,14 @@ extern int no_fragments;
 extern int always_use_fragments;
 extern struct file_info **dupl_frag;
 extern int duplicate_checking;
+extern int fragment_verify;
 extern int no_hardlinks;
+extern int sparse_files;
 extern struct dir_info *root_dir;
 extern struct pathnames *paths;
 extern int tarfile;
 extern int root_mode_opt;
 extern mode_t root_mode;
-extern struct inode_info *inode_info[INODE_HASH_SIZE];
 
 extern int read_fs_bytes(int, long long, long long, void *);
 extern void add_file(long long, long long, long long, unsigned int *, int,
@@ -240,9 +289,13 @@ extern struct id *create_id(unsigned int);
 extern unsigned int get_uid(unsigned int);
 extern unsigned int get_guid(unsigned int);
 extern long long read_bytes(int, void *, long long);
-extern unsigned short get_checksum_mem(char *, int);
+extern int write_bytes(int, void *, long long);
+extern unsigned long long get_hash_mem(char *, int);
 extern int reproducible;
+extern int processors;
+extern int pseudo_processes;
 extern void *reader(void *arg);
+extern int pseudo_spool_size(int);
 extern squashfs_inode create_inode(struct dir_info *dir_info,
 	struct dir_ent *dir_ent, int type, long long byte_size,
 	long long start_block, unsigned int offset, unsigned int *block_list,
@@ -251,6 +304,9 @@ extern void free_fragment(struct fragment *fragment);
 extern struct file_info *write_file(struct dir_ent *dir_ent, int *dup);
 extern int excluded(char *name, struct pathnames *paths, struct pathnames **new);
 extern struct dir_ent *lookup_name(struct dir_info *dir, char *name);
+extern void add_name_index(struct dir_info *dir, struct dir_ent *dir_ent);
+extern void remove_name_index(struct dir_info *dir, struct dir_ent *dir_ent);
+extern void free_name_index(struct dir_info *dir);
 extern struct dir_ent *create_dir_entry(char *name, char *source_name,
 	char *nonstandard_pathname, struct dir_info *dir);
 extern void add_dir_entry(struct dir_ent *dir_ent, struct dir_info *sub_dir,
@@ -261,5 +317,9 @@ extern struct dir_info *create_dir(char *pathname, char *subpath, int depth);
 extern char *subpathname(struct dir_ent *dir_ent);
 extern struct dir_info *scan1_opendir(char *pathname, char *subpath, int depth);
 extern squashfs_inode do_directory_scans(struct dir_ent *dir_ent, int progress);
+extern struct inode_info *alloc_inode(int bytes);
+extern void get_inode_stat(struct inode_stat *dest, struct stat *buf);
 extern struct inode_info *lookup_inode(struct stat *buf);
+extern struct inode_info *lookup_inode3(struct stat *buf,
+	struct pseudo_dev *pseudo, char *symlink, int bytes);
 #endif
@@ -0,0 +1,203 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * prefetch.c
+ *
+ * Readahead thread.  The reader reads one file at a time, and waits for
+ * each read to complete, which is where it spends most of its time on a
+ * slow disk.  But the files it will read, and the order it will read them
+ * in, are known in advance from the directory tree (or the sort list).  This
+ * thread walks the same files ahead of the reader, and asks the kernel
+ * to read them into the page cache (posix_fadvise(WILLNEED)), so by the time
+ * the reader gets to them the reads are hopefully already done.
+ *
+ * It is kept no more than the budget ahead of the reader, as data read too
+ * far ahead may be evicted before it is used.  The reader reports its
+ * progress with prefetch_progress(), and files larger than the budget are
+ * prefetched a piece at a time.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "squashfs_fs.h"
+#include "mksquashfs.h"
+#include "mksquashfs_error.h"
+#include "progressbar.h"
+#include "pseudo.h"
+#include "image.h"
+#include "sort.h"
+#include "prefetch.h"
+
+#define FALSE 0
+#define TRUE 1
+
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_room = PTHREAD_COND_INITIALIZER;
+
+/* bytes prefetched, and bytes read by the reader, in the same order */
+static long long prefetched = 0, consumed = 0;
+static long long budget;
+static int prefetching = FALSE;
+
+
+/*
+ * Wait until <size> bytes can be prefetched without getting more than the
+ * budget ahead of the reader, and account for them
+ */
+static void reserve(long long size)
+{
+	pthread_mutex_lock(&prefetch_mutex);
+	while(prefetched + size > consumed + budget)
+		pthread_cond_wait(&prefetch_room, &prefetch_mutex);
+	prefetched += size;
+	pthread_mutex_unlock(&prefetch_mutex);
+}
+
+
+static void prefetch_file(struct dir_ent *dir_ent)
+{
+	long long size = dir_ent->inode->buf.st_size, offset, chunk;
+	char *filename = NULL;
+	int fd = -1;
+
+	if(size == 0)
+		return;
+
+	if(dir_ent->nonstandard_pathname)
+		fd = open(dir_ent->nonstandard_pathname, O_RDONLY);
+	else if(asprintf(&filename, "%s/%s", dir_ent->our_dir->pathname,
+				dir_ent->source_name ? : dir_ent->name) != -1) {
+		fd = open(filename, O_RDONLY);
+		free(filename);
+	}
+
+	/*
+	 * The reader reports the file's size whether it can read it or not,
+	 * so if it can't be opened here it is still accounted for
+	 */
+	for(offset = 0; offset < size; offset += chunk) {
+		chunk = size - offset;
+		if(chunk > PREFETCH_CHUNK)
+			chunk = PREFETCH_CHUNK;
+		if(chunk > budget)
+			chunk = budget;
+
+		reserve(chunk);
+
+		if(fd != -1)
+			posix_fadvise(fd, offset, chunk, POSIX_FADV_WILLNEED);
+	}
+
+	if(fd != -1)
+		close(fd);
+}
+
+
+/* pseudo files and image files aren't read from a source file */
+static inline int source_file(struct inode_info *inode)
+{
+	return !IS_PSEUDO_PROCESS(inode) && !IS_PSEUDO_DATA(inode) &&
+							!IS_IMAGE(inode);
+}
+
+
+static void prefetch_dir(struct dir_info *dir)
+{
+	struct dir_ent *dir_ent;
+
+	/* the same files reader_scan() reads, in the same order */
+	for(dir_ent = dir->list; dir_ent; dir_ent = dir_ent->next) {
+		struct inode_info *inode = dir_ent->inode;
+
+		if(inode->root_entry || !source_file(inode))
+			continue;
+
+		if(S_ISREG(inode->buf.st_mode))
+			prefetch_file(dir_ent);
+		else if(S_ISDIR(inode->buf.st_mode))
+			prefetch_dir(dir_ent->dir);
+	}
+}
+
+
+static void *prefetch_thrd(void *arg)
+{
+	sigset_t sigmask, old_mask;
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigmask, &old_mask);
+
+	if(sorted) {
+		struct priority_entry *entry;
+		int i;
+
+		for(i = 65535; i >= 0; i--)
+			for(entry = priority_list[i]; entry;
+							entry = entry->next)
+				if(source_file(entry->dir->inode))
+					prefetch_file(entry->dir);
+	} else
+		prefetch_dir(arg);
+
+	return NULL;
+}
+
+
+void prefetch_init(struct dir_info *dir, long long size)
+{
+	pthread_t thread;
+
+	budget = size;
+	prefetching = TRUE;
+
+	if(pthread_create(&thread, NULL, prefetch_thrd, dir) != 0)
+		BAD_ERROR("Failed to create thread\n");
+	pthread_detach(thread);
+}
+
+
+/*
+ * Called by the reader as it reads the files, in the order they were
+ * prefetched
+ */
+void prefetch_progress(long long bytes)
+{
+	if(!prefetching)
+		return;
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &prefetch_mutex);
+	pthread_mutex_lock(&prefetch_mutex);
+
+	consumed += bytes;
+	pthread_cond_signal(&prefetch_room);
+
+	pthread_cleanup_pop(1);
+}
@@ -46,6 +46,7 @@
 #include "info.h"
 #include "compressor.h"
 #include "process_fragments.h"
+#include "fnv.h"
 
 #define FALSE 0
 #define TRUE 1
@@ -56,24 +57,22 @@ extern int sparse_files;
 extern long long start_offset;
 
 /*
- * Compute 16 bit BSD checksum over the data, and check for sparseness
+ * Compute the 64 bit fragment hash over the data, and check for sparseness
  */
-static int checksum_sparse(struct file_buffer *file_buffer)
+static int hash_sparse(struct file_buffer *file_buffer)
 {
 	unsigned char *b = (unsigned char *) file_buffer->data;
-	unsigned short chksum = 0;
+	unsigned long long hash = FNV_OFFSET;
 	int bytes = file_buffer->size, sparse = TRUE, value;
 
 	while(bytes --) {
-		chksum = (chksum & 1) ? (chksum >> 1) | 0x8000 : chksum >> 1;
 		value = *b++;
-		if(value) {
+		if(value)
 			sparse = FALSE;
-			chksum += value;
-		}
+		hash = FNV_HASH(hash, value);
 	}
 
-	file_buffer->checksum = chksum;
+	file_buffer->hash = hash;
 	return sparse;
 }
 
@@ -217,12 +216,19 @@ finished:
 }
 
 
-struct file_buffer *get_fragment_cksum(struct file_info *file,
-	char *data_buffer, int fd, unsigned short *checksum)
+/*
+ * Get the hash of a fragment in the "old" filesystem being appended to.
+ * The fragment block is decompressed once, and the hashes of all the
+ * fragments it contains are computed and cached, so that later duplicate
+ * checks against them can be done without reading the block again
+ */
+static unsigned long long get_fragment_hash(struct file_info *file,
+	char *data_buffer, int fd)
 {
 	struct file_buffer *frag_buffer;
 	struct append_file *append;
 	int index = file->fragment->index;
+	unsigned long long hash = 0;
 
 	frag_buffer = get_fragment(file->fragment, data_buffer, fd);
 
@@ -232,20 +238,22 @@ struct file_buffer *get_fragment_cksum(struct file_info *file,
 		int offset = append->file->fragment->offset;
 		int size = append->file->fragment->size;
 		char *data = frag_buffer->data + offset;
-		unsigned short cksum = get_checksum_mem(data, size);
+		unsigned long long fhash = get_hash_mem(data, size);
 
 		if(file == append->file)
-			*checksum = cksum;
+			hash = fhash;
 
 		pthread_mutex_lock(&dup_mutex);
-		append->file->fragment_checksum = cksum;
-		append->file->have_frag_checksum = TRUE;
+		append->file->fragment_hash = fhash;
+		append->file->have_frag_hash = TRUE;
 		pthread_mutex_unlock(&dup_mutex);
 	}
 
 	pthread_cleanup_pop(0);
 
-	return frag_buffer;
+	cache_block_put(frag_buffer);
+
+	return hash;
 }
 
 
@@ -274,10 +282,10 @@ void *frag_thrd(void *destination_file)
 	while(1) {
 		struct file_buffer *file_buffer = queue_get(to_process_frag);
 		struct file_buffer *buffer;
-		int sparse = checksum_sparse(file_buffer);
+		int sparse = hash_sparse(file_buffer);
 		struct file_info *dupl_ptr;
 		long long file_size;
-		unsigned short checksum;
+		unsigned long long hash;
 		char flag;
 		int res;
 
@@ -321,35 +329,34 @@ void *frag_thrd(void *destination_file)
 				continue;
 
 			pthread_mutex_lock(&dup_mutex);
-			flag = dupl_ptr->have_frag_checksum;
-			checksum = dupl_ptr->fragment_checksum;
+			flag = dupl_ptr->have_frag_hash;
+			hash = dupl_ptr->fragment_hash;
 			pthread_mutex_unlock(&dup_mutex);
 
 			/*
-			 * If we have the checksum and it matches then
-			 * read in the fragment block.
+			 * If we *don't* have the hash, then we are appending,
+			 * and the fragment block is on the "old" filesystem.
+			 * Read it in and hash the fragments it contains.
 			 *
-			 * If we *don't* have the checksum, then we are
-			 * appending, and the fragment block is on the
-			 * "old" filesystem.  Read it in and checksum
-			 * the entire fragment buffer
+			 * Fragments with matching hashes are then byte
+			 * compared, unless -no-fragment-verify has been
+			 * specified, in which case the hash decides
 			 */
-			if(!flag) {
-				buffer = get_fragment_cksum(dupl_ptr,
-					data_buffer, fd, &checksum);
-				if(checksum != file_buffer->checksum) {
-					cache_block_put(buffer);
-					continue;
-				}
-			} else if(checksum == file_buffer->checksum)
+			if(!flag)
+				hash = get_fragment_hash(dupl_ptr, data_buffer, fd);
+
+			if(hash != file_buffer->hash)
+				continue;
+
+			if(fragment_verify) {
 				buffer = get_fragment(dupl_ptr->fragment,
 					data_buffer, fd);
-			else
-				continue;
+				res = memcmp(file_buffer->data, buffer->data +
+					dupl_ptr->fragment->offset, file_size);
+				cache_block_put(buffer);
+			} else
+				res = 0;
 
-			res = memcmp(file_buffer->data, buffer->data +
-				dupl_ptr->fragment->offset, file_size);
-			cache_block_put(buffer);
 			if(res == 0) {
 				struct file_buffer *dup = malloc(sizeof(*dup));
 				if(dup == NULL)
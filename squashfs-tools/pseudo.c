@@ -38,6 +38,7 @@
 #include <ctype.h>
 
 #include "pseudo.h"
+#include "fnv.h"
 #include "mksquashfs_error.h"
 #include "progressbar.h"
 
@@ -47,15 +48,18 @@
 
 struct pseudo *pseudo = NULL;
 
-static char *get_component(char *target, char **targname)
+/*
+ * Split off the first component of target, returning its length in len,
+ * and the rest of target after it
+ */
+static char *get_component(char *target, int *len)
 {
-	char *start;
+	char *start = target;
 
-	start = target;
 	while(*target != '/' && *target != '\0')
 		target ++;
 
-	*targname = strndup(start, target - start);
+	*len = target - start;
 
 	while(*target == '/')
 		target ++;
@@ -64,40 +68,130 @@ static char *get_component(char *target, char **targname)
 }
 
 
+static unsigned int pseudo_hash(char *name, int len, int size)
+{
+	unsigned long long hash = FNV_OFFSET;
+
+	while(len --)
+		hash = FNV_HASH(hash, (unsigned char) *name++);
+
+	return hash & (size - 1);
+}
+
+
+static struct pseudo *new_pseudo()
+{
+	struct pseudo *pseudo = malloc(sizeof(struct pseudo));
+
+	if(pseudo == NULL)
+		MEM_ERROR();
+
+	pseudo->names = pseudo->count = pseudo->size = 0;
+	pseudo->name = NULL;
+	pseudo->table = NULL;
+	pseudo->table_size = 0;
+
+	return pseudo;
+}
+
+
+static void insert_name(struct pseudo *pseudo, int i)
+{
+	char *name = pseudo->name[i].name;
+	unsigned int hash = pseudo_hash(name, strlen(name), pseudo->table_size);
+
+	while(pseudo->table[hash] != -1)
+		hash = (hash + 1) & (pseudo->table_size - 1);
+
+	pseudo->table[hash] = i;
+}
+
+
 /*
- * Add pseudo device target to the set of pseudo devices.  Pseudo_dev
- * describes the pseudo device attributes.
+ * Find name (of length len, not necessarily nul terminated) in the pseudo
+ * directory, returning its index or -1
  */
-struct pseudo *add_pseudo(struct pseudo *pseudo, struct pseudo_dev *pseudo_dev,
-	char *target, char *alltarget)
+static int find_name(struct pseudo *pseudo, char *name, int len)
 {
-	char *targname;
-	int i;
+	unsigned int hash;
 
-	target = get_component(target, &targname);
+	if(pseudo->table_size == 0)
+		return -1;
 
-	if(pseudo == NULL) {
-		pseudo = malloc(sizeof(struct pseudo));
-		if(pseudo == NULL)
-			MEM_ERROR();
+	hash = pseudo_hash(name, len, pseudo->table_size);
+
+	for(; pseudo->table[hash] != -1; hash = (hash + 1) &
+						(pseudo->table_size - 1)) {
+		char *entry = pseudo->name[pseudo->table[hash]].name;
 
-		pseudo->names = 0;
-		pseudo->count = 0;
-		pseudo->name = NULL;
+		if(strncmp(entry, name, len) == 0 && entry[len] == '\0')
+			return pseudo->table[hash];
 	}
 
-	for(i = 0; i < pseudo->names; i++)
-		if(strcmp(pseudo->name[i].name, targname) == 0)
-			break;
+	return -1;
+}
 
-	if(i == pseudo->names) {
-		/* allocate new name entry */
-		pseudo->names ++;
-		pseudo->name = realloc(pseudo->name, (i + 1) *
+
+/* add a new entry called name (of length len), returning its index */
+static int add_name(struct pseudo *pseudo, char *name, int len)
+{
+	int i = pseudo->names ++;
+
+	if(i == pseudo->size) {
+		pseudo->size = pseudo->size ? pseudo->size * 2 : 16;
+		pseudo->name = realloc(pseudo->name, pseudo->size *
 			sizeof(struct pseudo_entry));
 		if(pseudo->name == NULL)
 			MEM_ERROR();
-		pseudo->name[i].name = targname;
+	}
+
+	pseudo->name[i].name = strndup(name, len);
+	if(pseudo->name[i].name == NULL)
+		MEM_ERROR();
+
+	/* keep the hash table at most 3/4 full */
+	if(pseudo->names * 4 > pseudo->table_size * 3) {
+		int n;
+
+		pseudo->table_size = pseudo->table_size ?
+			pseudo->table_size * 2 : 32;
+		free(pseudo->table);
+		pseudo->table = malloc(pseudo->table_size * sizeof(int));
+		if(pseudo->table == NULL)
+			MEM_ERROR();
+
+		for(n = 0; n < pseudo->table_size; n++)
+			pseudo->table[n] = -1;
+
+		for(n = 0; n < pseudo->names; n++)
+			insert_name(pseudo, n);
+	} else
+		insert_name(pseudo, i);
+
+	return i;
+}
+
+
+/*
+ * Add pseudo device target to the set of pseudo devices.  Pseudo_dev
+ * describes the pseudo device attributes.
+ */
+struct pseudo *add_pseudo(struct pseudo *pseudo, struct pseudo_dev *pseudo_dev,
+	char *target, char *alltarget)
+{
+	char *targname = target;
+	int i, len;
+
+	target = get_component(target, &len);
+
+	if(pseudo == NULL)
+		pseudo = new_pseudo();
+
+	i = find_name(pseudo, targname, len);
+
+	if(i == -1) {
+		/* allocate new name entry */
+		i = add_name(pseudo, targname, len);
 
 		if(target[0] == '\0') {
 			/* at leaf pathname component */
@@ -112,8 +206,6 @@ struct pseudo *add_pseudo(struct pseudo *pseudo, struct pseudo_dev *pseudo_dev,
 		}
 	} else {
 		/* existing matching entry */
-		free(targname);
-
 		if(pseudo->name[i].pseudo == NULL) {
 			/* No sub-directory which means this is the leaf
 			 * component of a pre-existing pseudo file.
@@ -192,17 +284,9 @@ struct pseudo *add_pseudo_definition(struct pseudo *pseudo, struct pseudo_dev *p
 			pseudo->name[0].dev = pseudo_dev;
 			return pseudo;
 		} else {
-			struct pseudo *new = malloc(sizeof(struct pseudo));
-			if(new == NULL)
-				MEM_ERROR();
-
-			new->names = 1;
-			new->count = 0;
-			new->name = malloc(sizeof(struct pseudo_entry));
-			if(new->name == NULL)
-				MEM_ERROR();
+			struct pseudo *new = new_pseudo();
 
-			new->name[0].name = "/";
+			add_name(new, "/", 1);
 			new->name[0].pseudo = pseudo;
 			new->name[0].pathname = "/";
 			new->name[0].dev = pseudo_dev;
@@ -231,11 +315,9 @@ struct pseudo *pseudo_subdir(char *filename, struct pseudo *pseudo)
 	if(pseudo == NULL)
 		return NULL;
 
-	for(i = 0; i < pseudo->names; i++)
-		if(strcmp(filename, pseudo->name[i].name) == 0)
-			return pseudo->name[i].pseudo;
+	i = find_name(pseudo, filename, strlen(filename));
 
-	return NULL;
+	return i == -1 ? NULL : pseudo->name[i].pseudo;
 }
 
 
@@ -259,7 +341,11 @@ int pseudo_exec_file(struct pseudo_dev *dev, int *child)
 {
 	int res, pipefd[2];
 
-	res = pipe(pipefd);
+	/*
+	 * Close on exec, as other commands can be being started at the
+	 * same time, and must not hold our pipe open
+	 */
+	res = pipe2(pipefd, O_CLOEXEC);
 	if(res == -1) {
 		ERROR("Executing dynamic pseudo file, pipe failed\n");
 		return 0;
@@ -377,21 +463,16 @@ failed:
 
 struct pseudo_entry *pseudo_lookup(struct pseudo *pseudo, char *target)
 {
-	char *targname;
-	int i;
+	char *targname = target;
+	int i, len;
 
 	if(pseudo == NULL)
 		return NULL;
 
-	target = get_component(target, &targname);
-
-	for(i = 0; i < pseudo->names; i++)
-		if(strcmp(pseudo->name[i].name, targname) == 0)
-			break;
-
-	free(targname);
+	target = get_component(target, &len);
 
-	if(i == pseudo->names)
+	i = find_name(pseudo, targname, len);
+	if(i == -1)
 		return NULL;
 
 	if(target[0] == '\0')
@@ -81,6 +81,10 @@ struct pseudo {
 	int			names;
 	int			count;
 	struct pseudo_entry	*name;
+	/* allocated size of name, and hash table of its indexes */
+	int			size;
+	int			*table;
+	int			table_size;
 };
 
 extern long long read_bytes(int, void *, long long);
@@ -35,6 +35,7 @@
 #include <limits.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_swap.h"
@@ -103,6 +104,148 @@ int read_block(int fd, long long start, long long *next, int expected,
 }
 
 
+/*
+ * Find the start of the metadata blocks in a metadata table.  Only the
+ * two byte block headers are read, which is enough to step from one block
+ * to the next without decompressing anything.  If count is -1 the table
+ * is scanned up to <end>, otherwise <count> blocks are located.
+ */
+static long long *scan_metadata_blocks(int fd, long long start, long long end,
+	int count, int *blocks)
+{
+	long long *index = NULL;
+	int i, alloc = 0;
+
+	for(i = 0; count == -1 ? start < end : i < count; i++) {
+		unsigned short c_byte;
+
+		if(i == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			index = realloc(index, alloc * sizeof(long long));
+			if(index == NULL)
+				MEM_ERROR();
+		}
+
+		if(read_fs_bytes(fd, start, 2, &c_byte) == 0)
+			goto failed;
+
+		SQUASHFS_INSWAP_SHORTS(&c_byte, 1);
+		c_byte = SQUASHFS_COMPRESSED_SIZE(c_byte);
+		if(c_byte > SQUASHFS_METADATA_SIZE)
+			goto failed;
+
+		index[i] = start;
+		start += 2 + c_byte;
+	}
+
+	*blocks = i;
+	return index;
+
+failed:
+	free(index);
+	return NULL;
+}
+
+
+struct metadata_read {
+	int			fd;
+	long long		*index;
+	int			blocks;
+	int			size;
+	unsigned char		*table;
+	int			next;
+	int			failed;
+	int			last;
+	pthread_mutex_t		mutex;
+};
+
+
+static void *metadata_reader(void *arg)
+{
+	struct metadata_read *read = arg;
+
+	while(1) {
+		int i, expected, res;
+
+		pthread_mutex_lock(&read->mutex);
+		i = read->failed ? read->blocks : read->next ++;
+		pthread_mutex_unlock(&read->mutex);
+
+		if(i >= read->blocks)
+			break;
+
+		/*
+		 * Every block other than the last should decompress to
+		 * SQUASHFS_METADATA_SIZE bytes.  If the amount of data wanted
+		 * is known, use that to decide, as the original serial reader
+		 * did
+		 */
+		if(read->size == -1)
+			expected = i < read->blocks - 1 ? SQUASHFS_METADATA_SIZE : 0;
+		else
+			expected = (read->size - i * SQUASHFS_METADATA_SIZE) >=
+				SQUASHFS_METADATA_SIZE ? SQUASHFS_METADATA_SIZE : 0;
+
+		TRACE("metadata_reader: reading block 0x%llx\n", read->index[i]);
+		res = read_block(read->fd, read->index[i], NULL, expected,
+			read->table + i * SQUASHFS_METADATA_SIZE);
+
+		pthread_mutex_lock(&read->mutex);
+		if(res == 0)
+			read->failed = TRUE;
+		else if(i == read->blocks - 1)
+			read->last = res;
+		pthread_mutex_unlock(&read->mutex);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Decompress the metadata blocks located by scan_metadata_blocks() into
+ * <table>, block i being stored at i * SQUASHFS_METADATA_SIZE.  Because each
+ * block has a fixed position in the output the blocks can be decompressed
+ * in parallel, using up to <processors> threads.
+ *
+ * Returns the number of bytes decompressed, or 0 on failure.
+ */
+static int read_metadata_blocks(int fd, long long *index, int blocks, int size,
+	unsigned char *table)
+{
+	struct metadata_read read = { fd, index, blocks, size, table, 0, FALSE,
+		0, PTHREAD_MUTEX_INITIALIZER };
+	int i, threads = processors < blocks ? processors : blocks;
+	pthread_t *thread = NULL;
+
+	if(blocks == 0)
+		return 0;
+
+	if(threads > 1) {
+		thread = malloc((threads - 1) * sizeof(pthread_t));
+		if(thread == NULL)
+			MEM_ERROR();
+
+		for(i = 0; i < threads - 1; i++)
+			if(pthread_create(&thread[i], NULL, metadata_reader, &read))
+				BAD_ERROR("Failed to create thread\n");
+	}
+
+	metadata_reader(&read);
+
+	for(i = 0; i < threads - 1; i++)
+		pthread_join(thread[i], NULL);
+
+	free(thread);
+
+	if(read.failed)
+		return 0;
+
+	return (blocks - 1) * SQUASHFS_METADATA_SIZE + read.last;
+}
+
+
+
 #define NO_BYTES(SIZE) \
 	(bytes - (cur_ptr - inode_table) < (SIZE))
 
@@ -119,57 +262,42 @@ unsigned char *scan_inode_table(int fd, long long start, long long end,
 {
 	unsigned char *cur_ptr;
 	unsigned char *inode_table = NULL;
-	int byte, files = 0;
-	unsigned int directory_start_block, bytes = 0, size = 0;
+	int i, blocks, files = 0;
+	unsigned int directory_start_block, bytes = 0;
 	struct squashfs_base_inode_header base;
-	int alloc_size;
+	long long *index = NULL;
 
 	TRACE("scan_inode_table: start 0x%llx, end 0x%llx, root_inode_start "
 		"0x%llx\n", start, end, root_inode_start);
 
 	/*
-	 * Use the size of the compressed inode table as an initial
-	 * memory allocation value, and the reallocation value, if
-	 * this is too small.
-	 *
-	 * With a 50% compression ratio, this should require 2 alloc calls
-	 * With a 25% compression ratio, this should require 4 alloc calls
-	 * With a 12.5% compression ratio, this should require 8 alloc calls
-	 *
-	 * Always round to a multiple of SQUASHFS_METADATA_SIZE
+	 * Locate the metadata blocks first.  Knowing how many blocks there
+	 * are allows the inode table to be allocated in one go, and the
+	 * blocks to be decompressed in parallel directly into place
 	 */
-	alloc_size = ((end - start) + SQUASHFS_METADATA_SIZE) & ~(SQUASHFS_METADATA_SIZE - 1);
+	index = scan_metadata_blocks(fd, start, end, -1, &blocks);
+	if(index == NULL || blocks == 0)
+		goto corrupted;
+
+	inode_table = malloc(blocks * SQUASHFS_METADATA_SIZE);
+	if(inode_table == NULL)
+		MEM_ERROR();
+
+	bytes = read_metadata_blocks(fd, index, blocks, -1, inode_table);
+	if(bytes == 0)
+		goto corrupted;
 
 	/* Rogue value used to check if it was found */
 	*root_inode_block = -1LL;
-	while(start < end) {
-		if(start == root_inode_start) {
+	for(i = 0; i < blocks; i++)
+		if(index[i] == root_inode_start) {
 			TRACE("scan_inode_table: read compressed block 0x%llx "
-				"containing root inode\n", start);
-			*root_inode_block = bytes;
+				"containing root inode\n", index[i]);
+			*root_inode_block = i * SQUASHFS_METADATA_SIZE;
 		}
-		if(size - bytes < SQUASHFS_METADATA_SIZE) {
-			inode_table = realloc(inode_table, size
-				+= alloc_size);
-			if(inode_table == NULL)
-				MEM_ERROR();
-		}
-		TRACE("scan_inode_table: reading block 0x%llx\n", start);
-		byte = read_block(fd, start, &start, 0, inode_table + bytes);
-		if(byte == 0)
-			goto corrupted;
 
-		bytes += byte;
-
-		/* If this is not the last metadata block in the inode table
-		 * then it should be SQUASHFS_METADATA_SIZE in size.
-		 * Note, we can't use expected in read_block() above for this
-		 * because we don't know if this is the last block until
-		 * after reading.
-		 */
-		if(start != end && byte != SQUASHFS_METADATA_SIZE)
-			goto corrupted;
-	}
+	free(index);
+	index = NULL;
 
 	/*
 	 * We expect to have found the metadata block containing the
@@ -555,6 +683,7 @@ unsigned char *scan_inode_table(int fd, long long start, long long end,
 corrupted:
 	ERROR("scan_inode_table: filesystem corruption detected in "
 		"scanning metadata\n");
+	free(index);
 	free(inode_table);
 	return NULL;
 }
@@ -698,9 +827,9 @@ unsigned char *squashfs_readdir(int fd, int root_entries,
 		__attribute__ ((aligned));
 	struct squashfs_dir_entry *dire = (struct squashfs_dir_entry *) buffer;
 	unsigned char *directory_table = NULL;
-	int byte, bytes = 0, dir_count;
+	int bytes, blocks, dir_count;
 	long long start = sBlk->directory_table_start + directory_start_block,
-		last_start_block = start; 
+		last_start_block = start, *index;
 
 	size += offset;
 	directory_table = malloc((size + SQUASHFS_METADATA_SIZE * 2 - 1) &
@@ -708,24 +837,29 @@ unsigned char *squashfs_readdir(int fd, int root_entries,
 	if(directory_table == NULL)
 		MEM_ERROR();
 
-	while(bytes < size) {
-		int expected = (size - bytes) >= SQUASHFS_METADATA_SIZE ?
-			SQUASHFS_METADATA_SIZE : 0;
+	/*
+	 * All but the last metadata block are SQUASHFS_METADATA_SIZE bytes,
+	 * and so the number of blocks holding the directory is known
+	 * in advance.  Locate them and decompress them in parallel
+	 */
+	blocks = (size + SQUASHFS_METADATA_SIZE - 1) / SQUASHFS_METADATA_SIZE;
+	index = scan_metadata_blocks(fd, start, 0, blocks, &blocks);
+	if(index == NULL)
+		goto failed;
+
+	if(blocks) {
+		last_start_block = index[blocks - 1];
 
-		TRACE("squashfs_readdir: reading block 0x%llx, bytes read so "
-			"far %d\n", start, bytes);
+		TRACE("squashfs_readdir: reading %d blocks from 0x%llx\n",
+			blocks, start);
 
-		last_start_block = start;
-		byte = read_block(fd, start, &start, expected, directory_table + bytes);
-		if(byte == 0) {
-			ERROR("Failed to read directory\n");
-			ERROR("Filesystem corrupted?\n");
-			free(directory_table);
-			return NULL;
-		}
-		bytes += byte;
+		if(read_metadata_blocks(fd, index, blocks, size,
+							directory_table) < size)
+			goto failed;
 	}
 
+	free(index);
+
 	if(!root_entries)
 		goto all_done;
 
@@ -775,6 +909,13 @@ all_done:
 	*last_directory_block = (unsigned int) last_start_block -
 		sBlk->directory_table_start;
 	return directory_table;
+
+failed:
+	ERROR("Failed to read directory\n");
+	ERROR("Filesystem corrupted?\n");
+	free(index);
+	free(directory_table);
+	return NULL;
 }
 
 
@@ -26,9 +26,30 @@
 #define TRUE 1
 #define FALSE 0
 
+/* most directory fds kept open by the reader, and the hash table size */
+#define DIR_FD_MAX		1024
+#define DIR_FD_HASH_SIZE	1024
+
+/*
+ * dynamic pseudo file output kept in memory, the rest is spooled to a
+ * temporary file, and how many commands per process can run ahead
+ */
+#define PSEUDO_SPOOL_MEM	(1024 * 1024)
+#define PSEUDO_COPY_SIZE	65536
+#define PSEUDO_AHEAD		2
+
+#define PSEUDO_QUEUED		0
+#define PSEUDO_DONE		1
+
+#define PSEUDO_EXEC_ERROR	1
+#define PSEUDO_READ_ERROR	2
+#define PSEUDO_EXIT_ERROR	3
+
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -38,6 +59,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 #include "squashfs_fs.h"
 #include "mksquashfs.h"
 #include "caches-queues-lists.h"
@@ -46,6 +68,9 @@
 #include "pseudo.h"
 #include "sort.h"
 #include "tar.h"
+#include "squashfs_read.h"
+#include "image.h"
+#include "prefetch.h"
 
 static void sigalrm_handler()
 {
@@ -96,6 +121,209 @@ static char *pathname(struct dir_ent *dir_ent)
 }
 
 
+/*
+ * Opening every file by its full pathname makes the kernel walk the whole
+ * path each time, which on deep trees over NFS or FUSE is the dominant
+ * cost.  Instead the reader keeps the directories open and opens files with
+ * openat().  The number of directory fds is bounded by dir_fd_budget, when
+ * it is reached the least recently used is closed.  This is only used by the
+ * reader thread, and so needs no locking
+ */
+struct dir_fd {
+	struct dir_info		*dir;
+	int			fd;
+	struct dir_fd		*hash_next;
+	struct dir_fd		*lru_prev;
+	struct dir_fd		*lru_next;
+};
+
+static struct dir_fd *dir_fd_table[DIR_FD_HASH_SIZE];
+static struct dir_fd *dir_fds = NULL, *lru_head = NULL, *lru_tail = NULL;
+static int dir_fd_budget = -1, dir_fd_count = 0;
+
+
+static inline int dir_fd_hash(struct dir_info *dir)
+{
+	unsigned long long hash = (unsigned long long) (size_t) dir *
+							0x9e3779b97f4a7c15ULL;
+
+	return (hash >> 32) & (DIR_FD_HASH_SIZE - 1);
+}
+
+
+static void lru_remove(struct dir_fd *entry)
+{
+	if(entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		lru_head = entry->lru_next;
+
+	if(entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		lru_tail = entry->lru_prev;
+}
+
+
+static void lru_add(struct dir_fd *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = lru_head;
+	if(lru_head)
+		lru_head->lru_prev = entry;
+	else
+		lru_tail = entry;
+	lru_head = entry;
+}
+
+
+/*
+ * Close the least recently used directory fd, returning its slot.  Returns
+ * NULL if there are no directory fds open
+ */
+static struct dir_fd *evict_dir_fd()
+{
+	struct dir_fd *entry = lru_tail, **hash;
+
+	if(entry == NULL)
+		return NULL;
+
+	for(hash = &dir_fd_table[dir_fd_hash(entry->dir)]; *hash != entry;
+						hash = &(*hash)->hash_next);
+	*hash = entry->hash_next;
+
+	lru_remove(entry);
+	close(entry->fd);
+
+	return entry;
+}
+
+
+/*
+ * Use at most a quarter of the fd limit, leaving the rest for the files
+ * being read, and everything else Mksquashfs has open
+ */
+static void init_dir_fds()
+{
+	struct rlimit rlim;
+
+	if(getrlimit(RLIMIT_NOFILE, &rlim) == -1 || rlim.rlim_cur ==
+								RLIM_INFINITY)
+		dir_fd_budget = DIR_FD_MAX;
+	else
+		dir_fd_budget = rlim.rlim_cur / 4 < DIR_FD_MAX ?
+						rlim.rlim_cur / 4 : DIR_FD_MAX;
+
+	/* the parent has to stay open while the child is opened */
+	if(dir_fd_budget < 2)
+		dir_fd_budget = 0;
+	else {
+		dir_fds = malloc(dir_fd_budget * sizeof(struct dir_fd));
+		if(dir_fds == NULL)
+			MEM_ERROR();
+	}
+}
+
+
+/*
+ * Return an fd for dir, or -1 if it can't be opened.  If the directory
+ * was reached by the scan from its parent, it is opened relative to the
+ * parent (recursively), otherwise by its pathname
+ */
+static int get_dir_fd(struct dir_info *dir)
+{
+	struct dir_ent *dir_ent = dir->dir_ent;
+	struct dir_fd *entry;
+	int fd, parent = -1, hash = dir_fd_hash(dir);
+
+	if(dir_fd_budget == -1)
+		init_dir_fds();
+
+	if(dir_fd_budget == 0 || dir->pathname[0] == '\0')
+		return -1;
+
+	for(entry = dir_fd_table[hash]; entry; entry = entry->hash_next)
+		if(entry->dir == dir) {
+			lru_remove(entry);
+			lru_add(entry);
+			return entry->fd;
+		}
+
+	if(dir_ent && dir_ent->our_dir && dir_ent->nonstandard_pathname == NULL)
+		parent = get_dir_fd(dir_ent->our_dir);
+
+	while(1) {
+		if(parent != -1)
+			fd = openat(parent, dir_ent->source_name ? :
+				dir_ent->name, O_RDONLY | O_DIRECTORY);
+		else
+			fd = open(dir->pathname, O_RDONLY | O_DIRECTORY);
+
+		if(fd != -1 || errno != EINTR)
+			break;
+	}
+
+	if(fd == -1)
+		return -1;
+
+	if(dir_fd_count < dir_fd_budget)
+		entry = &dir_fds[dir_fd_count ++];
+	else
+		entry = evict_dir_fd();
+
+	entry->dir = dir;
+	entry->fd = fd;
+	entry->hash_next = dir_fd_table[hash];
+	dir_fd_table[hash] = entry;
+	lru_add(entry);
+
+	return fd;
+}
+
+
+static void close_dir_fds()
+{
+	while(evict_dir_fd());
+	free(dir_fds);
+	dir_fds = NULL;
+	dir_fd_count = 0;
+}
+
+
+/*
+ * Open the file, relative to its directory if possible.  If the open fails
+ * because the process is out of fds, close the directory fds, stop using
+ * them, and try again by pathname
+ */
+static int open_file(struct dir_ent *dir_ent)
+{
+	int dir_fd = -1, file;
+
+	if(dir_ent->nonstandard_pathname == NULL)
+		dir_fd = get_dir_fd(dir_ent->our_dir);
+
+	while(1) {
+		if(dir_fd != -1)
+			file = openat(dir_fd, dir_ent->source_name ? :
+						dir_ent->name, O_RDONLY);
+		else
+			file = open(pathname(dir_ent), O_RDONLY);
+
+		if(file != -1)
+			break;
+
+		if(errno == EMFILE && dir_fd_count) {
+			close_dir_fds();
+			dir_fd_budget = 0;
+			dir_fd = -1;
+		} else if(errno != EINTR)
+			break;
+	}
+
+	return file;
+}
+
+
 static inline int is_fragment(struct inode_info *inode)
 {
 	off_t file_size = inode->buf.st_size;
@@ -132,22 +360,338 @@ static void put_file_buffer(struct file_buffer *file_buffer)
 }
 
 
+/*
+ * Dynamic pseudo files.  Rather than the reader running each command and
+ * waiting for it to finish, the commands are run ahead of time by the
+ * pseudo threads, at most pseudo_processes at once.  Their output is
+ * spooled, the first PSEUDO_SPOOL_MEM bytes in memory and the rest to a
+ * temporary file, and the reader then reads the output of each in turn
+ */
+struct pseudo_job {
+	struct dir_ent	*dir_ent;
+	int		state;
+	int		error;
+	char		*buffer;
+	long long	size;
+	long long	offset;
+	/* temporary file holding the output after the first size bytes */
+	FILE		*spool;
+};
+
+static pthread_mutex_t pseudo_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pseudo_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pseudo_done = PTHREAD_COND_INITIALIZER;
+
+/* the dynamic pseudo files, in the order the reader reads them */
+static struct pseudo_job *pseudo_jobs = NULL;
+static int pseudo_count = 0, pseudo_next = 0, pseudo_consumed = 0;
+static int pseudo_ahead;
+
+
+static void spool_output(struct pseudo_job *job, int file, char *copy)
+{
+	long long bytes;
+
+	job->spool = tmpfile();
+	if(job->spool == NULL) {
+		ERROR("Failed to create dynamic pseudo file spool because %s\n",
+			strerror(errno));
+		job->error = PSEUDO_READ_ERROR;
+		return;
+	}
+
+	/* don't leak the spool into the other commands */
+	fcntl(fileno(job->spool), F_SETFD, FD_CLOEXEC);
+
+	while((bytes = read_bytes(file, copy, PSEUDO_COPY_SIZE)) > 0)
+		if(write_bytes(fileno(job->spool), copy, bytes) == -1)
+			break;
+
+	if(bytes != 0 || lseek(fileno(job->spool), 0, SEEK_SET) == -1)
+		job->error = PSEUDO_READ_ERROR;
+}
+
+
+static void run_pseudo_job(struct pseudo_job *job, char *copy)
+{
+	int file, child, status, res;
+
+	file = pseudo_exec_file(job->dir_ent->inode->pseudo, &child);
+	if(!file) {
+		job->error = PSEUDO_EXEC_ERROR;
+		return;
+	}
+
+	job->buffer = malloc(PSEUDO_SPOOL_MEM);
+	if(job->buffer == NULL)
+		MEM_ERROR();
+
+	job->size = read_bytes(file, job->buffer, PSEUDO_SPOOL_MEM);
+	if(job->size == -1) {
+		job->size = 0;
+		job->error = PSEUDO_READ_ERROR;
+	} else if(job->size == PSEUDO_SPOOL_MEM)
+		spool_output(job, file, copy);
+
+	close(file);
+
+	while(1) {
+		res = waitpid(child, &status, 0);
+		if(res != -1)
+			break;
+		else if(errno != EINTR)
+			BAD_ERROR("read process: waitpid returned %d\n", errno);
+	}
+
+	if(job->error == 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+		job->error = PSEUDO_EXIT_ERROR;
+}
+
+
+static void *pseudo_thrd(void *arg)
+{
+	sigset_t sigmask, old_mask;
+	char *copy = malloc(PSEUDO_COPY_SIZE);
+
+	if(copy == NULL)
+		MEM_ERROR();
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigmask, &old_mask);
+
+	while(1) {
+		struct pseudo_job *job;
+
+		pthread_mutex_lock(&pseudo_mutex);
+		while(pseudo_next < pseudo_count && pseudo_next >=
+						pseudo_consumed + pseudo_ahead)
+			pthread_cond_wait(&pseudo_work, &pseudo_mutex);
+
+		if(pseudo_next == pseudo_count) {
+			pthread_mutex_unlock(&pseudo_mutex);
+			break;
+		}
+
+		job = &pseudo_jobs[pseudo_next ++];
+		pthread_mutex_unlock(&pseudo_mutex);
+
+		run_pseudo_job(job, copy);
+
+		pthread_mutex_lock(&pseudo_mutex);
+		job->state = PSEUDO_DONE;
+		pthread_cond_broadcast(&pseudo_done);
+		pthread_mutex_unlock(&pseudo_mutex);
+	}
+
+	free(copy);
+	return NULL;
+}
+
+
+/*
+ * Memory in Mbytes used to hold the output of the commands run ahead by
+ * <processes> pseudo threads, plus the one being read
+ */
+int pseudo_spool_size(int processes)
+{
+	return (processes * PSEUDO_AHEAD + 1) * (PSEUDO_SPOOL_MEM >> 20);
+}
+
+
+/*
+ * Add a dynamic pseudo file to be run ahead.  The read flag is used to
+ * skip hard links to a file already added, and is cleared afterwards
+ */
+static void add_pseudo_job(struct dir_ent *dir_ent)
+{
+	struct inode_info *inode = dir_ent->inode;
+
+	if(inode->read)
+		return;
+
+	if(pseudo_count % 64 == 0) {
+		pseudo_jobs = realloc(pseudo_jobs, (pseudo_count + 64) *
+			sizeof(struct pseudo_job));
+		if(pseudo_jobs == NULL)
+			MEM_ERROR();
+	}
+
+	pseudo_jobs[pseudo_count].dir_ent = dir_ent;
+	pseudo_jobs[pseudo_count].state = PSEUDO_QUEUED;
+	pseudo_jobs[pseudo_count].error = 0;
+	pseudo_jobs[pseudo_count].buffer = NULL;
+	pseudo_jobs[pseudo_count].size = 0;
+	pseudo_jobs[pseudo_count].offset = 0;
+	pseudo_jobs[pseudo_count ++].spool = NULL;
+	inode->read = TRUE;
+}
+
+
+/*
+ * Find the dynamic pseudo files, in the same order as reader_scan() will
+ * read them
+ */
+static void find_pseudo_jobs(struct dir_info *dir)
+{
+	struct dir_ent *dir_ent = dir->list;
+
+	for(; dir_ent; dir_ent = dir_ent->next) {
+		struct inode_info *inode = dir_ent->inode;
+
+		if(inode->root_entry)
+			continue;
+
+		if(IS_PSEUDO_PROCESS(inode))
+			add_pseudo_job(dir_ent);
+		else if(!IS_PSEUDO_DATA(inode) && S_ISDIR(inode->buf.st_mode))
+			find_pseudo_jobs(dir_ent->dir);
+	}
+}
+
+
+/*
+ * Run the dynamic pseudo file commands ahead of the reader, if
+ * -pseudo-processes is given.  Otherwise the reader runs each command
+ * when it gets to it
+ */
+static void start_pseudo_jobs(struct dir_info *dir)
+{
+	pthread_t thread;
+	int i, threads = pseudo_processes;
+
+	if(pseudo_processes == 0)
+		return;
+
+	if(sorted) {
+		struct priority_entry *entry;
+
+		for(i = 65535; i >= 0; i--)
+			for(entry = priority_list[i]; entry;
+							entry = entry->next)
+				if(IS_PSEUDO_PROCESS(entry->dir->inode))
+					add_pseudo_job(entry->dir);
+	} else
+		find_pseudo_jobs(dir);
+
+	for(i = 0; i < pseudo_count; i++)
+		pseudo_jobs[i].dir_ent->inode->read = FALSE;
+
+	if(threads > pseudo_count)
+		threads = pseudo_count;
+
+	pseudo_ahead = threads * PSEUDO_AHEAD;
+
+	for(i = 0; i < threads; i++) {
+		if(pthread_create(&thread, NULL, pseudo_thrd, NULL) != 0)
+			BAD_ERROR("Failed to create thread\n");
+		pthread_detach(thread);
+	}
+}
+
+
+/*
+ * Get the next dynamic pseudo file, waiting for its command to finish.
+ * If the commands aren't being run ahead, it is run now
+ */
+static struct pseudo_job *get_pseudo_job(struct dir_ent *dir_ent,
+	struct pseudo_job *job)
+{
+	static char copy[PSEUDO_COPY_SIZE];
+
+	if(pseudo_jobs == NULL) {
+		job->dir_ent = dir_ent;
+		job->error = 0;
+		job->buffer = NULL;
+		job->size = job->offset = 0;
+		job->spool = NULL;
+		run_pseudo_job(job, copy);
+		return job;
+	}
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &pseudo_mutex);
+	pthread_mutex_lock(&pseudo_mutex);
+
+	if(pseudo_consumed == pseudo_count ||
+			pseudo_jobs[pseudo_consumed].dir_ent->inode !=
+			dir_ent->inode)
+		BAD_ERROR("Dynamic pseudo file read out of order\n");
+
+	job = &pseudo_jobs[pseudo_consumed];
+	while(job->state != PSEUDO_DONE)
+		pthread_cond_wait(&pseudo_done, &pseudo_mutex);
+
+	pthread_cleanup_pop(1);
+
+	return job;
+}
+
+
+static void put_pseudo_job(struct pseudo_job *job)
+{
+	free(job->buffer);
+	if(job->spool)
+		fclose(job->spool);
+
+	if(pseudo_jobs == NULL)
+		return;
+
+	pthread_mutex_lock(&pseudo_mutex);
+	pseudo_consumed ++;
+	pthread_cond_broadcast(&pseudo_work);
+	pthread_mutex_unlock(&pseudo_mutex);
+}
+
+
+/*
+ * Read the spooled output, returns -1 at the end if reading the output
+ * failed
+ */
+static long long read_pseudo_job(struct pseudo_job *job, char *buff,
+	long long size)
+{
+	long long bytes = job->size - job->offset;
+
+	if(bytes > size)
+		bytes = size;
+
+	memcpy(buff, job->buffer + job->offset, bytes);
+	job->offset += bytes;
+
+	if(bytes < size && job->spool) {
+		long long res = read_bytes(fileno(job->spool), buff + bytes,
+								size - bytes);
+
+		if(res == -1)
+			return -1;
+		bytes += res;
+	}
+
+	if(bytes == 0 && job->error == PSEUDO_READ_ERROR)
+		return -1;
+
+	return bytes;
+}
+
+
 static int seq = 0;
 static void reader_read_process(struct dir_ent *dir_ent)
 {
 	long long bytes = 0;
 	struct inode_info *inode = dir_ent->inode;
 	struct file_buffer *prev_buffer = NULL, *file_buffer;
-	int status, byte, res, child;
-	int file;
+	struct pseudo_job *job, local_job;
+	int byte;
 
 	if(inode->read)
 		return;
 
 	inode->read = TRUE;
 
-	file = pseudo_exec_file(inode->pseudo, &child);
-	if(!file) {
+	job = get_pseudo_job(dir_ent, &local_job);
+	if(job->error == PSEUDO_EXEC_ERROR) {
 		file_buffer = cache_get_nohash(reader_buffer);
 		file_buffer->sequence = seq ++;
 		goto read_err;
@@ -158,9 +702,9 @@ static void reader_read_process(struct dir_ent *dir_ent)
 		file_buffer->sequence = seq ++;
 		file_buffer->noD = inode->noD;
 
-		byte = read_bytes(file, file_buffer->data, block_size);
+		byte = read_pseudo_job(job, file_buffer->data, block_size);
 		if(byte == -1)
-			goto read_err2;
+			goto read_err;
 
 		file_buffer->size = byte;
 		file_buffer->file_size = -1;
@@ -191,19 +735,11 @@ static void reader_read_process(struct dir_ent *dir_ent)
 	 */
 	inode->buf.st_size = bytes;
 
-	while(1) {
-		res = waitpid(child, &status, 0);
-		if(res != -1)
-			break;
-		else if(errno != EINTR)
-			BAD_ERROR("read process: waitpid returned %d\n", errno);
-	}
-
-	close(file);
-
-	if(res == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	if(job->error)
 		goto read_err;
 
+	put_pseudo_job(job);
+
 	if(prev_buffer == NULL)
 		prev_buffer = file_buffer;
 	else {
@@ -216,9 +752,8 @@ static void reader_read_process(struct dir_ent *dir_ent)
 
 	return;
 
-read_err2:
-	close(file);
 read_err:
+	put_pseudo_job(job);
 	if(prev_buffer) {
 		cache_block_put(file_buffer);
 		seq --;
@@ -229,16 +764,154 @@ read_err:
 }
 
 
+/*
+ * With -physical-read, regular files are gathered into a window, and read
+ * in the order they're stored on disk, to reduce seeking.  The window is
+ * bounded to half the read queue, and the blocks of files read ahead of
+ * their turn are held here, and sent on once the files before them have
+ * been read, so the filesystem layout doesn't change
+ */
+struct window_file {
+	struct dir_ent		*dir_ent;
+	long long		physical;
+	int			index;
+	int			first;
+	int			count;
+	int			done;
+};
+
+struct pending_buffer {
+	struct file_buffer	*buffer;
+	int			sparse;
+};
+
+static struct window_file *window = NULL;
+static int *window_order;
+static int window_files = 0, window_blocks = 0, window_size;
+static struct pending_buffer *pending;
+static int pending_count = 0;
+/* TRUE if the file being read is ahead of its turn */
+static int deferring = FALSE;
+/* set if the file being read would overflow the pending buffers */
+static int window_full = FALSE;
+/* progress of the file being read ahead, reported once it has been read */
+static long long deferred_progress = 0;
+
+
+/*
+ * Get a buffer for reader_read_file().  Returns NULL if the file is being
+ * read ahead of its turn, and all the pending buffers are used
+ */
+static struct file_buffer *get_reader_buffer()
+{
+	if(deferring && pending_count == window_size) {
+		window_full = TRUE;
+		return NULL;
+	}
+
+	return cache_get_nohash(reader_buffer);
+}
+
+
+static void queue_file_buffer(struct file_buffer *file_buffer, int sparse)
+{
+	if(deferring) {
+		pending[pending_count].buffer = file_buffer;
+		pending[pending_count ++].sparse = sparse;
+		return;
+	}
+
+	file_buffer->sequence = seq ++;
+
+	/* sparse blocks have no data to compress, and skip the deflators */
+	if(sparse)
+		seq_queue_put(to_main, file_buffer);
+	else
+		put_file_buffer(file_buffer);
+}
+
+
+/*
+ * Is the block at offset wholly within a hole, and so can be output as
+ * a sparse block without reading it?  Data_start and data_end cache the
+ * data region at or after the last block looked up, which saves a pair of
+ * lseeks per block.  Leaves the file position at the block to be read next.
+ * Returns TRUE if a hole, FALSE if not, and -1 on error
+ */
+static int hole_block(int file, long long offset, long long *data_start,
+	long long *data_end)
+{
+#ifdef SEEK_DATA
+	int hole, moved = FALSE;
+
+	if(offset >= *data_end) {
+		*data_start = lseek(file, offset, SEEK_DATA);
+		if(*data_start == -1 && errno == ENXIO)
+			/* no more data, the rest of the file is a hole */
+			*data_start = *data_end = LLONG_MAX;
+		else if(*data_start == -1) {
+			/* SEEK_DATA isn't supported, treat it all as data */
+			*data_start = 0;
+			*data_end = LLONG_MAX;
+		} else {
+			*data_end = lseek(file, *data_start, SEEK_HOLE);
+			if(*data_end == -1)
+				*data_end = LLONG_MAX;
+		}
+		moved = TRUE;
+	}
+
+	hole = offset + block_size <= *data_start;
+
+	if(moved || hole) {
+		if(lseek(file, hole ? offset + block_size : offset,
+						SEEK_SET) == -1)
+			return -1;
+	}
+
+	return hole;
+#else
+	return FALSE;
+#endif
+}
+
+
+/*
+ * Tell the prefetcher how much of the file has been read.  It prefetched
+ * the size the file was when scanned, and so that is what is reported,
+ * however much is actually read.  A file read ahead of its turn may be
+ * given up on and read again, and so its progress is held back until
+ * it has been read
+ */
+static void read_progress(long long *progress, long long size, long long bytes)
+{
+	if(bytes > size - *progress)
+		bytes = size - *progress;
+
+	if(bytes > 0) {
+		*progress += bytes;
+		if(deferring)
+			deferred_progress += bytes;
+		else
+			prefetch_progress(bytes);
+	}
+}
+
+
 static void reader_read_file(struct dir_ent *dir_ent)
 {
-	struct stat *buf = &dir_ent->inode->buf, buf2;
+	struct inode_stat *buf = &dir_ent->inode->buf;
+	struct stat buf2;
 	struct file_buffer *file_buffer;
-	int blocks, file, res;
-	long long bytes, read_size;
+	int blocks, file, res, sparse;
+	long long bytes, read_size, data_start, data_end, progress = 0;
+	long long size = buf->st_size;
 	struct inode_info *inode = dir_ent->inode;
 
-	if(inode->read)
+	if(inode->read) {
+		read_progress(&progress, size, size);
 		return;
+	}
 
 	inode->read = TRUE;
 again:
@@ -246,25 +919,51 @@ again:
 	read_size = buf->st_size;
 	blocks = (read_size + block_size - 1) >> block_log;
 
-	while(1) {
-		file = open(pathname(dir_ent), O_RDONLY);
-		if(file != -1 || errno != EINTR)
-			break;
-	}
-
+	file = open_file(dir_ent);
 	if(file == -1) {
-		file_buffer = cache_get_nohash(reader_buffer);
-		file_buffer->sequence = seq ++;
+		file_buffer = get_reader_buffer();
+		if(file_buffer == NULL)
+			return;
 		goto read_err2;
 	}
 
+	/*
+	 * If the file has fewer blocks allocated than its size it has holes.
+	 * Rather than reading these as zeros, and having the deflate threads
+	 * discover they're zero, ask the filesystem where the holes are, and
+	 * output hole blocks as sparse without reading them
+	 */
+	sparse = sparse_files && (buf->st_blocks << 9) < read_size;
+	data_start = data_end = 0;
+
 	do {
-		file_buffer = cache_get_nohash(reader_buffer);
+		file_buffer = get_reader_buffer();
+		if(file_buffer == NULL) {
+			close(file);
+			return;
+		}
+
 		file_buffer->file_size = read_size;
-		file_buffer->sequence = seq ++;
 		file_buffer->noD = inode->noD;
 		file_buffer->error = FALSE;
 
+		/* The tail block is always read, see below */
+		if(sparse && blocks > 1) {
+			res = hole_block(file, bytes, &data_start, &data_end);
+			if(res == -1)
+				goto read_err;
+
+			if(res) {
+				file_buffer->size = block_size;
+				file_buffer->c_byte = 0;
+				file_buffer->fragment = FALSE;
+				bytes += block_size;
+				read_progress(&progress, size, block_size);
+				queue_file_buffer(file_buffer, TRUE);
+				continue;
+			}
+		}
+
 		/*
 		 * Always try to read block_size bytes from the file rather
 		 * than expected bytes (which will be less than the block_size
@@ -280,6 +979,7 @@ again:
 			goto read_err;
 
 		bytes += file_buffer->size;
+		read_progress(&progress, size, file_buffer->size);
 
 		if(blocks > 1) {
 			/* non-tail block should be exactly block_size */
@@ -287,7 +987,7 @@ again:
 				goto restat;
 
 			file_buffer->fragment = FALSE;
-			put_file_buffer(file_buffer);
+			queue_file_buffer(file_buffer, FALSE);
 		}
 	} while(-- blocks > 0);
 
@@ -313,9 +1013,10 @@ again:
 	}
 
 	file_buffer->fragment = is_fragment(inode);
-	put_file_buffer(file_buffer);
+	queue_file_buffer(file_buffer, FALSE);
 
 	close(file);
+	read_progress(&progress, size, size);
 
 	return;
 
@@ -329,16 +1030,137 @@ restat:
 
 	if(read_size != buf2.st_size) {
 		close(file);
-		memcpy(buf, &buf2, sizeof(struct stat));
+		get_inode_stat(buf, &buf2);
 		file_buffer->error = 2;
-		put_file_buffer(file_buffer);
+		queue_file_buffer(file_buffer, FALSE);
 		goto again;
 	}
 read_err:
 	close(file);
 read_err2:
 	file_buffer->error = TRUE;
-	put_file_buffer(file_buffer);
+	queue_file_buffer(file_buffer, FALSE);
+	read_progress(&progress, size, size);
+}
+
+
+static void emit_window_file(struct window_file *file)
+{
+	int i;
+
+	for(i = file->first; i < file->first + file->count; i++)
+		queue_file_buffer(pending[i].buffer, pending[i].sparse);
+}
+
+
+static int compare_physical(const void *a, const void *b)
+{
+	struct window_file *file_a = &window[*(int *) a];
+	struct window_file *file_b = &window[*(int *) b];
+
+	if(file_a->physical != file_b->physical)
+		return file_a->physical < file_b->physical ? -1 : 1;
+
+	return file_a->index - file_b->index;
+}
+
+
+/*
+ * Read the files in the window in physical order.  The file whose turn it
+ * is is sent on as it is read, the others are held until their turn.  If
+ * a file grows so much it would overflow the pending buffers, give up on it,
+ * and read the rest of the window in the usual order
+ */
+static void flush_window()
+{
+	int i, next = 0;
+
+	for(i = 0; i < window_files; i++)
+		window_order[i] = i;
+
+	qsort(window_order, window_files, sizeof(int), compare_physical);
+
+	for(i = 0; i < window_files && !window_full; i++) {
+		struct window_file *file = &window[window_order[i]];
+
+		deferring = file->index != next;
+		file->first = pending_count;
+		reader_read_file(file->dir_ent);
+		deferring = FALSE;
+
+		if(window_full) {
+			for(; pending_count > file->first; pending_count --)
+				cache_block_put(pending[pending_count - 1].buffer);
+			file->dir_ent->inode->read = FALSE;
+			deferred_progress = 0;
+			break;
+		}
+
+		if(deferred_progress) {
+			prefetch_progress(deferred_progress);
+			deferred_progress = 0;
+		}
+
+		file->count = pending_count - file->first;
+		file->done = TRUE;
+
+		if(file->index == next)
+			for(next ++; next < window_files && window[next].done;
+								next ++)
+				emit_window_file(&window[next]);
+	}
+
+	for(; next < window_files; next ++) {
+		if(window[next].done)
+			emit_window_file(&window[next]);
+		else
+			reader_read_file(window[next].dir_ent);
+	}
+
+	window_files = window_blocks = pending_count = 0;
+	window_full = FALSE;
+}
+
+
+static void read_file(struct dir_ent *dir_ent)
+{
+	struct window_file *file;
+	int blocks;
+
+	if(!physical_read || dir_ent->inode->read) {
+		reader_read_file(dir_ent);
+		return;
+	}
+
+	if(window == NULL) {
+		window_size = reader_buffer->max_buffers / 2 ? : 1;
+		window = malloc(window_size * sizeof(struct window_file));
+		window_order = malloc(window_size * sizeof(int));
+		pending = malloc(window_size * sizeof(struct pending_buffer));
+		if(window == NULL || window_order == NULL || pending == NULL)
+			MEM_ERROR();
+	}
+
+	/* every file takes at least one buffer, even if empty */
+	blocks = (dir_ent->inode->buf.st_size + block_size - 1) >> block_log;
+	if(blocks == 0)
+		blocks = 1;
+
+	if(window_blocks + blocks > window_size)
+		flush_window();
+
+	/* too large to be held, read it now */
+	if(blocks > window_size) {
+		reader_read_file(dir_ent);
+		return;
+	}
+
+	file = &window[window_files];
+	file->dir_ent = dir_ent;
+	file->physical = dir_ent->inode->physical;
+	file->index = window_files ++;
+	file->done = FALSE;
+	window_blocks += blocks;
 }
 
 
@@ -414,15 +1236,130 @@ static void reader_read_data(struct dir_ent *dir_ent)
 }
 
 
+/*
+ * Read a regular file out of a Squashfs image source.  If the image
+ * has the same block size, then the block list is used to take the data
+ * blocks directly from the image: blocks compressed by the same compressor
+ * are copied as is by the deflate threads, and other compressed
+ * blocks are decompressed by the deflate threads before being recompressed.
+ * Otherwise the file is read decompressed, as happens with tail-end
+ * data destined for a fragment
+ */
+static void reader_read_image(struct dir_ent *dir_ent)
+{
+	struct inode_info *inode = dir_ent->inode;
+	struct image_file *file = inode->image_file;
+	struct image_source *source = file->source;
+	struct file_buffer *file_buffer;
+	long long read_size = inode->buf.st_size, start = 0;
+	int blocks = (read_size + block_size - 1) >> block_log;
+	int fragment = is_fragment(inode);
+	unsigned int *block_list = NULL;
+	int i, list_size = 0;
+
+	if(inode->read)
+		return;
+
+	inode->read = TRUE;
+
+	if(source->block_size == block_size) {
+		list_size = squashfs_read_blocklist(source->fs, file->inode,
+			&start, &block_list);
+		if(list_size == -1) {
+			file_buffer = cache_get_nohash(reader_buffer);
+			file_buffer->sequence = seq ++;
+			goto read_err;
+		}
+	}
+
+	i = 0;
+	do {
+		int size = blocks > 1 ? block_size : read_size -
+						(long long) i * block_size;
+		int tail = blocks == 1;
+
+		if(i >= list_size || (tail && fragment)) {
+			file_buffer = cache_get_nohash(reader_buffer);
+			file_buffer->sequence = seq ++;
+
+			if(size && squashfs_read_pread(source->fs, file->inode,
+					file_buffer->data, size, (long long) i *
+					block_size) != size)
+				goto read_err;
+		} else if(block_list[i] == 0) {
+			/* sparse block */
+			file_buffer = cache_get_nohash(reader_buffer);
+			file_buffer->sequence = seq ++;
+			memset(file_buffer->data, 0, size);
+		} else {
+			int compressed = SQUASHFS_COMPRESSED_BLOCK(block_list[i]);
+			int bytes = SQUASHFS_COMPRESSED_SIZE_BLOCK(block_list[i]);
+			int verbatim = compressed && source->verbatim &&
+								!inode->noD;
+
+			file_buffer = cache_get_nohash(reader_buffer);
+			file_buffer->sequence = seq ++;
+
+			if(bytes > block_size || (!compressed && bytes != size))
+				goto read_err;
+
+			if(squashfs_read_raw(source->fs, start,
+					file_buffer->data, bytes) == -1)
+				goto read_err;
+
+			start += bytes;
+
+			if(verbatim) {
+				/* already compressed, the deflate threads
+				 * copy it as is */
+				file_buffer->verbatim = TRUE;
+				file_buffer->c_byte = block_list[i];
+			} else {
+				/*
+				 * Compressed blocks are decompressed by the
+				 * deflate threads, c_byte holds the expected
+				 * uncompressed size
+				 */
+				file_buffer->transcode = compressed;
+				file_buffer->image_comp = source->comp;
+				file_buffer->c_byte = size;
+			}
+			size = bytes;
+		}
+
+		file_buffer->file_size = read_size;
+		file_buffer->noD = inode->noD;
+		file_buffer->error = FALSE;
+		file_buffer->size = size;
+		file_buffer->fragment = tail ? fragment : FALSE;
+		put_file_buffer(file_buffer);
+	} while(i ++, -- blocks > 0);
+
+	free(block_list);
+	return;
+
+read_err:
+	free(block_list);
+	file_buffer->error = TRUE;
+	put_file_buffer(file_buffer);
+}
+
+
 void reader_scan(struct dir_info *dir)
 {
 	struct dir_ent *dir_ent = dir->list;
 
 	for(; dir_ent; dir_ent = dir_ent->next) {
-		struct stat *buf = &dir_ent->inode->buf;
+		struct inode_stat *buf = &dir_ent->inode->buf;
 		if(dir_ent->inode->root_entry)
 			continue;
 
+		/* files not in the window have to wait for it */
+		if(window_files && (IS_PSEUDO_PROCESS(dir_ent->inode) ||
+					IS_PSEUDO_DATA(dir_ent->inode) ||
+					IS_IMAGE(dir_ent->inode)))
+			flush_window();
+
 		if(IS_PSEUDO_PROCESS(dir_ent->inode)) {
 			reader_read_process(dir_ent);
 			continue;
@@ -433,9 +1370,14 @@ void reader_scan(struct dir_info *dir)
 			continue;
 		}
 
+		if(IS_IMAGE(dir_ent->inode) && S_ISREG(buf->st_mode)) {
+			reader_read_image(dir_ent);
+			continue;
+		}
+
 		switch(buf->st_mode & S_IFMT) {
 			case S_IFREG:
-				reader_read_file(dir_ent);
+				read_file(dir_ent);
 				break;
 			case S_IFDIR:
 				reader_scan(dir_ent->dir);
@@ -445,6 +1387,26 @@ void reader_scan(struct dir_info *dir)
 }
 
 
+/*
+ * The sort list holds all the regular files, including the pseudo files,
+ * which are read in the same way as by reader_scan()
+ */
+static void read_sorted(struct dir_ent *dir_ent)
+{
+	struct inode_info *inode = dir_ent->inode;
+
+	if(window_files && (IS_PSEUDO_PROCESS(inode) || IS_PSEUDO_DATA(inode)))
+		flush_window();
+
+	if(IS_PSEUDO_PROCESS(inode))
+		reader_read_process(dir_ent);
+	else if(IS_PSEUDO_DATA(inode))
+		reader_read_data(dir_ent);
+	else
+		read_file(dir_ent);
+}
+
+
 void *reader(void *arg)
 {
 	struct itimerval itimerval;
@@ -460,19 +1422,33 @@ void *reader(void *arg)
 		setitimer(ITIMER_REAL, &itimerval, NULL);
 	}
 
+	/* by default prefetch a read queue's worth ahead */
+	if(!tarfile && prefetch_size)
+		prefetch_init(dir, prefetch_size == -1 ? (long long)
+			reader_buffer->max_buffers * block_size : prefetch_size);
+
 	if(tarfile)
 		read_tar_file();
-	else if(!sorted)
+	else if(!sorted) {
+		start_pseudo_jobs(dir);
 		reader_scan(dir);
+		flush_window();
+		free(pseudo_jobs);
+	}
 	else{
 		int i;
 		struct priority_entry *entry;
 
+		start_pseudo_jobs(dir);
+
 		for(i = 65535; i >= 0; i--)
 			for(entry = priority_list[i]; entry;
 							entry = entry->next)
-				reader_read_file(entry->dir);
+				read_sorted(entry->dir);
+		flush_window();
+		free(pseudo_jobs);
 	}
 
+	close_dir_fds();
 	pthread_exit(NULL);
 }
@@ -0,0 +1,464 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * scanner.c
+ *
+ * Directory scanning threads.  Dir_scan1() walks the source directories
+ * depth first on the main thread, and building the in-memory tree has to
+ * stay serial, because exclude actions, hard link detection and error
+ * reporting all depend on the order entries are seen.  What can be done in
+ * parallel is the I/O: reading the directory, and stat'ing and readlink'ing
+ * its entries.  When dir_scan1() opens a directory it queues the
+ * sub-directories it will later descend into, and these threads read them
+ * ahead of time, so that by the time dir_scan1() gets there the results
+ * are (hopefully) already waiting.
+ *
+ * The xattrs of each entry are read here too, rather than one file at a time
+ * when the inode is created, as is the physical location of each regular
+ * file if the reader is going to read files in disk order.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#include "squashfs_fs.h"
+#include "mksquashfs_error.h"
+#include "progressbar.h"
+#include "xattr.h"
+#include "scanner.h"
+
+#define FALSE 0
+#define TRUE 1
+
+static pthread_mutex_t scanner_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scanner_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scanner_done = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Directories waiting to be scanned.  This is used as a stack, the most
+ * recently queued directories are those dir_scan1() will descend into
+ * soonest
+ */
+static struct scanner_dir *work_list = NULL;
+
+/* queued or scanned directories not yet collected by scanner_get() */
+static struct scanner_dir *scanner_table[SCANNER_HASH_SIZE];
+
+static int scanner_threads = 0;
+
+/* read xattrs as well */
+static int scanner_xattrs = FALSE;
+
+/* and the physical offsets of regular files */
+static int scanner_physical = FALSE;
+
+/*
+ * Is /proc/self/fd available to read xattrs relative to the directory?
+ * Checked once by scanner_init(), before the threads are started
+ */
+static int scanner_proc = FALSE;
+
+
+static int scanner_hash(char *pathname)
+{
+	unsigned int hash = 0;
+
+	while(*pathname)
+		hash = hash * 31 + (unsigned char) *pathname++;
+
+	return hash & SCANNER_HASH_MASK;
+}
+
+
+static void scan_xattrs(struct scanner_dir *dir, int fd,
+	struct scanner_entry *entry)
+{
+	char *filename;
+	int res;
+
+	res = asprintf(&filename, "%s/%s", dir->pathname, entry->name);
+	if(res == -1)
+		BAD_ERROR("asprintf failed in scan_xattrs\n");
+
+	if(scanner_proc)
+		entry->xattrs = read_xattrs_from_dir_fd(fd, entry->name,
+					filename, &entry->xattr_list);
+	else
+		entry->xattrs = read_xattrs_from_system(filename,
+							&entry->xattr_list);
+	free(filename);
+}
+
+
+/*
+ * Return the physical offset on disk of the first extent of <name>, or 0 if
+ * the file has no data, or the filesystem can't say
+ */
+long long physical_offset(int dir_fd, char *name)
+{
+#ifdef FS_IOC_FIEMAP
+	struct {
+		struct fiemap map;
+		struct fiemap_extent extent;
+	} fiemap;
+	int fd, res;
+
+	fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if(fd == -1)
+		return 0;
+
+	memset(&fiemap, 0, sizeof(fiemap));
+	fiemap.map.fm_length = FIEMAP_MAX_OFFSET;
+	fiemap.map.fm_extent_count = 1;
+
+	res = ioctl(fd, FS_IOC_FIEMAP, &fiemap);
+	close(fd);
+
+	if(res == -1 || fiemap.map.fm_mapped_extents == 0)
+		return 0;
+
+	return fiemap.extent.fe_physical;
+#else
+	return 0;
+#endif
+}
+
+
+static void scan_directory(struct scanner_dir *dir, char *buffer)
+{
+	struct dirent *d_name;
+	DIR *linuxdir;
+	int fd, size = 0;
+
+	fd = open(dir->pathname, O_RDONLY | O_DIRECTORY);
+	if(fd == -1) {
+		dir->error = errno;
+		return;
+	}
+
+	linuxdir = fdopendir(fd);
+	if(linuxdir == NULL) {
+		dir->error = errno;
+		close(fd);
+		return;
+	}
+
+	while((d_name = readdir(linuxdir)) != NULL) {
+		struct scanner_entry *entry;
+
+		if(strcmp(d_name->d_name, ".") == 0 ||
+					strcmp(d_name->d_name, "..") == 0)
+			continue;
+
+		if(dir->count == size) {
+			size = size ? size * 2 : 16;
+			dir->entry = realloc(dir->entry, size *
+				sizeof(struct scanner_entry));
+			if(dir->entry == NULL)
+				MEM_ERROR();
+		}
+
+		entry = &dir->entry[dir->count ++];
+		entry->name = strdup(d_name->d_name);
+		if(entry->name == NULL)
+			MEM_ERROR();
+		entry->error = 0;
+		entry->symlink = NULL;
+		entry->symlink_size = 0;
+		entry->symlink_error = 0;
+		entry->xattr_list = NULL;
+		entry->xattrs = -1;
+		entry->physical = 0;
+
+		if(fstatat(fd, entry->name, &entry->buf,
+					AT_SYMLINK_NOFOLLOW) == -1) {
+			entry->error = errno;
+			continue;
+		}
+
+		if(scanner_xattrs)
+			scan_xattrs(dir, fd, entry);
+
+		if(scanner_physical && S_ISREG(entry->buf.st_mode))
+			entry->physical = physical_offset(fd, entry->name);
+
+		if(!S_ISLNK(entry->buf.st_mode))
+			continue;
+
+		entry->symlink_size = readlinkat(fd, entry->name, buffer,
+			SCANNER_SYMLINK_MAX);
+		if(entry->symlink_size == -1)
+			entry->symlink_error = errno;
+		else if(entry->symlink_size > 0 && entry->symlink_size <
+							SCANNER_SYMLINK_MAX) {
+			entry->symlink = malloc(entry->symlink_size);
+			if(entry->symlink == NULL)
+				MEM_ERROR();
+			memcpy(entry->symlink, buffer, entry->symlink_size);
+		}
+	}
+
+	closedir(linuxdir);
+}
+
+
+static struct scanner_dir *new_dir(char *pathname)
+{
+	struct scanner_dir *dir = malloc(sizeof(struct scanner_dir));
+
+	if(dir == NULL)
+		MEM_ERROR();
+
+	dir->pathname = strdup(pathname);
+	if(dir->pathname == NULL)
+		MEM_ERROR();
+
+	dir->entry = NULL;
+	dir->count = dir->cur = dir->error = 0;
+	dir->state = SCANNER_QUEUED;
+	dir->next = dir->prev = dir->hash_next = NULL;
+
+	return dir;
+}
+
+
+/* Called with scanner_mutex held */
+static void remove_work(struct scanner_dir *dir)
+{
+	if(dir->prev)
+		dir->prev->next = dir->next;
+	else
+		work_list = dir->next;
+
+	if(dir->next)
+		dir->next->prev = dir->prev;
+}
+
+
+/* Called with scanner_mutex held */
+static struct scanner_dir *remove_hash(char *pathname)
+{
+	struct scanner_dir **dir = &scanner_table[scanner_hash(pathname)];
+
+	for(; *dir; dir = &(*dir)->hash_next)
+		if(strcmp((*dir)->pathname, pathname) == 0) {
+			struct scanner_dir *found = *dir;
+
+			*dir = found->hash_next;
+			return found;
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Remove a directory from the queue.  If it has not been started, it
+ * is returned to the caller to scan, otherwise wait for the scanning thread
+ * to finish with it.  Returns NULL if the directory was never queued.
+ */
+static struct scanner_dir *collect(char *pathname, int *scan)
+{
+	struct scanner_dir *dir;
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &scanner_mutex);
+	pthread_mutex_lock(&scanner_mutex);
+
+	*scan = FALSE;
+	dir = remove_hash(pathname);
+	if(dir && dir->state == SCANNER_QUEUED) {
+		remove_work(dir);
+		dir->state = SCANNER_RUNNING;
+		*scan = TRUE;
+	} else if(dir)
+		while(dir->state != SCANNER_DONE)
+			pthread_cond_wait(&scanner_done, &scanner_mutex);
+
+	pthread_cleanup_pop(1);
+
+	return dir;
+}
+
+
+static void *scanner_thrd(void *arg)
+{
+	sigset_t sigmask, old_mask;
+	char *buffer = malloc(SCANNER_SYMLINK_MAX);
+
+	if(buffer == NULL)
+		MEM_ERROR();
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigmask, &old_mask);
+
+	while(1) {
+		struct scanner_dir *dir;
+
+		pthread_mutex_lock(&scanner_mutex);
+		while(work_list == NULL)
+			pthread_cond_wait(&scanner_work, &scanner_mutex);
+		dir = work_list;
+		remove_work(dir);
+		dir->state = SCANNER_RUNNING;
+		pthread_mutex_unlock(&scanner_mutex);
+
+		scan_directory(dir, buffer);
+
+		pthread_mutex_lock(&scanner_mutex);
+		dir->state = SCANNER_DONE;
+		pthread_cond_broadcast(&scanner_done);
+		pthread_mutex_unlock(&scanner_mutex);
+	}
+}
+
+
+void scanner_init(int threads, int xattrs, int physical)
+{
+	pthread_t thread;
+	int i;
+
+	scanner_threads = threads;
+	scanner_xattrs = xattrs;
+	scanner_physical = physical;
+	scanner_proc = xattrs && access("/proc/self/fd", X_OK) == 0;
+
+	for(i = 0; i < threads; i++) {
+		if(pthread_create(&thread, NULL, scanner_thrd, NULL) != 0)
+			BAD_ERROR("Failed to create thread\n");
+		pthread_detach(thread);
+	}
+}
+
+
+/*
+ * Queue a directory to be read ahead by the scanner threads
+ */
+void scanner_queue(char *pathname)
+{
+	struct scanner_dir *dir;
+	int hash;
+
+	if(scanner_threads == 0)
+		return;
+
+	dir = new_dir(pathname);
+	hash = scanner_hash(pathname);
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &scanner_mutex);
+	pthread_mutex_lock(&scanner_mutex);
+
+	dir->next = work_list;
+	if(work_list)
+		work_list->prev = dir;
+	work_list = dir;
+
+	dir->hash_next = scanner_table[hash];
+	scanner_table[hash] = dir;
+
+	pthread_cond_signal(&scanner_work);
+	pthread_cleanup_pop(1);
+}
+
+
+/*
+ * Get the scanned directory.  If it was queued, this collects the result,
+ * otherwise the directory is scanned now
+ */
+struct scanner_dir *scanner_get(char *pathname)
+{
+	static char buffer[SCANNER_SYMLINK_MAX];
+	struct scanner_dir *dir;
+	int scan;
+
+	dir = collect(pathname, &scan);
+	if(dir == NULL) {
+		dir = new_dir(pathname);
+		scan = TRUE;
+	}
+
+	if(scan)
+		scan_directory(dir, buffer);
+
+	return dir;
+}
+
+
+struct scanner_entry *scanner_readdir(struct scanner_dir *dir)
+{
+	return dir->cur < dir->count ? &dir->entry[dir->cur ++] : NULL;
+}
+
+
+/*
+ * A queued directory isn't wanted after all (it has been excluded)
+ */
+void scanner_discard(char *pathname)
+{
+	struct scanner_dir *dir;
+	int scan;
+
+	dir = collect(pathname, &scan);
+	if(dir)
+		scanner_free(dir);
+}
+
+
+void scanner_free(struct scanner_dir *dir)
+{
+	int i;
+
+	for(i = 0; i < dir->count; i++) {
+		struct scanner_entry *entry = &dir->entry[i];
+		int j;
+
+		/* xattrs not taken by mksquashfs */
+		for(j = 0; j < entry->xattrs; j++) {
+			free(entry->xattr_list[j].full_name);
+			free(entry->xattr_list[j].value);
+		}
+
+		if(entry->xattrs > 0)
+			free(entry->xattr_list);
+		free(entry->name);
+		free(entry->symlink);
+	}
+
+	free(dir->entry);
+	free(dir->pathname);
+	free(dir);
+}
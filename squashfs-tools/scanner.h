@@ -0,0 +1,77 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * scanner.h
+ */
+
+#define SCANNER_HASH_SIZE	4096
+#define SCANNER_HASH_MASK	(SCANNER_HASH_SIZE - 1)
+
+/* largest symlink, the same limit dir_scan1() has always used */
+#define SCANNER_SYMLINK_MAX	65536
+
+#define SCANNER_QUEUED		0
+#define SCANNER_RUNNING		1
+#define SCANNER_DONE		2
+
+/* a directory entry, and the result of stat'ing it */
+struct scanner_entry {
+	char			*name;
+	struct stat		buf;
+	/* errno if fstatat() failed, otherwise 0 */
+	int			error;
+	/* symlink contents, the readlinkat() return value, and errno if it
+	 * failed */
+	char			*symlink;
+	int			symlink_size;
+	int			symlink_error;
+	/* xattrs, xattrs is -1 if they haven't been read */
+	struct xattr_list	*xattr_list;
+	int			xattrs;
+	/* physical offset of a regular file's data, 0 if not known */
+	long long		physical;
+};
+
+struct scanner_dir {
+	char			*pathname;
+	struct scanner_entry	*entry;
+	int			count;
+	/* readdir position, used by mksquashfs */
+	int			cur;
+	/* errno if the directory could not be opened, otherwise 0 */
+	int			error;
+	int			state;
+	struct scanner_dir	*next;
+	struct scanner_dir	*prev;
+	struct scanner_dir	*hash_next;
+};
+
+#define SCANNER_ENTRY(dir)	(&(dir)->entry[(dir)->cur - 1])
+
+extern void scanner_init(int, int, int);
+extern long long physical_offset(int, char *);
+extern void scanner_queue(char *);
+extern struct scanner_dir *scanner_get(char *);
+extern struct scanner_entry *scanner_readdir(struct scanner_dir *);
+extern void scanner_discard(char *);
+extern void scanner_free(struct scanner_dir *);
+#endif
@@ -76,7 +76,7 @@ void add_priority_list(struct dir_ent *dir, int priority)
 }
 
 
-int get_priority(char *filename, struct stat *buf, int priority)
+int get_priority(char *filename, struct inode_stat *buf, int priority)
 {
 	int hash = buf->st_ino & 0xffff;
 	struct sort_info *s;
@@ -186,14 +186,14 @@ error:
 
 
 void generate_file_priorities(struct dir_info *dir, int priority,
-	struct stat *buf)
+	struct inode_stat *buf)
 {
 	struct dir_ent *dir_ent = dir->list;
 
 	priority = get_priority(dir->pathname, buf, priority);
 
 	for(; dir_ent; dir_ent = dir_ent->next) {
-		struct stat *buf = &dir_ent->inode->buf;
+		struct inode_stat *buf = &dir_ent->inode->buf;
 		if(dir_ent->inode->root_entry)
 			continue;
 
@@ -370,3 +370,63 @@ void sort_files_and_write(struct dir_info *dir)
 					entry->dir->inode->buf.st_size);
 		}
 }
+
+
+struct physical_entry {
+	struct priority_entry	*entry;
+	int			index;
+};
+
+
+static int compare_physical(const void *a, const void *b)
+{
+	const struct physical_entry *entry_a = a, *entry_b = b;
+	long long physical_a = entry_a->entry->dir->inode->physical;
+	long long physical_b = entry_b->entry->dir->inode->physical;
+
+	if(physical_a != physical_b)
+		return physical_a < physical_b ? -1 : 1;
+
+	return entry_a->index - entry_b->index;
+}
+
+
+/*
+ * Sort the files of each priority into the order they're stored on the
+ * source disk (-physical-sort).  Files the filesystem can't locate stay at
+ * the front in their existing order
+ */
+void sort_physical()
+{
+	struct physical_entry *list = NULL;
+	struct priority_entry *entry;
+	int i, j, count, size = 0;
+
+	for(i = 0; i < 65536; i++) {
+		for(count = 0, entry = priority_list[i]; entry;
+						entry = entry->next, count ++) {
+			if(count == size) {
+				size = size ? size * 2 : 1024;
+				list = realloc(list, size *
+					sizeof(struct physical_entry));
+				if(list == NULL)
+					MEM_ERROR();
+			}
+			list[count].entry = entry;
+			list[count].index = count;
+		}
+
+		if(count < 2)
+			continue;
+
+		qsort(list, count, sizeof(struct physical_entry),
+							compare_physical);
+
+		for(j = 0; j < count - 1; j++)
+			list[j].entry->next = list[j + 1].entry;
+		list[count - 1].entry->next = NULL;
+		priority_list[i] = list[0].entry;
+	}
+
+	free(list);
+}
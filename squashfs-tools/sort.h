@@ -32,6 +32,7 @@ struct priority_entry {
 extern int read_sort_file(char *, int, char *[]);
 extern void sort_files_and_write(struct dir_info *);
 extern void generate_file_priorities(struct dir_info *, int priority,
-	struct stat *);
+	struct inode_stat *);
+extern void sort_physical();
 extern struct  priority_entry *priority_list[65536];
 #endif
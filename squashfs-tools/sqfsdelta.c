@@ -0,0 +1,729 @@
+/*
+ * Generate and apply binary deltas between two squashfs filesystems.
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * sqfsdelta.c
+ *
+ * Generic binary diff tools see compressed data as noise.  Sqfsdelta
+ * instead uses the file block lists and fragment table of both
+ * filesystems (read with libsquashfs-read) to find the compressed data
+ * blocks in the new filesystem which exist unchanged in the old
+ * filesystem.  These are stored in the delta as copies from the old
+ * filesystem, and everything else (superblock, metadata, and new or
+ * changed data blocks) is stored as literal data.  Compressed blocks are
+ * compared byte for byte and are never decompressed.
+ *
+ * Applying the delta to the old filesystem reconstructs the new filesystem
+ * bit for bit, which is checked against a hash stored in the delta.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_read.h"
+#include "fnv.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define ERROR(s, args...) \
+		do { \
+			fprintf(stderr, s, ## args); \
+		} while(0)
+
+#define BAD_ERROR(s, args...) \
+		do { \
+			fprintf(stderr, "FATAL ERROR: " s, ## args); \
+			exit(1); \
+		} while(0)
+
+#define MEM_ERROR() \
+		do { \
+			fprintf(stderr, "FATAL ERROR: Out of memory (%s)\n", \
+								__func__); \
+			exit(1); \
+		} while(0)
+
+#define DELTA_MAGIC		"SQFSDLT1"
+#define DELTA_COPY		1
+#define DELTA_DATA		2
+#define DELTA_END		3
+
+#define BUFFER_SIZE		(1024 * 1024)
+
+struct region {
+	long long		start;
+	unsigned int		size;
+};
+
+struct regions {
+	struct region		*region;
+	int			count;
+	int			size;
+	/* the block size of the filesystem, no region can be larger */
+	unsigned int		block_size;
+};
+
+struct block_hash {
+	unsigned long long	hash;
+	long long		start;
+	unsigned int		size;
+};
+
+/* delta header, numbers are stored little endian */
+struct delta_header {
+	char			magic[8];
+	unsigned char		old_size[8];
+	unsigned char		new_size[8];
+	struct squashfs_super_block old_sBlk;
+};
+
+int quiet = FALSE;
+char *buffer, *old_buffer;
+
+
+static unsigned long long hash_bytes(unsigned long long hash, void *data,
+	long long size)
+{
+	unsigned char *ptr = data;
+
+	while(size --)
+		hash = FNV_HASH(hash, *ptr++);
+
+	return hash;
+}
+
+
+static void put_number(unsigned char *dest, unsigned long long number)
+{
+	int i;
+
+	for(i = 0; i < 8; i++, number >>= 8)
+		dest[i] = number & 0xff;
+}
+
+
+static unsigned long long get_number(unsigned char *src)
+{
+	unsigned long long number = 0;
+	int i;
+
+	for(i = 7; i >= 0; i--)
+		number = (number << 8) | src[i];
+
+	return number;
+}
+
+
+static void read_image(int fd, char *name, long long start, void *buf,
+	long long size)
+{
+	ssize_t res;
+
+	for(; size; size -= res, start += res, buf += res) {
+		res = pread(fd, buf, size, start);
+		if(res == -1 && errno == EINTR)
+			res = 0;
+		else if(res <= 0)
+			BAD_ERROR("Failed to read %s, because %s\n", name,
+				res == -1 ? strerror(errno) : "unexpected EOF");
+	}
+}
+
+
+static int write_bytes(int fd, void *buf, long long size)
+{
+	ssize_t res;
+
+	for(; size; size -= res, buf += res) {
+		res = write(fd, buf, size);
+		if(res == -1 && errno == EINTR)
+			res = 0;
+		else if(res == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+static void write_delta(FILE *file, void *data, long long size)
+{
+	if(fwrite(data, 1, size, file) != size)
+		BAD_ERROR("Failed to write delta file, because %s\n",
+			strerror(errno));
+}
+
+
+static int read_delta(FILE *file, void *data, long long size)
+{
+	if(fread(data, 1, size, file) == size)
+		return TRUE;
+
+	ERROR("Failed to read delta file, because %s\n", feof(file) ?
+		"it is truncated" : strerror(errno));
+	return FALSE;
+}
+
+
+static void add_region(struct regions *regions, char *name, long long start,
+	unsigned int size)
+{
+	/* the sizes come from the image, and are read into buffer */
+	if(size > regions->block_size)
+		BAD_ERROR("Squashfs image %s is corrupt, it has a block larger "
+			"than the block size\n", name);
+
+	if(regions->count == regions->size) {
+		regions->size = regions->size ? regions->size * 2 : 1024;
+		regions->region = realloc(regions->region, regions->size *
+			sizeof(struct region));
+		if(regions->region == NULL)
+			MEM_ERROR();
+	}
+
+	regions->region[regions->count].start = start;
+	regions->region[regions->count++].size = size;
+}
+
+
+/*
+ * Add the compressed data blocks of every regular file in the directory
+ * to <regions>
+ */
+static void scan_dir(struct squashfs_read_fs *fs, char *name, long long ref,
+	struct regions *regions)
+{
+	struct squashfs_read_dir *dir = squashfs_read_opendir(fs, ref);
+	struct squashfs_read_dirent ent;
+	int res;
+
+	if(dir == NULL)
+		BAD_ERROR("Failed to read directory in %s, because %s\n", name,
+			strerror(errno));
+
+	while((res = squashfs_read_readdir(dir, &ent)) == 1) {
+		unsigned int *block_list;
+		long long start;
+		int i, blocks;
+
+		if(S_ISDIR(ent.type)) {
+			scan_dir(fs, name, ent.inode, regions);
+			continue;
+		}
+
+		if(!S_ISREG(ent.type))
+			continue;
+
+		blocks = squashfs_read_blocklist(fs, ent.inode, &start,
+								&block_list);
+		if(blocks == -1)
+			BAD_ERROR("Failed to read file %s in %s, because %s\n",
+				ent.name, name, strerror(errno));
+
+		for(i = 0; i < blocks; i++) {
+			unsigned int size =
+				SQUASHFS_COMPRESSED_SIZE_BLOCK(block_list[i]);
+
+			/* sparse blocks have no data */
+			if(size) {
+				add_region(regions, name, start, size);
+				start += size;
+			}
+		}
+
+		free(block_list);
+	}
+
+	if(res == -1)
+		BAD_ERROR("Failed to read directory in %s, because %s\n", name,
+			strerror(errno));
+
+	squashfs_read_closedir(dir);
+}
+
+
+static int compare_regions(const void *a, const void *b)
+{
+	const struct region *ra = a, *rb = b;
+
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+
+/*
+ * Return the compressed data blocks and fragment blocks in the filesystem
+ * sorted by their position in the filesystem.  Duplicate files share blocks,
+ * and so blocks are only returned once
+ */
+static struct regions *get_regions(char *name)
+{
+	struct squashfs_read_fs *fs = squashfs_read_open(name, 0, 0);
+	struct regions *regions = calloc(1, sizeof(struct regions));
+	unsigned int i, fragments;
+	int n, count;
+
+	if(fs == NULL)
+		BAD_ERROR("Failed to read Squashfs image %s because %s\n",
+			name, errno == EINVAL ? "it isn't a Squashfs 4.0 "
+			"filesystem" : strerror(errno));
+
+	if(regions == NULL)
+		MEM_ERROR();
+
+	regions->block_size = squashfs_read_block_size(fs);
+	if(regions->block_size > BUFFER_SIZE)
+		BAD_ERROR("Squashfs image %s is corrupt, its block size is "
+			"too large\n", name);
+
+	scan_dir(fs, name, squashfs_read_root(fs), regions);
+
+	fragments = squashfs_read_fragments(fs);
+	for(i = 0; i < fragments; i++) {
+		long long start;
+		unsigned int size;
+
+		if(squashfs_read_fragment(fs, i, &start, &size) == -1)
+			BAD_ERROR("Failed to read fragment table in %s, "
+				"because %s\n", name, strerror(errno));
+
+		add_region(regions, name, start,
+			SQUASHFS_COMPRESSED_SIZE_BLOCK(size));
+	}
+
+	squashfs_read_close(fs);
+
+	qsort(regions->region, regions->count, sizeof(struct region),
+		compare_regions);
+
+	for(count = 0, n = 0; n < regions->count; n++)
+		if(count == 0 || regions->region[n].start !=
+					regions->region[count - 1].start)
+			regions->region[count++] = regions->region[n];
+
+	regions->count = count;
+	return regions;
+}
+
+
+/*
+ * Build an open addressed hash table of the compressed blocks in the old
+ * filesystem, keyed on the hash of their compressed bytes
+ */
+static struct block_hash *hash_regions(int fd, char *name,
+	struct regions *regions, unsigned int *mask)
+{
+	struct block_hash *table;
+	unsigned int size = 1;
+	int i;
+
+	while(size < regions->count * 2)
+		size <<= 1;
+
+	table = calloc(size, sizeof(struct block_hash));
+	if(table == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < regions->count; i++) {
+		struct region *region = &regions->region[i];
+		unsigned long long hash;
+		unsigned int slot;
+
+		read_image(fd, name, region->start, buffer, region->size);
+		hash = hash_bytes(FNV_OFFSET, buffer, region->size);
+
+		for(slot = hash & (size - 1); table[slot].size;
+					slot = (slot + 1) & (size - 1));
+
+		table[slot].hash = hash;
+		table[slot].start = region->start;
+		table[slot].size = region->size;
+	}
+
+	*mask = size - 1;
+	return table;
+}
+
+
+/*
+ * Find the block in the old filesystem identical to <data>, returning
+ * its position, or -1 if there isn't one
+ */
+static long long lookup_block(struct block_hash *table, unsigned int mask,
+	int fd, char *name, void *data, unsigned int size)
+{
+	unsigned long long hash = hash_bytes(FNV_OFFSET, data, size);
+	unsigned int slot;
+
+	for(slot = hash & mask; table[slot].size; slot = (slot + 1) & mask) {
+		if(table[slot].hash != hash || table[slot].size != size)
+			continue;
+
+		read_image(fd, name, table[slot].start, old_buffer, size);
+		if(memcmp(data, old_buffer, size) == 0)
+			return table[slot].start;
+	}
+
+	return -1;
+}
+
+
+/*
+ * Pending delta operation.  Adjacent copies and adjacent literal data are
+ * merged before being written to the delta
+ */
+struct pending {
+	int			type;
+	long long		start;
+	long long		size;
+};
+
+
+static void flush_pending(FILE *delta, int fd, char *name,
+	struct pending *pending)
+{
+	unsigned char record[17];
+	long long start, size;
+
+	if(pending->size == 0)
+		return;
+
+	record[0] = pending->type;
+	put_number(record + 1, pending->type == DELTA_COPY ? pending->start :
+						pending->size);
+	put_number(record + 9, pending->size);
+	write_delta(delta, record, pending->type == DELTA_COPY ? 17 : 9);
+
+	if(pending->type == DELTA_DATA)
+		for(start = pending->start, size = pending->size; size;) {
+			int bytes = size > BUFFER_SIZE ? BUFFER_SIZE : size;
+
+			read_image(fd, name, start, buffer, bytes);
+			write_delta(delta, buffer, bytes);
+			start += bytes;
+			size -= bytes;
+		}
+
+	pending->size = 0;
+}
+
+
+static void add_pending(FILE *delta, int fd, char *name,
+	struct pending *pending, int type, long long start, long long size)
+{
+	if(pending->size && pending->type == type &&
+			pending->start + pending->size == start) {
+		pending->size += size;
+		return;
+	}
+
+	flush_pending(delta, fd, name, pending);
+	pending->type = type;
+	pending->start = start;
+	pending->size = size;
+}
+
+
+static unsigned long long hash_image(int fd, char *name, long long start,
+	long long size, unsigned long long hash)
+{
+	while(size) {
+		int bytes = size > BUFFER_SIZE ? BUFFER_SIZE : size;
+
+		read_image(fd, name, start, buffer, bytes);
+		hash = hash_bytes(hash, buffer, bytes);
+		start += bytes;
+		size -= bytes;
+	}
+
+	return hash;
+}
+
+
+static int generate_delta(char *old_name, char *new_name, char *delta_name)
+{
+	struct regions *old_regions, *new_regions;
+	struct pending pending = { DELTA_DATA, 0, 0 };
+	struct delta_header header;
+	struct block_hash *table;
+	struct stat old_buf, new_buf;
+	unsigned long long hash = FNV_OFFSET;
+	long long pos = 0, copied = 0, blocks = 0;
+	unsigned char record[9];
+	unsigned int mask;
+	int old_fd, new_fd, i;
+	FILE *delta;
+
+	old_fd = open(old_name, O_RDONLY);
+	if(old_fd == -1 || fstat(old_fd, &old_buf) == -1)
+		BAD_ERROR("Failed to open %s, because %s\n", old_name,
+			strerror(errno));
+
+	new_fd = open(new_name, O_RDONLY);
+	if(new_fd == -1 || fstat(new_fd, &new_buf) == -1)
+		BAD_ERROR("Failed to open %s, because %s\n", new_name,
+			strerror(errno));
+
+	old_regions = get_regions(old_name);
+	new_regions = get_regions(new_name);
+	table = hash_regions(old_fd, old_name, old_regions, &mask);
+
+	delta = fopen(delta_name, "w");
+	if(delta == NULL)
+		BAD_ERROR("Failed to create delta file %s, because %s\n",
+			delta_name, strerror(errno));
+
+	memcpy(header.magic, DELTA_MAGIC, 8);
+	put_number(header.old_size, old_buf.st_size);
+	put_number(header.new_size, new_buf.st_size);
+	read_image(old_fd, old_name, 0, &header.old_sBlk,
+		sizeof(struct squashfs_super_block));
+	write_delta(delta, &header, sizeof(header));
+
+	for(i = 0; i < new_regions->count; i++) {
+		struct region *region = &new_regions->region[i];
+		long long start;
+
+		/* ignore anything overlapping, it'll be stored as data */
+		if(region->start < pos || region->start + region->size >
+							new_buf.st_size)
+			continue;
+
+		if(region->start > pos) {
+			hash = hash_image(new_fd, new_name, pos,
+				region->start - pos, hash);
+			add_pending(delta, new_fd, new_name, &pending,
+				DELTA_DATA, pos, region->start - pos);
+		}
+
+		read_image(new_fd, new_name, region->start, buffer,
+			region->size);
+		hash = hash_bytes(hash, buffer, region->size);
+
+		start = lookup_block(table, mask, old_fd, old_name, buffer,
+			region->size);
+		if(start == -1)
+			add_pending(delta, new_fd, new_name, &pending,
+				DELTA_DATA, region->start, region->size);
+		else {
+			add_pending(delta, new_fd, new_name, &pending,
+				DELTA_COPY, start, region->size);
+			copied += region->size;
+			blocks ++;
+		}
+
+		pos = region->start + region->size;
+	}
+
+	if(pos < new_buf.st_size) {
+		hash = hash_image(new_fd, new_name, pos, new_buf.st_size - pos,
+			hash);
+		add_pending(delta, new_fd, new_name, &pending, DELTA_DATA, pos,
+			new_buf.st_size - pos);
+	}
+
+	flush_pending(delta, new_fd, new_name, &pending);
+
+	record[0] = DELTA_END;
+	put_number(record + 1, hash);
+	write_delta(delta, record, 9);
+
+	if(fclose(delta) == EOF)
+		BAD_ERROR("Failed to write delta file %s, because %s\n",
+			delta_name, strerror(errno));
+
+	if(!quiet)
+		printf("%lld of %lld bytes (%lld blocks) copied from %s, "
+			"%lld bytes stored in delta\n", copied,
+			(long long) new_buf.st_size, blocks, old_name,
+			(long long) new_buf.st_size - copied);
+
+	return 0;
+}
+
+
+static int apply_delta(char *old_name, char *delta_name, char *new_name)
+{
+	struct squashfs_super_block sBlk;
+	struct delta_header header;
+	struct stat old_buf;
+	unsigned long long hash = FNV_OFFSET;
+	long long new_size, written = 0;
+	unsigned char record[17];
+	int old_fd, new_fd;
+	FILE *delta;
+
+	old_fd = open(old_name, O_RDONLY);
+	if(old_fd == -1 || fstat(old_fd, &old_buf) == -1)
+		BAD_ERROR("Failed to open %s, because %s\n", old_name,
+			strerror(errno));
+
+	delta = fopen(delta_name, "r");
+	if(delta == NULL)
+		BAD_ERROR("Failed to open delta file %s, because %s\n",
+			delta_name, strerror(errno));
+
+	if(read_delta(delta, &header, sizeof(header)) == FALSE)
+		exit(1);
+
+	if(memcmp(header.magic, DELTA_MAGIC, 8) != 0)
+		BAD_ERROR("%s is not a Squashfs delta file\n", delta_name);
+
+	read_image(old_fd, old_name, 0, &sBlk, sizeof(sBlk));
+	if(get_number(header.old_size) != old_buf.st_size ||
+			memcmp(&sBlk, &header.old_sBlk, sizeof(sBlk)) != 0)
+		BAD_ERROR("Delta file %s was not generated from %s\n",
+			delta_name, old_name);
+
+	new_size = get_number(header.new_size);
+	if(new_size < 0)
+		BAD_ERROR("Delta file %s is corrupt\n", delta_name);
+
+	new_fd = open(new_name, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR |
+		S_IWUSR | S_IRGRP | S_IROTH);
+	if(new_fd == -1)
+		BAD_ERROR("Failed to create %s, because %s\n", new_name,
+			strerror(errno));
+
+	while(1) {
+		long long start = 0, size;
+
+		if(read_delta(delta, record, 9) == FALSE)
+			goto corrupt;
+
+		if(record[0] == DELTA_END)
+			break;
+
+		if(record[0] == DELTA_COPY) {
+			if(read_delta(delta, record + 9, 8) == FALSE)
+				goto corrupt;
+			start = get_number(record + 1);
+			size = get_number(record + 9);
+		} else if(record[0] == DELTA_DATA)
+			size = get_number(record + 1);
+		else
+			goto corrupt;
+
+		/* the delta isn't trusted, check without overflowing */
+		if(size < 0 || size > new_size - written)
+			goto corrupt;
+
+		if(record[0] == DELTA_COPY && (start < 0 ||
+					start > old_buf.st_size - size))
+			goto corrupt;
+
+		while(size) {
+			int bytes = size > BUFFER_SIZE ? BUFFER_SIZE : size;
+
+			if(record[0] == DELTA_COPY) {
+				read_image(old_fd, old_name, start, buffer,
+					bytes);
+				start += bytes;
+			} else if(read_delta(delta, buffer, bytes) == FALSE)
+				goto corrupt;
+
+			if(write_bytes(new_fd, buffer, bytes) == -1)
+				goto failed;
+
+			hash = hash_bytes(hash, buffer, bytes);
+			written += bytes;
+			size -= bytes;
+		}
+	}
+
+	if(written != new_size || hash != get_number(record + 1))
+		goto corrupt;
+
+	if(close(new_fd) == -1)
+		goto failed;
+
+	fclose(delta);
+	return 0;
+
+corrupt:
+	unlink(new_name);
+	BAD_ERROR("Delta file %s is corrupt\n", delta_name);
+
+failed:
+	unlink(new_name);
+	BAD_ERROR("Failed to write %s, because %s\n", new_name,
+		strerror(errno));
+}
+
+
+static void print_options(FILE *stream, char *name)
+{
+	fprintf(stream, "SYNTAX: %s [options] -generate old-image new-image "
+		"delta\n", name);
+	fprintf(stream, "        %s [options] -apply old-image delta "
+		"new-image\n", name);
+	fprintf(stream, "\t-generate\t\tgenerate the delta between old-image ");
+	fprintf(stream, "and new-image\n");
+	fprintf(stream, "\t-apply\t\t\tapply delta to old-image, reconstructing ");
+	fprintf(stream, "new-image\n");
+	fprintf(stream, "\t-q[uiet]\t\tno verbose output\n");
+	fprintf(stream, "\t-h[elp]\t\t\toutput this options text to stdout\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int i, generate = -1;
+
+	for(i = 1; i < argc; i++) {
+		if(*argv[i] != '-')
+			break;
+		if(strcmp(argv[i], "-help") == 0 || strcmp(argv[i], "-h") == 0) {
+			print_options(stdout, argv[0]);
+			exit(0);
+		} else if(strcmp(argv[i], "-generate") == 0)
+			generate = TRUE;
+		else if(strcmp(argv[i], "-apply") == 0)
+			generate = FALSE;
+		else if(strcmp(argv[i], "-quiet") == 0 ||
+				strcmp(argv[i], "-q") == 0)
+			quiet = TRUE;
+		else {
+			print_options(stderr, argv[0]);
+			exit(1);
+		}
+	}
+
+	if(generate == -1 || argc - i != 3) {
+		print_options(stderr, argv[0]);
+		exit(1);
+	}
+
+	buffer = malloc(BUFFER_SIZE);
+	old_buffer = malloc(SQUASHFS_FILE_MAX_SIZE);
+	if(buffer == NULL || old_buffer == NULL)
+		MEM_ERROR();
+
+	if(generate)
+		return generate_delta(argv[i], argv[i + 1], argv[i + 2]);
+	else
+		return apply_delta(argv[i], argv[i + 1], argv[i + 2]);
+}
@@ -0,0 +1,1462 @@
+/*
+ * Read a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * squashfs_read.c
+ *
+ * libsquashfs-read.  This reads Squashfs 4.0 filesystems in the same way
+ * as unsquash-4.c, but with all state held in a handle rather than in
+ * globals, so that it can be embedded and used from multiple threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_swap.h"
+#include "compressor.h"
+#include "squashfs_read.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define CACHE_HASH_SIZE	65536
+#define CACHE_HASH(start)	((start) & 0xffff)
+
+/*
+ * Decompressed metadata or data block.  Blocks are identified by their
+ * on disk start position
+ */
+struct read_cache_entry {
+	long long		start;
+	long long		next;
+	int			length;
+	int			used;
+	struct read_cache_entry	*hash_next;
+	struct read_cache_entry	*hash_prev;
+	struct read_cache_entry	*lru_next;
+	struct read_cache_entry	*lru_prev;
+	char			data[0];
+};
+
+/*
+ * Block cache shared by all threads using the filesystem handle.  Entries
+ * are kept in most recently used order, and unused entries are
+ * discarded from the tail once the cache grows beyond max_size bytes
+ */
+struct read_cache {
+	pthread_mutex_t		mutex;
+	long long		size;
+	long long		max_size;
+	struct read_cache_entry	*lru_head;
+	struct read_cache_entry	*lru_tail;
+	struct read_cache_entry	*hash_table[CACHE_HASH_SIZE];
+};
+
+struct squashfs_read_fs {
+	int				fd;
+	long long			offset;
+	struct squashfs_super_block	sBlk;
+	struct compressor		*comp;
+	unsigned int			*id_table;
+	long long			*fragment_index;
+	long long			xattr_table_start;
+	unsigned int			xattr_ids;
+	long long			*xattr_index;
+	struct read_cache		*cache;
+};
+
+struct squashfs_read_dir {
+	struct squashfs_read_fs		*fs;
+	long long			start;
+	unsigned int			offset;
+	int				bytes;
+	int				size;
+	int				count;
+	struct squashfs_dir_header	dirh;
+};
+
+/* unified in-memory inode */
+struct read_inode {
+	int		type;
+	mode_t		mode;
+	uid_t		uid;
+	gid_t		gid;
+	time_t		mtime;
+	unsigned int	inode_number;
+	unsigned int	nlink;
+	long long	data;
+	long long	start;
+	unsigned int	offset;
+	long long	block_start;
+	unsigned int	block_offset;
+	int		blocks;
+	unsigned int	fragment;
+	int		frag_bytes;
+	unsigned int	rdev;
+	unsigned int	xattr;
+};
+
+static int lookup_type[] = {
+	0,
+	S_IFDIR,
+	S_IFREG,
+	S_IFLNK,
+	S_IFBLK,
+	S_IFCHR,
+	S_IFIFO,
+	S_IFSOCK,
+	S_IFDIR,
+	S_IFREG,
+	S_IFLNK,
+	S_IFBLK,
+	S_IFCHR,
+	S_IFIFO,
+	S_IFSOCK
+};
+
+static char *xattr_prefix[] = {
+	"user.",
+	"trusted.",
+	"security."
+};
+
+
+static struct read_cache *cache_init(long long max_size)
+{
+	struct read_cache *cache = calloc(1, sizeof(struct read_cache));
+
+	if(cache == NULL)
+		return NULL;
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	cache->max_size = max_size;
+
+	return cache;
+}
+
+
+static void cache_free(struct read_cache *cache)
+{
+	struct read_cache_entry *entry, *next;
+
+	for(entry = cache->lru_head; entry; entry = next) {
+		next = entry->lru_next;
+		free(entry);
+	}
+
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache);
+}
+
+
+/* Called with the cache mutex held */
+static void cache_unlink(struct read_cache *cache,
+	struct read_cache_entry *entry)
+{
+	if(entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+
+	if(entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+
+/* Called with the cache mutex held */
+static void cache_make_head(struct read_cache *cache,
+	struct read_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if(cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+}
+
+
+/* Called with the cache mutex held */
+static void cache_evict(struct read_cache *cache)
+{
+	struct read_cache_entry *entry = cache->lru_tail, *prev;
+
+	for(; entry && cache->size > cache->max_size; entry = prev) {
+		prev = entry->lru_prev;
+
+		if(entry->used)
+			continue;
+
+		cache_unlink(cache, entry);
+
+		if(entry->hash_prev)
+			entry->hash_prev->hash_next = entry->hash_next;
+		else
+			cache->hash_table[CACHE_HASH(entry->start)] =
+				entry->hash_next;
+		if(entry->hash_next)
+			entry->hash_next->hash_prev = entry->hash_prev;
+
+		cache->size -= entry->length;
+		free(entry);
+	}
+}
+
+
+static struct read_cache_entry *cache_lookup(struct read_cache *cache,
+	long long start)
+{
+	struct read_cache_entry *entry;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	for(entry = cache->hash_table[CACHE_HASH(start)]; entry;
+						entry = entry->hash_next)
+		if(entry->start == start)
+			break;
+
+	if(entry) {
+		entry->used ++;
+		cache_unlink(cache, entry);
+		cache_make_head(cache, entry);
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	return entry;
+}
+
+
+/*
+ * Insert a newly read block into the cache.  Another thread may have read
+ * and inserted the same block in the meantime, in which case the new
+ * block is discarded and the existing one returned
+ */
+static struct read_cache_entry *cache_insert(struct read_cache *cache,
+	struct read_cache_entry *new)
+{
+	int hash = CACHE_HASH(new->start);
+	struct read_cache_entry *entry;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	for(entry = cache->hash_table[hash]; entry; entry = entry->hash_next)
+		if(entry->start == new->start)
+			break;
+
+	if(entry) {
+		entry->used ++;
+		free(new);
+	} else {
+		entry = new;
+		entry->used = 1;
+		entry->hash_prev = NULL;
+		entry->hash_next = cache->hash_table[hash];
+		if(entry->hash_next)
+			entry->hash_next->hash_prev = entry;
+		cache->hash_table[hash] = entry;
+		cache_make_head(cache, entry);
+		cache->size += entry->length;
+		cache_evict(cache);
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	return entry;
+}
+
+
+static void cache_put(struct read_cache *cache, struct read_cache_entry *entry)
+{
+	pthread_mutex_lock(&cache->mutex);
+	entry->used --;
+	if(entry->used == 0 && cache->size > cache->max_size)
+		cache_evict(cache);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+static int read_bytes(struct squashfs_read_fs *fs, long long byte, int bytes,
+	void *buff)
+{
+	off_t off = fs->offset + byte;
+	int res, count;
+
+	for(count = 0; count < bytes; count += res) {
+		res = pread(fs->fd, buff + count, bytes - count, off + count);
+		if(res < 1) {
+			if(res == 0) {
+				errno = EIO;
+				return FALSE;
+			} else if(errno != EINTR)
+				return FALSE;
+			res = 0;
+		}
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Read <size> bytes at <start> and (if compressed) decompress them into
+ * <dest>, returning the length of the data or -1 on error
+ */
+static int read_decompress(struct squashfs_read_fs *fs, long long start,
+	int size, int compressed, void *dest, int outlen)
+{
+	int res, error;
+	char *buffer;
+
+	if(size > outlen) {
+		errno = EIO;
+		return -1;
+	}
+
+	if(!compressed)
+		return read_bytes(fs, start, size, dest) ? size : -1;
+
+	buffer = malloc(size);
+	if(buffer == NULL)
+		return -1;
+
+	if(read_bytes(fs, start, size, buffer) == FALSE) {
+		free(buffer);
+		return -1;
+	}
+
+	res = compressor_uncompress(fs->comp, dest, buffer, size, outlen,
+		&error);
+	free(buffer);
+
+	if(res == -1)
+		errno = EIO;
+
+	return res;
+}
+
+
+static struct read_cache_entry *read_metadata_block(struct squashfs_read_fs *fs,
+	long long start)
+{
+	struct read_cache_entry *entry = cache_lookup(fs->cache, start);
+	unsigned short c_byte;
+	int size, res;
+
+	if(entry)
+		return entry;
+
+	if(read_bytes(fs, start, 2, &c_byte) == FALSE)
+		return NULL;
+	SQUASHFS_INSWAP_SHORTS(&c_byte, 1);
+
+	size = SQUASHFS_COMPRESSED_SIZE(c_byte);
+
+	entry = malloc(sizeof(struct read_cache_entry) +
+						SQUASHFS_METADATA_SIZE);
+	if(entry == NULL)
+		return NULL;
+
+	res = read_decompress(fs, start + 2, size, SQUASHFS_COMPRESSED(c_byte),
+		entry->data, SQUASHFS_METADATA_SIZE);
+	if(res == -1) {
+		free(entry);
+		return NULL;
+	}
+
+	entry->start = start;
+	entry->next = start + 2 + size;
+	entry->length = res;
+
+	return cache_insert(fs->cache, entry);
+}
+
+
+static struct read_cache_entry *read_data_block(struct squashfs_read_fs *fs,
+	long long start, unsigned int c_byte)
+{
+	struct read_cache_entry *entry = cache_lookup(fs->cache, start);
+	int res;
+
+	if(entry)
+		return entry;
+
+	entry = malloc(sizeof(struct read_cache_entry) + fs->sBlk.block_size);
+	if(entry == NULL)
+		return NULL;
+
+	res = read_decompress(fs, start, SQUASHFS_COMPRESSED_SIZE_BLOCK(c_byte),
+		SQUASHFS_COMPRESSED_BLOCK(c_byte), entry->data,
+		fs->sBlk.block_size);
+	if(res == -1) {
+		free(entry);
+		return NULL;
+	}
+
+	entry->start = start;
+	entry->next = start + SQUASHFS_COMPRESSED_SIZE_BLOCK(c_byte);
+	entry->length = res;
+
+	return cache_insert(fs->cache, entry);
+}
+
+
+/*
+ * Read length bytes from metadata position <block, offset> (block is the
+ * start of the compressed block on disk, and offset is the offset into
+ * the block once decompressed).  Data is packed into consecutive blocks,
+ * and length bytes may require reading more than one block.
+ */
+static int read_metadata(struct squashfs_read_fs *fs, void *buffer,
+	long long *blk, unsigned int *off, int length)
+{
+	struct read_cache_entry *entry;
+	long long block = *blk;
+	unsigned int offset = *off;
+
+	while(length) {
+		int copy;
+
+		entry = read_metadata_block(fs, block);
+		if(entry == NULL)
+			return FALSE;
+
+		if(offset >= entry->length) {
+			cache_put(fs->cache, entry);
+			errno = EIO;
+			return FALSE;
+		}
+
+		copy = entry->length - offset;
+		if(copy > length)
+			copy = length;
+
+		memcpy(buffer, entry->data + offset, copy);
+		buffer += copy;
+		length -= copy;
+		offset += copy;
+
+		if(offset == entry->length) {
+			block = entry->next;
+			offset = 0;
+		}
+
+		cache_put(fs->cache, entry);
+	}
+
+	*blk = block;
+	*off = offset;
+	return TRUE;
+}
+
+
+/*
+ * Read a table stored as consecutive metadata blocks, whose locations are
+ * given by the index stored at <index_start>
+ */
+static void *read_table(struct squashfs_read_fs *fs, long long index_start,
+	int bytes)
+{
+	int indexes = (bytes + SQUASHFS_METADATA_SIZE - 1) /
+						SQUASHFS_METADATA_SIZE;
+	long long *index = malloc(indexes * sizeof(long long));
+	char *table = malloc(bytes);
+	int i;
+
+	if(index == NULL || table == NULL)
+		goto failed;
+
+	if(read_bytes(fs, index_start, indexes * sizeof(long long), index) ==
+									FALSE)
+		goto failed;
+	SQUASHFS_INSWAP_LONG_LONGS(index, indexes);
+
+	for(i = 0; i < indexes; i++) {
+		unsigned int offset = 0;
+		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE :
+			bytes - i * SQUASHFS_METADATA_SIZE;
+
+		if(read_metadata(fs, table + i * SQUASHFS_METADATA_SIZE,
+				&index[i], &offset, expected) == FALSE)
+			goto failed;
+	}
+
+	free(index);
+	return table;
+
+failed:
+	free(index);
+	free(table);
+	return NULL;
+}
+
+
+static int read_inode(struct squashfs_read_fs *fs, long long inode,
+	struct read_inode *i)
+{
+	union squashfs_inode_header header;
+	long long start = fs->sBlk.inode_table_start +
+						SQUASHFS_INODE_BLK(inode);
+	unsigned int offset = SQUASHFS_INODE_OFFSET(inode);
+	long long st = start;
+	unsigned int off = offset;
+	unsigned int block_size = fs->sBlk.block_size;
+	int block_log = fs->sBlk.block_log;
+
+	if(read_metadata(fs, &header.base, &st, &off, sizeof(header.base)) ==
+									FALSE)
+		return FALSE;
+
+	SQUASHFS_INSWAP_BASE_INODE_HEADER(&header.base);
+
+	if(header.base.inode_type < SQUASHFS_DIR_TYPE ||
+			header.base.inode_type > SQUASHFS_LSOCKET_TYPE ||
+			header.base.uid >= fs->sBlk.no_ids ||
+			header.base.guid >= fs->sBlk.no_ids) {
+		errno = EIO;
+		return FALSE;
+	}
+
+	memset(i, 0, sizeof(*i));
+	i->type = header.base.inode_type;
+	i->mode = lookup_type[i->type] | header.base.mode;
+	i->uid = fs->id_table[header.base.uid];
+	i->gid = fs->id_table[header.base.guid];
+	i->mtime = header.base.mtime;
+	i->inode_number = header.base.inode_number;
+	i->xattr = SQUASHFS_INVALID_XATTR;
+	i->fragment = SQUASHFS_INVALID_FRAG;
+	i->nlink = 1;
+
+	switch(i->type) {
+	case SQUASHFS_DIR_TYPE: {
+		struct squashfs_dir_inode_header *inode = &header.dir;
+
+		if(read_metadata(fs, inode, &start, &offset, sizeof(*inode)) ==
+									FALSE)
+			return FALSE;
+		SQUASHFS_INSWAP_DIR_INODE_HEADER(inode);
+
+		i->data = inode->file_size;
+		i->offset = inode->offset;
+		i->start = inode->start_block;
+		i->nlink = inode->nlink;
+		break;
+	}
+	case SQUASHFS_LDIR_TYPE: {
+		struct squashfs_ldir_inode_header *inode = &header.ldir;
+
+		if(read_metadata(fs, inode, &start, &offset, sizeof(*inode)) ==
+									FALSE)
+			return FALSE;
+		SQUASHFS_INSWAP_LDIR_INODE_HEADER(inode);
+
+		i->data = inode->file_size;
+		i->offset = inode->offset;
+		i->start = inode->start_block;
+		i->nlink = inode->nlink;
+		i->xattr = inode->xattr;
+		break;
+	}
+	case SQUASHFS_FILE_TYPE: {
+		struct squashfs_reg_inode_header *inode = &header.reg;
+
+		if(read_metadata(fs, inode, &start, &offset, sizeof(*inode)) ==
+									FALSE)
+			return FALSE;
+		SQUASHFS_INSWAP_REG_INODE_HEADER(inode);
+
+		i->data = inode->file_size;
+		i->fragment = inode->fragment;
+		i->offset = inode->offset;
+		i->start = inode->start_block;
+		break;
+	}
+	case SQUASHFS_LREG_TYPE: {
+		struct squashfs_lreg_inode_header *inode = &header.lreg;
+
+		if(read_metadata(fs, inode, &start, &offset, sizeof(*inode)) ==
+									FALSE)
+			return FALSE;
+		SQUASHFS_INSWAP_LREG_INODE_HEADER(inode);
+
+		i->data = inode->file_size;
+		i->fragment = inode->fragment;
+		i->offset = inode->offset;
+		i->start = inode->start_block;
+		i->nlink = inode->nlink;
+		i->xattr = inode->xattr;
+		break;
+	}
+	case SQUASHFS_SYMLINK_TYPE:
+	case SQUASHFS_LSYMLINK_TYPE: {
+		struct squashfs_symlink_inode_header *inode = &header.symlink;
+
+		if(read_metadata(fs, inode, &start, &offset, sizeof(*inode)) ==
+									FALSE)
+			return FALSE;
+		SQUASHFS_INSWAP_SYMLINK_INODE_HEADER(inode);
+
+		i->data = inode->symlink_size;
+		i->nlink = inode->nlink;
+		i->block_start = start;
+		i->block_offset = offset;
+
+		if(i->type == SQUASHFS_LSYMLINK_TYPE) {
+			/* the xattr index follows the symlink */
+			char *buffer = malloc(inode->symlink_size +
+							sizeof(unsigned int));
+			unsigned int xattr;
+			int res;
+
+			if(buffer == NULL)
+				return FALSE;
+
+			res = read_metadata(fs, buffer, &start, &offset,
+				inode->symlink_size + sizeof(unsigned int));
+			if(res)
+				memcpy(&xattr, buffer + inode->symlink_size,
+					sizeof(unsigned int));
+			free(buffer);
+			if(res == FALSE)
+				return FALSE;
+
+			SQUASHFS_INSWAP_INTS(&xattr, 1);
+			i->xattr = xattr;
+		}
+		break;
+	}
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_CHRDEV_TYPE: {
+		struct squashfs_dev_inode_header *inode = &header.dev;
+
+		if(read_metadata(fs, inode, &start, &offset, sizeof(*inode)) ==
+									FALSE)
+			return FALSE;
+		SQUASHFS_INSWAP_DEV_INODE_HEADER(inode);
+
+		i->rdev = inode->rdev;
+		i->nlink = inode->nlink;
+		break;
+	}
+	case SQUASHFS_LBLKDEV_TYPE:
+	case SQUASHFS_LCHRDEV_TYPE: {
+		struct squashfs_ldev_inode_header *inode = &header.ldev;
+
+		if(read_metadata(fs, inode, &start, &offset, sizeof(*inode)) ==
+									FALSE)
+			return FALSE;
+		SQUASHFS_INSWAP_LDEV_INODE_HEADER(inode);
+
+		i->rdev = inode->rdev;
+		i->nlink = inode->nlink;
+		i->xattr = inode->xattr;
+		break;
+	}
+	case SQUASHFS_FIFO_TYPE:
+	case SQUASHFS_SOCKET_TYPE: {
+		struct squashfs_ipc_inode_header *inode = &header.ipc;
+
+		if(read_metadata(fs, inode, &start, &offset, sizeof(*inode)) ==
+									FALSE)
+			return FALSE;
+		SQUASHFS_INSWAP_IPC_INODE_HEADER(inode);
+
+		i->nlink = inode->nlink;
+		break;
+	}
+	case SQUASHFS_LFIFO_TYPE:
+	case SQUASHFS_LSOCKET_TYPE: {
+		struct squashfs_lipc_inode_header *inode = &header.lipc;
+
+		if(read_metadata(fs, inode, &start, &offset, sizeof(*inode)) ==
+									FALSE)
+			return FALSE;
+		SQUASHFS_INSWAP_LIPC_INODE_HEADER(inode);
+
+		i->nlink = inode->nlink;
+		i->xattr = inode->xattr;
+		break;
+	}
+	}
+
+	if(i->type == SQUASHFS_FILE_TYPE || i->type == SQUASHFS_LREG_TYPE) {
+		if(i->fragment == SQUASHFS_INVALID_FRAG)
+			i->blocks = (i->data + block_size - 1) >> block_log;
+		else {
+			if(i->fragment >= fs->sBlk.fragments) {
+				errno = EIO;
+				return FALSE;
+			}
+			i->blocks = i->data >> block_log;
+			i->frag_bytes = i->data & (block_size - 1);
+		}
+
+		/* the block list follows the inode */
+		i->block_start = start;
+		i->block_offset = offset;
+	}
+
+	return TRUE;
+}
+
+
+static int read_fragment(struct squashfs_read_fs *fs, unsigned int fragment,
+	long long *start_block, unsigned int *size)
+{
+	struct squashfs_fragment_entry entry;
+	long long start = fs->fragment_index[SQUASHFS_FRAGMENT_INDEX(fragment)];
+	unsigned int offset = SQUASHFS_FRAGMENT_INDEX_OFFSET(fragment);
+
+	if(read_metadata(fs, &entry, &start, &offset, sizeof(entry)) == FALSE)
+		return FALSE;
+	SQUASHFS_INSWAP_FRAGMENT_ENTRY(&entry);
+
+	*start_block = entry.start_block;
+	*size = entry.size;
+	return TRUE;
+}
+
+
+struct squashfs_read_fs *squashfs_read_open(const char *filename,
+	long long offset, int cache_size)
+{
+	struct squashfs_read_fs *fs = calloc(1, sizeof(struct squashfs_read_fs));
+	struct squashfs_super_block *sBlk;
+	int res;
+
+	if(fs == NULL)
+		return NULL;
+
+	sBlk = &fs->sBlk;
+	fs->offset = offset;
+	fs->fd = open(filename, O_RDONLY);
+	if(fs->fd == -1)
+		goto failed;
+
+	if(read_bytes(fs, SQUASHFS_START, sizeof(*sBlk), sBlk) == FALSE)
+		goto failed;
+	SQUASHFS_INSWAP_SUPER_BLOCK(sBlk);
+
+	if(sBlk->s_magic != SQUASHFS_MAGIC || sBlk->s_major != 4 ||
+						sBlk->s_minor != 0) {
+		errno = EINVAL;
+		goto failed;
+	}
+
+	if(sBlk->block_size > SQUASHFS_FILE_MAX_SIZE ||
+			sBlk->block_log > SQUASHFS_FILE_MAX_LOG ||
+			sBlk->block_size != (1 << sBlk->block_log) ||
+			sBlk->no_ids == 0 ||
+			sBlk->inode_table_start >= sBlk->directory_table_start) {
+		errno = EIO;
+		goto failed;
+	}
+
+	fs->comp = lookup_compressor_id(sBlk->compression);
+	if(!fs->comp->supported) {
+		errno = EOPNOTSUPP;
+		goto failed;
+	}
+
+	if(cache_size <= 0)
+		cache_size = SQUASHFS_READ_CACHE_DEFAULT;
+
+	fs->cache = cache_init((long long) cache_size << 20);
+	if(fs->cache == NULL)
+		goto failed;
+
+	/*
+	 * Read compression options from disk if present, and pass to
+	 * the compressor to ensure we know how to decompress a filesystem
+	 * compressed with these compression options.
+	 */
+	if(SQUASHFS_COMP_OPTS(sBlk->flags)) {
+		struct read_cache_entry *entry = read_metadata_block(fs,
+						sizeof(*sBlk));
+
+		if(entry == NULL)
+			goto failed;
+
+		res = compressor_check_options(fs->comp, sBlk->block_size,
+			entry->data, entry->length);
+		cache_put(fs->cache, entry);
+	} else
+		res = compressor_check_options(fs->comp, sBlk->block_size,
+			NULL, 0);
+
+	if(res == -1) {
+		errno = EOPNOTSUPP;
+		goto failed;
+	}
+
+	fs->id_table = read_table(fs, sBlk->id_table_start,
+					SQUASHFS_ID_BYTES(sBlk->no_ids));
+	if(fs->id_table == NULL)
+		goto failed;
+	SQUASHFS_INSWAP_INTS(fs->id_table, sBlk->no_ids);
+
+	if(sBlk->fragments) {
+		int indexes = SQUASHFS_FRAGMENT_INDEXES((long long)
+							sBlk->fragments);
+
+		fs->fragment_index = malloc(indexes * sizeof(long long));
+		if(fs->fragment_index == NULL)
+			goto failed;
+
+		if(read_bytes(fs, sBlk->fragment_table_start, indexes *
+			sizeof(long long), fs->fragment_index) == FALSE)
+			goto failed;
+		SQUASHFS_INSWAP_FRAGMENT_INDEXES(fs->fragment_index, indexes);
+	}
+
+	if(sBlk->xattr_id_table_start != SQUASHFS_INVALID_BLK) {
+		struct squashfs_xattr_table id_table;
+		int indexes;
+
+		if(read_bytes(fs, sBlk->xattr_id_table_start, sizeof(id_table),
+							&id_table) == FALSE)
+			goto failed;
+		SQUASHFS_INSWAP_XATTR_TABLE(&id_table);
+
+		fs->xattr_table_start = id_table.xattr_table_start;
+		fs->xattr_ids = id_table.xattr_ids;
+		indexes = SQUASHFS_XATTR_BLOCKS((long long) fs->xattr_ids);
+
+		fs->xattr_index = malloc(indexes * sizeof(long long));
+		if(fs->xattr_index == NULL)
+			goto failed;
+
+		if(read_bytes(fs, sBlk->xattr_id_table_start +
+				sizeof(id_table), indexes * sizeof(long long),
+				fs->xattr_index) == FALSE)
+			goto failed;
+		SQUASHFS_INSWAP_LONG_LONGS(fs->xattr_index, indexes);
+	}
+
+	return fs;
+
+failed:
+	squashfs_read_close(fs);
+	return NULL;
+}
+
+
+void squashfs_read_close(struct squashfs_read_fs *fs)
+{
+	int err = errno;
+
+	if(fs->fd != -1)
+		close(fs->fd);
+	if(fs->cache)
+		cache_free(fs->cache);
+	free(fs->id_table);
+	free(fs->fragment_index);
+	free(fs->xattr_index);
+	free(fs);
+
+	errno = err;
+}
+
+
+long long squashfs_read_root(struct squashfs_read_fs *fs)
+{
+	return fs->sBlk.root_inode;
+}
+
+
+unsigned int squashfs_read_block_size(struct squashfs_read_fs *fs)
+{
+	return fs->sBlk.block_size;
+}
+
+
+int squashfs_read_compression(struct squashfs_read_fs *fs)
+{
+	return fs->sBlk.compression;
+}
+
+
+int squashfs_read_stat(struct squashfs_read_fs *fs, long long inode,
+	struct squashfs_read_stat *buf)
+{
+	struct read_inode i;
+
+	if(read_inode(fs, inode, &i) == FALSE)
+		return -1;
+
+	buf->inode = inode;
+	buf->inode_number = i.inode_number;
+	buf->mode = i.mode;
+	buf->uid = i.uid;
+	buf->gid = i.gid;
+	buf->mtime = i.mtime;
+	buf->nlink = i.nlink;
+	buf->size = i.data;
+	buf->rdev = makedev((i.rdev >> 8) & 0xfff,
+				(i.rdev & 0xff) | ((i.rdev >> 12) & 0xfff00));
+	buf->xattr = i.xattr;
+
+	return 0;
+}
+
+
+struct squashfs_read_dir *squashfs_read_opendir(struct squashfs_read_fs *fs,
+	long long inode)
+{
+	struct squashfs_read_dir *dir;
+	struct read_inode i;
+
+	if(read_inode(fs, inode, &i) == FALSE)
+		return NULL;
+
+	if(!S_ISDIR(i.mode)) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	dir = malloc(sizeof(struct squashfs_read_dir));
+	if(dir == NULL)
+		return NULL;
+
+	dir->fs = fs;
+	dir->start = fs->sBlk.directory_table_start + i.start;
+	dir->offset = i.offset;
+	dir->bytes = 0;
+	/* directory file size includes the implicit "." and ".." entries */
+	dir->size = i.data - 3;
+	dir->count = 0;
+
+	return dir;
+}
+
+
+int squashfs_read_readdir(struct squashfs_read_dir *dir,
+	struct squashfs_read_dirent *ent)
+{
+	struct squashfs_dir_entry dire;
+	int res;
+
+	if(dir->count == 0) {
+		if(dir->bytes >= dir->size)
+			return 0;
+
+		res = read_metadata(dir->fs, &dir->dirh, &dir->start,
+			&dir->offset, sizeof(dir->dirh));
+		if(res == FALSE)
+			return -1;
+		SQUASHFS_INSWAP_DIR_HEADER(&dir->dirh);
+
+		dir->bytes += sizeof(dir->dirh);
+		dir->count = dir->dirh.count + 1;
+
+		/* count should never be larger than SQUASHFS_DIR_COUNT */
+		if(dir->count > SQUASHFS_DIR_COUNT)
+			goto corrupted;
+	}
+
+	res = read_metadata(dir->fs, &dire, &dir->start, &dir->offset,
+								sizeof(dire));
+	if(res == FALSE)
+		return -1;
+	SQUASHFS_INSWAP_DIR_ENTRY(&dire);
+
+	/* size should never be SQUASHFS_NAME_LEN or larger */
+	if(dire.size >= SQUASHFS_NAME_LEN || dire.type < SQUASHFS_DIR_TYPE ||
+					dire.type > SQUASHFS_LSOCKET_TYPE)
+		goto corrupted;
+
+	res = read_metadata(dir->fs, ent->name, &dir->start, &dir->offset,
+								dire.size + 1);
+	if(res == FALSE)
+		return -1;
+	ent->name[dire.size + 1] = '\0';
+
+	/* check name for invalid characters (i.e /, ., ..) */
+	if(strchr(ent->name, '/') || strcmp(ent->name, ".") == 0 ||
+					strcmp(ent->name, "..") == 0)
+		goto corrupted;
+
+	dir->bytes += sizeof(dire) + dire.size + 1;
+	dir->count --;
+
+	ent->inode = SQUASHFS_MKINODE(dir->dirh.start_block, dire.offset);
+	ent->inode_number = dir->dirh.inode_number + dire.inode_number;
+	ent->type = lookup_type[dire.type];
+
+	return 1;
+
+corrupted:
+	errno = EIO;
+	return -1;
+}
+
+
+void squashfs_read_closedir(struct squashfs_read_dir *dir)
+{
+	free(dir);
+}
+
+
+/*
+ * Look up <pathname> relative to the root directory.  Symbolic links are
+ * not followed
+ */
+int squashfs_read_lookup(struct squashfs_read_fs *fs, const char *pathname,
+	long long *inode)
+{
+	struct squashfs_read_dirent ent;
+	long long cur = fs->sBlk.root_inode;
+
+	while(1) {
+		struct squashfs_read_dir *dir;
+		const char *end;
+		int len, res;
+
+		while(*pathname == '/')
+			pathname ++;
+
+		if(*pathname == '\0')
+			break;
+
+		for(end = pathname; *end != '/' && *end != '\0'; end ++);
+		len = end - pathname;
+
+		dir = squashfs_read_opendir(fs, cur);
+		if(dir == NULL)
+			return -1;
+
+		/* directories are sorted, so stop once past the name */
+		while((res = squashfs_read_readdir(dir, &ent)) == 1) {
+			int cmp = strncmp(ent.name, pathname, len);
+
+			if(cmp == 0 && ent.name[len] == '\0')
+				break;
+			if(cmp > 0) {
+				res = 0;
+				break;
+			}
+		}
+
+		squashfs_read_closedir(dir);
+
+		if(res == -1)
+			return -1;
+		else if(res == 0) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		cur = ent.inode;
+		pathname = end;
+	}
+
+	*inode = cur;
+	return 0;
+}
+
+
+int squashfs_read_stat_path(struct squashfs_read_fs *fs, const char *pathname,
+	struct squashfs_read_stat *buf)
+{
+	long long inode;
+
+	if(squashfs_read_lookup(fs, pathname, &inode) == -1)
+		return -1;
+
+	return squashfs_read_stat(fs, inode, buf);
+}
+
+
+ssize_t squashfs_read_pread(struct squashfs_read_fs *fs, long long inode,
+	void *buf, size_t count, long long offset)
+{
+	unsigned int block_size = fs->sBlk.block_size;
+	unsigned int *block_list = NULL;
+	long long start, pos = offset;
+	struct read_inode i;
+	int first, last, index;
+	size_t bytes = 0;
+
+	if(read_inode(fs, inode, &i) == FALSE)
+		return -1;
+
+	if(!S_ISREG(i.mode)) {
+		errno = S_ISDIR(i.mode) ? EISDIR : EINVAL;
+		return -1;
+	}
+
+	if(offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(offset >= i.data || count == 0)
+		return 0;
+
+	if(count > i.data - offset)
+		count = i.data - offset;
+
+	/*
+	 * Work out which blocks cover the range, and read the block list
+	 * up to the last of them, this is needed to find their on disk
+	 * location
+	 */
+	first = offset / block_size;
+	last = (offset + count - 1) / block_size;
+	if(last >= i.blocks)
+		last = i.blocks - 1;
+
+	if(last >= 0) {
+		block_list = malloc((last + 1) * sizeof(unsigned int));
+		if(block_list == NULL)
+			return -1;
+
+		if(read_metadata(fs, block_list, &i.block_start,
+				&i.block_offset, (last + 1) *
+				sizeof(unsigned int)) == FALSE)
+			goto failed;
+		SQUASHFS_INSWAP_INTS(block_list, last + 1);
+	}
+
+	for(start = i.start, index = 0; index < first && index <= last; index++)
+		start += SQUASHFS_COMPRESSED_SIZE_BLOCK(block_list[index]);
+
+	for(index = first; bytes < count; index ++) {
+		struct read_cache_entry *entry;
+		int block_offset = pos - (long long) index * block_size;
+		int avail = block_size - block_offset;
+
+		if(avail > count - bytes)
+			avail = count - bytes;
+
+		if(index < i.blocks) {
+			if(block_list[index] == 0) {
+				/* sparse block */
+				memset(buf + bytes, 0, avail);
+				goto next;
+			}
+
+			entry = read_data_block(fs, start, block_list[index]);
+			start += SQUASHFS_COMPRESSED_SIZE_BLOCK(
+							block_list[index]);
+		} else {
+			long long frag_start;
+			unsigned int frag_size;
+
+			if(read_fragment(fs, i.fragment, &frag_start,
+							&frag_size) == FALSE)
+				goto failed;
+
+			entry = read_data_block(fs, frag_start, frag_size);
+			block_offset += i.offset;
+		}
+
+		if(entry == NULL)
+			goto failed;
+
+		if(block_offset + avail > entry->length) {
+			cache_put(fs->cache, entry);
+			errno = EIO;
+			goto failed;
+		}
+
+		memcpy(buf + bytes, entry->data + block_offset, avail);
+		cache_put(fs->cache, entry);
+
+next:
+		bytes += avail;
+		pos += avail;
+	}
+
+	free(block_list);
+	return bytes;
+
+failed:
+	free(block_list);
+	return -1;
+}
+
+
+ssize_t squashfs_read_pread_path(struct squashfs_read_fs *fs,
+	const char *pathname, void *buf, size_t count, long long offset)
+{
+	long long inode;
+
+	if(squashfs_read_lookup(fs, pathname, &inode) == -1)
+		return -1;
+
+	return squashfs_read_pread(fs, inode, buf, count, offset);
+}
+
+
+ssize_t squashfs_read_readlink(struct squashfs_read_fs *fs, long long inode,
+	char *buf, size_t size)
+{
+	struct read_inode i;
+
+	if(read_inode(fs, inode, &i) == FALSE)
+		return -1;
+
+	if(!S_ISLNK(i.mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(size > i.data)
+		size = i.data;
+
+	if(read_metadata(fs, buf, &i.block_start, &i.block_offset, size) ==
+									FALSE)
+		return -1;
+
+	return size;
+}
+
+
+/*
+ * Return the block list of regular file <inode>, and the on disk start of
+ * its first block.  The block list is malloced and should be freed by
+ * the caller.  Returns the number of blocks, or -1 on error
+ */
+int squashfs_read_blocklist(struct squashfs_read_fs *fs, long long inode,
+	long long *start, unsigned int **block_list)
+{
+	unsigned int *list = NULL;
+	struct read_inode i;
+
+	if(read_inode(fs, inode, &i) == FALSE)
+		return -1;
+
+	if(!S_ISREG(i.mode)) {
+		errno = S_ISDIR(i.mode) ? EISDIR : EINVAL;
+		return -1;
+	}
+
+	if(i.blocks) {
+		list = malloc(i.blocks * sizeof(unsigned int));
+		if(list == NULL)
+			return -1;
+
+		if(read_metadata(fs, list, &i.block_start, &i.block_offset,
+				i.blocks * sizeof(unsigned int)) == FALSE) {
+			free(list);
+			return -1;
+		}
+		SQUASHFS_INSWAP_INTS(list, i.blocks);
+	}
+
+	*start = i.start;
+	*block_list = list;
+	return i.blocks;
+}
+
+
+/*
+ * Read <count> bytes at filesystem position <start> without decompressing
+ * them
+ */
+ssize_t squashfs_read_raw(struct squashfs_read_fs *fs, long long start,
+	void *buf, size_t count)
+{
+	return read_bytes(fs, start, count, buf) ? count : -1;
+}
+
+
+unsigned int squashfs_read_fragments(struct squashfs_read_fs *fs)
+{
+	return fs->sBlk.fragments;
+}
+
+
+int squashfs_read_fragment(struct squashfs_read_fs *fs, unsigned int fragment,
+	long long *start, unsigned int *size)
+{
+	if(fragment >= fs->sBlk.fragments) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return read_fragment(fs, fragment, start, size) ? 0 : -1;
+}
+
+
+void squashfs_read_free_xattrs(struct squashfs_read_xattr *xattrs, int count)
+{
+	int err = errno, i;
+
+	for(i = 0; i < count; i++) {
+		free(xattrs[i].name);
+		free(xattrs[i].value);
+	}
+
+	free(xattrs);
+	errno = err;
+}
+
+
+static void *read_xattr_value(struct squashfs_read_fs *fs, long long *start,
+	unsigned int *offset, int *vsize)
+{
+	struct squashfs_xattr_val val;
+	void *value;
+
+	if(read_metadata(fs, &val, start, offset, sizeof(val)) == FALSE)
+		return NULL;
+	SQUASHFS_INSWAP_XATTR_VAL(&val);
+
+	value = malloc(val.vsize ? : 1);
+	if(value == NULL)
+		return NULL;
+
+	if(read_metadata(fs, value, start, offset, val.vsize) == FALSE) {
+		free(value);
+		return NULL;
+	}
+
+	*vsize = val.vsize;
+	return value;
+}
+
+
+/*
+ * Return the xattrs of <inode>.  The xattr list is malloced and should
+ * be freed with squashfs_read_free_xattrs().  Returns the number of
+ * xattrs, or -1 on error
+ */
+int squashfs_read_xattrs(struct squashfs_read_fs *fs, long long inode,
+	struct squashfs_read_xattr **list)
+{
+	struct squashfs_read_xattr *xattrs;
+	struct squashfs_xattr_id id;
+	struct read_inode i;
+	long long start;
+	unsigned int offset;
+	int count;
+
+	if(read_inode(fs, inode, &i) == FALSE)
+		return -1;
+
+	*list = NULL;
+	if(i.xattr == SQUASHFS_INVALID_XATTR)
+		return 0;
+
+	if(i.xattr >= fs->xattr_ids) {
+		errno = EIO;
+		return -1;
+	}
+
+	start = fs->xattr_index[SQUASHFS_XATTR_BLOCK(i.xattr)];
+	offset = SQUASHFS_XATTR_BLOCK_OFFSET(i.xattr);
+	if(read_metadata(fs, &id, &start, &offset, sizeof(id)) == FALSE)
+		return -1;
+	SQUASHFS_INSWAP_XATTR_ID(&id);
+
+	if(id.count == 0)
+		return 0;
+
+	xattrs = calloc(id.count, sizeof(struct squashfs_read_xattr));
+	if(xattrs == NULL)
+		return -1;
+
+	start = fs->xattr_table_start + SQUASHFS_XATTR_BLK(id.xattr);
+	offset = SQUASHFS_XATTR_OFFSET(id.xattr);
+
+	for(count = 0; count < id.count; count++) {
+		struct squashfs_read_xattr *xattr = &xattrs[count];
+		struct squashfs_xattr_entry entry;
+		int type, prefix_size;
+
+		if(read_metadata(fs, &entry, &start, &offset, sizeof(entry)) ==
+									FALSE)
+			goto failed;
+		SQUASHFS_INSWAP_XATTR_ENTRY(&entry);
+
+		type = entry.type & SQUASHFS_XATTR_PREFIX_MASK;
+		if(type > SQUASHFS_XATTR_SECURITY) {
+			errno = EIO;
+			goto failed;
+		}
+
+		prefix_size = strlen(xattr_prefix[type]);
+		xattr->name = malloc(prefix_size + entry.size + 1);
+		if(xattr->name == NULL)
+			goto failed;
+
+		memcpy(xattr->name, xattr_prefix[type], prefix_size);
+		if(read_metadata(fs, xattr->name + prefix_size, &start,
+					&offset, entry.size) == FALSE)
+			goto failed;
+		xattr->name[prefix_size + entry.size] = '\0';
+
+		if(entry.type & SQUASHFS_XATTR_VALUE_OOL) {
+			/*
+			 * Value is stored out of line, the inline value is a
+			 * reference to where it is stored
+			 */
+			long long *ref, ool_start;
+			unsigned int ool_offset;
+			int vsize;
+
+			ref = read_xattr_value(fs, &start, &offset, &vsize);
+			if(ref == NULL)
+				goto failed;
+
+			if(vsize != sizeof(long long)) {
+				free(ref);
+				errno = EIO;
+				goto failed;
+			}
+
+			SQUASHFS_INSWAP_LONG_LONGS(ref, 1);
+			ool_start = fs->xattr_table_start +
+						SQUASHFS_XATTR_BLK(*ref);
+			ool_offset = SQUASHFS_XATTR_OFFSET(*ref);
+			free(ref);
+
+			xattr->value = read_xattr_value(fs, &ool_start,
+						&ool_offset, &xattr->vsize);
+		} else
+			xattr->value = read_xattr_value(fs, &start, &offset,
+						&xattr->vsize);
+
+		if(xattr->value == NULL)
+			goto failed;
+	}
+
+	*list = xattrs;
+	return count;
+
+failed:
+	squashfs_read_free_xattrs(xattrs, id.count);
+	return -1;
+}
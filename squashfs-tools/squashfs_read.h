@@ -0,0 +1,144 @@
+#ifndef SQUASHFS_READ_H
+#define SQUASHFS_READ_H
+/*
+ * Read a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * squashfs_read.h
+ *
+ * Public interface to libsquashfs-read, a library which reads files and
+ * directories out of a Squashfs 4.0 filesystem image without extracting
+ * it.
+ *
+ * All state is held in the handle returned by squashfs_read_open(), and
+ * all functions taking a handle may be called concurrently from multiple
+ * threads.  Decompressed metadata and data blocks are kept in a block cache
+ * owned by the handle, and shared by all threads using it.
+ *
+ * Inodes are identified by their inode reference (the <block:offset>
+ * position of the inode in the inode table, as stored in directories).
+ *
+ * Unless otherwise stated functions return 0 on success, and -1 on
+ * failure with errno set.
+ */
+
+#include <sys/types.h>
+#include <time.h>
+
+/* default size of the block cache in Mbytes */
+#define SQUASHFS_READ_CACHE_DEFAULT	64
+
+struct squashfs_read_fs;
+struct squashfs_read_dir;
+
+struct squashfs_read_stat {
+	long long	inode;
+	unsigned int	inode_number;
+	mode_t		mode;
+	uid_t		uid;
+	gid_t		gid;
+	time_t		mtime;
+	unsigned int	nlink;
+	long long	size;
+	dev_t		rdev;
+	unsigned int	xattr;
+};
+
+struct squashfs_read_xattr {
+	char		*name;
+	void		*value;
+	int		vsize;
+};
+
+struct squashfs_read_dirent {
+	long long	inode;
+	unsigned int	inode_number;
+	mode_t		type;
+	char		name[257];
+};
+
+/*
+ * Open filesystem <filename>, which starts <offset> bytes into the file.
+ * <cache_size> is the size of the block cache in Mbytes, or 0 for
+ * the default.
+ */
+extern struct squashfs_read_fs *squashfs_read_open(const char *filename,
+	long long offset, int cache_size);
+extern void squashfs_read_close(struct squashfs_read_fs *fs);
+
+extern long long squashfs_read_root(struct squashfs_read_fs *fs);
+extern unsigned int squashfs_read_block_size(struct squashfs_read_fs *fs);
+/* returns the compressor id (SQUASHFS_xxx_COMPRESSION) */
+extern int squashfs_read_compression(struct squashfs_read_fs *fs);
+
+extern int squashfs_read_lookup(struct squashfs_read_fs *fs,
+	const char *pathname, long long *inode);
+extern int squashfs_read_stat(struct squashfs_read_fs *fs, long long inode,
+	struct squashfs_read_stat *buf);
+extern int squashfs_read_stat_path(struct squashfs_read_fs *fs,
+	const char *pathname, struct squashfs_read_stat *buf);
+
+extern struct squashfs_read_dir *squashfs_read_opendir(
+	struct squashfs_read_fs *fs, long long inode);
+/* returns 1 if an entry was returned, 0 at the end of the directory */
+extern int squashfs_read_readdir(struct squashfs_read_dir *dir,
+	struct squashfs_read_dirent *ent);
+extern void squashfs_read_closedir(struct squashfs_read_dir *dir);
+
+/* returns the number of bytes read, which is short at end of file */
+extern ssize_t squashfs_read_pread(struct squashfs_read_fs *fs,
+	long long inode, void *buf, size_t count, long long offset);
+extern ssize_t squashfs_read_pread_path(struct squashfs_read_fs *fs,
+	const char *pathname, void *buf, size_t count, long long offset);
+
+/* returns the length of the symbolic link, which is not NUL terminated */
+extern ssize_t squashfs_read_readlink(struct squashfs_read_fs *fs,
+	long long inode, char *buf, size_t size);
+
+/*
+ * Low level access to file data, used to copy compressed data blocks
+ * between filesystems without decompressing them.
+ * squashfs_read_blocklist() returns the number of blocks in the (malloced)
+ * block list, which holds the on disk size of each block as stored in
+ * the inode
+ */
+extern int squashfs_read_blocklist(struct squashfs_read_fs *fs,
+	long long inode, long long *start, unsigned int **block_list);
+extern ssize_t squashfs_read_raw(struct squashfs_read_fs *fs, long long start,
+	void *buf, size_t count);
+
+/*
+ * squashfs_read_fragments() returns the number of fragment blocks, and
+ * squashfs_read_fragment() returns the on disk start and size (as stored
+ * in the fragment table) of fragment block <fragment>
+ */
+extern unsigned int squashfs_read_fragments(struct squashfs_read_fs *fs);
+extern int squashfs_read_fragment(struct squashfs_read_fs *fs,
+	unsigned int fragment, long long *start, unsigned int *size);
+
+/*
+ * returns the number of xattrs in the (malloced) xattr list, names include
+ * the namespace prefix
+ */
+extern int squashfs_read_xattrs(struct squashfs_read_fs *fs, long long inode,
+	struct squashfs_read_xattr **list);
+extern void squashfs_read_free_xattrs(struct squashfs_read_xattr *list,
+	int count);
+#endif
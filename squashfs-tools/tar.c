@@ -231,13 +231,10 @@ static struct inode_info *new_inode(struct tar_file *tar_file)
 	struct inode_info *inode;
 	int bytes = tar_file->link ? strlen(tar_file->link) + 1 : 0;
 
-	inode = malloc(sizeof(struct inode_info) + bytes);
-	if(inode == NULL)
-		MEM_ERROR();
-
+	inode = alloc_inode(bytes);
 	if(bytes)
 		memcpy(&inode->symlink, tar_file->link, bytes);
-	memcpy(&inode->buf, &tar_file->buf, sizeof(struct stat));
+	get_inode_stat(&inode->buf, &tar_file->buf);
 	inode->read = FALSE;
 	inode->root_entry = FALSE;
 	inode->tar_file = tar_file;
@@ -246,6 +243,10 @@ static struct inode_info *new_inode(struct tar_file *tar_file)
 	inode->inode_number = 0;
 	inode->dummy_root_dir = FALSE;
 	inode->tarfile = TRUE;
+	inode->image = FALSE;
+	inode->image_file = NULL;
+	inode->xattr_list = NULL;
+	inode->xattrs = -1;
 
 	/*
 	 * Copy filesystem wide defaults into inode, these filesystem
@@ -257,9 +258,7 @@ static struct inode_info *new_inode(struct tar_file *tar_file)
 	inode->always_use_fragments = always_use_fragments;
 	inode->noD = noD;
 	inode->noF = noF;
-
-	inode->next = inode_info[0];
-	inode_info[0] = inode;
+	inode->hashed = FALSE;
 
 	return inode;
 }
@@ -390,6 +389,7 @@ static struct dir_info *add_tarfile(struct dir_info *sdir, char *source,
 			goto failed_early;
 
 		entry = create_dir_entry(name, NULL, NULL, dir);
+		free(name);
 
 		if(source[0] == '\0') {
 			if(S_ISDIR(tarfile->buf.st_mode)) {
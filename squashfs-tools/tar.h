@@ -132,6 +132,8 @@ struct tar_file {
 extern void read_tar_file();
 extern squashfs_inode process_tar_file(int progress);
 
+struct inode_info;
+
 #ifdef XATTR_SUPPORT
 extern int xattr_get_prefix(struct xattr_list *, char *);
 extern void read_tar_xattr(char *, char *, int, int, struct tar_file *);
@@ -31,6 +31,7 @@
 #include "unsquashfs_info.h"
 #include "stdarg.h"
 #include "fnmatch_compat.h"
+#include "match_index.h"
 
 #include <sys/sysinfo.h>
 #include <sys/sysmacros.h>
@@ -97,6 +98,12 @@ struct pathname *extract = NULL, *exclude = NULL;
 int writer_fd = 1;
 int pseudo_file = FALSE;
 char *pseudo_name;
+int copy_range = TRUE;
+long long cat_offset = 0, cat_length = -1;
+int verify = FALSE;
+int tar_output = FALSE;
+struct verify_block *verify_blocks = NULL;
+int verify_count = 0, verify_size = 0;
 
 int lookup_type[] = {
 	0,
@@ -930,6 +937,65 @@ failure:
 }
 
 
+/*
+ * Copy an uncompressed data block directly from the filesystem to the
+ * output file.  Where possible use copy_file_range(), which avoids copying
+ * the data through user space, and on filesystems supporting reflinks (e.g.
+ * XFS and btrfs) may share the extent rather than copying it.  If
+ * copy_file_range() isn't supported (or fails) fall back to reading
+ * and writing the data.
+ */
+int copy_block(int file_fd, long long start, int size)
+{
+	static char *buffer = NULL;
+
+#ifdef __linux__
+	/*
+	 * Only the writer thread calls this, and so this is its own state.
+	 * copy_range is the -no-copy-range option, and is only read once the
+	 * threads are running
+	 */
+	static int supported = TRUE;
+	loff_t off = start_offset + start;
+
+	while(copy_range && supported && size) {
+		ssize_t res = copy_file_range(fd, &off, file_fd, NULL, size, 0);
+
+		if(res == -1 && errno == EINTR)
+			continue;
+
+		if(res < 1) {
+			/*
+			 * Not supported between these filesystems (or an
+			 * error), don't try again, and fall back to reading
+			 * and writing the remainder
+			 */
+			supported = FALSE;
+			break;
+		}
+
+		size -= res;
+	}
+
+	start = off - start_offset;
+#endif
+
+	if(size == 0)
+		return TRUE;
+
+	if(buffer == NULL) {
+		buffer = malloc(block_size);
+		if(buffer == NULL)
+			MEM_ERROR();
+	}
+
+	if(read_fs_bytes(fd, start, size, buffer) == FALSE)
+		return FALSE;
+
+	return write_bytes(file_fd, buffer, size) != -1;
+}
+
+
 pthread_mutex_t open_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t open_empty = PTHREAD_COND_INITIALIZER;
 int open_unlimited, open_count;
@@ -970,7 +1036,7 @@ void close_wake(int fd)
 }
 
 
-void queue_file(char *pathname, int file_fd, struct inode *inode)
+void queue_file(char *pathname, int file_fd, struct inode *inode, int blocks)
 {
 	struct squashfs_file *file = malloc(sizeof(struct squashfs_file));
 	if(file == NULL)
@@ -983,9 +1049,10 @@ void queue_file(char *pathname, int file_fd, struct inode *inode)
 	file->uid = inode->uid;
 	file->time = inode->time;
 	file->pathname = strdup(pathname);
-	file->blocks = inode->blocks + (inode->frag_bytes > 0);
+	file->blocks = blocks;
 	file->sparse = inode->sparse;
 	file->xattr = inode->xattr;
+	file->header = NULL;
 	queue_put(to_writer, file);
 }
 
@@ -1003,6 +1070,7 @@ void queue_dir(char *pathname, struct dir *dir)
 	file->time = dir->mtime;
 	file->pathname = strdup(pathname);
 	file->xattr = dir->xattr;
+	file->header = NULL;
 	queue_put(to_writer, file);
 }
 
@@ -1038,7 +1106,8 @@ int write_file(struct inode *inode, char *pathname)
  	 * file.  If the file has one or more blocks or a fragment they are
  	 * queued separately (references to blocks in the cache).
  	 */
-	queue_file(pathname, file_fd, inode);
+	queue_file(pathname, file_fd, inode, inode->blocks +
+		(inode->frag_bytes > 0));
 
 	for(i = 0; i < inode->blocks; i++) {
 		int c_byte = SQUASHFS_COMPRESSED_SIZE_BLOCK(block_list[i]);
@@ -1048,11 +1117,23 @@ int write_file(struct inode *inode, char *pathname)
 			MEM_ERROR();
 
 		block->offset = 0;
+		block->start = 0;
+		block->copy = FALSE;
 		block->size = i == file_end ? inode->data & (block_size - 1) :
 			block_size;
 		if(block_list[i] == 0) /* sparse block */
 			block->buffer = NULL;
-		else {
+		else if(copy_range && !SQUASHFS_COMPRESSED_BLOCK(block_list[i])
+						&& c_byte == block->size) {
+			/*
+			 * uncompressed block, the writer thread copies it
+			 * directly from the filesystem, bypassing the cache
+			 */
+			block->buffer = NULL;
+			block->start = start;
+			block->copy = TRUE;
+			start += c_byte;
+		} else {
 			block->buffer = cache_get(data_cache, start,
 				block_list[i]);
 			start += c_byte;
@@ -1070,6 +1151,8 @@ int write_file(struct inode *inode, char *pathname)
 
 		s_ops->read_fragment(inode->fragment, &start, &size);
 		block->buffer = cache_get(fragment_cache, start, size);
+		block->start = 0;
+		block->copy = FALSE;
 		block->offset = inode->offset;
 		block->size = inode->frag_bytes;
 		queue_put(to_writer, block);
@@ -1082,20 +1165,46 @@ int write_file(struct inode *inode, char *pathname)
 
 int cat_file(struct inode *inode, char *pathname)
 {
-	unsigned int i;
+	unsigned int i, first, last;
 	unsigned int *block_list = NULL;
-	int file_end = inode->data / block_size;
 	long long start = inode->start;
+	long long frag_start = (long long) inode->blocks * block_size;
+	long long range_start, range_end;
+	int fragment;
 
 	TRACE("cat_file: regular file, blocks %d\n", inode->blocks);
 
-	if(inode->blocks) {
-		block_list = malloc(inode->blocks * sizeof(unsigned int));
+	/*
+	 * Work out the byte range of the file to output (by default the
+	 * entire file), and from that the data blocks and fragment
+	 * covering it.  Only those are read and decompressed
+	 */
+	range_start = cat_offset > inode->data ? inode->data : cat_offset;
+	if(cat_length != -1 && cat_length < inode->data - range_start)
+		range_end = range_start + cat_length;
+	else
+		range_end = inode->data;
+
+	if(range_start == range_end)
+		first = last = 0;
+	else {
+		first = range_start / block_size;
+		last = (range_end + block_size - 1) / block_size;
+		if(last > inode->blocks)
+			last = inode->blocks;
+		if(first > last)
+			first = last;
+	}
+
+	fragment = inode->frag_bytes && range_end > frag_start;
+
+	if(last) {
+		block_list = malloc(last * sizeof(unsigned int));
 		if(block_list == NULL)
 			MEM_ERROR();
 
 		s_ops->read_block_list(block_list, inode->block_start,
-					inode->block_offset, inode->blocks);
+					inode->block_offset, last);
 	}
 
 	/*
@@ -1103,18 +1212,29 @@ int cat_file(struct inode *inode, char *pathname)
 	 * file.  If the file has one or more blocks or a fragment they are
 	 * queued separately (references to blocks in the cache).
 	 */
-	queue_file(pathname, 0, inode);
+	queue_file(pathname, 0, inode, last - first + fragment);
 
-	for(i = 0; i < inode->blocks; i++) {
+	for(i = 0; i < first; i++)
+		start += SQUASHFS_COMPRESSED_SIZE_BLOCK(block_list[i]);
+
+	for(i = first; i < last; i++) {
 		int c_byte = SQUASHFS_COMPRESSED_SIZE_BLOCK(block_list[i]);
+		long long block_start = (long long) i * block_size;
+		long long block_end = block_start + block_size;
 		struct file_entry *block = malloc(sizeof(struct file_entry));
 
 		if(block == NULL)
 			MEM_ERROR();
 
-		block->offset = 0;
-		block->size = i == file_end ? inode->data & (block_size - 1) :
-			block_size;
+		if(block_start < range_start)
+			block_start = range_start;
+		if(block_end > range_end)
+			block_end = range_end;
+
+		block->offset = block_start - (long long) i * block_size;
+		block->start = 0;
+		block->copy = FALSE;
+		block->size = block_end - block_start;
 		if(block_list[i] == 0) /* sparse block */
 			block->buffer = NULL;
 		else {
@@ -1125,9 +1245,11 @@ int cat_file(struct inode *inode, char *pathname)
 		queue_put(to_writer, block);
 	}
 
-	if(inode->frag_bytes) {
+	if(fragment) {
 		int size;
 		long long start;
+		long long frag_offset = range_start > frag_start ?
+			range_start - frag_start : 0;
 		struct file_entry *block = malloc(sizeof(struct file_entry));
 
 		if(block == NULL)
@@ -1135,8 +1257,10 @@ int cat_file(struct inode *inode, char *pathname)
 
 		s_ops->read_fragment(inode->fragment, &start, &size);
 		block->buffer = cache_get(fragment_cache, start, size);
-		block->offset = inode->offset;
-		block->size = inode->frag_bytes;
+		block->start = 0;
+		block->copy = FALSE;
+		block->offset = inode->offset + frag_offset;
+		block->size = range_end - frag_start - frag_offset;
 		queue_put(to_writer, block);
 	}
 
@@ -1396,6 +1520,11 @@ void free_path(struct pathname *paths)
 		}
 	}
 
+	if(paths->lookup)
+		match_index_free(paths->lookup);
+	if(paths->index)
+		match_index_free(paths->index);
+	free(paths->name);
 	free(paths);
 }
 
@@ -1427,11 +1556,15 @@ struct pathname *add_path(struct pathname *paths, int type, char *target,
 
 		paths->names = 0;
 		paths->name = NULL;
+		paths->index = NULL;
+		paths->lookup = match_index_create(0);
+		if(paths->lookup == NULL)
+			MEM_ERROR();
 	}
 
-	for(i = 0; i < paths->names; i++)
-		if(strcmp(paths->name[i].name, targname) == 0)
-			break;
+	i = match_index_lookup(paths->lookup, targname);
+	if(i == -1)
+		i = paths->names;
 
 	if(i == paths->names) {
 		/*
@@ -1444,6 +1577,14 @@ struct pathname *add_path(struct pathname *paths, int type, char *target,
 			MEM_ERROR();
 
 		paths->name[i].name = targname;
+		if(!match_index_add(paths->lookup, targname, i, MATCH_LITERAL))
+			MEM_ERROR();
+
+		/* rebuilt the next time the names are matched */
+		if(paths->index) {
+			match_index_free(paths->index);
+			paths->index = NULL;
+		}
 		paths->name[i].paths = NULL;
 		if(use_regex) {
 			paths->name[i].preg = malloc(sizeof(regex_t));
@@ -1562,145 +1703,123 @@ void free_subdir(struct pathnames *paths)
 }
 
 
-int extract_matches(struct pathnames *paths, char *name, struct pathnames **new)
+static void index_path(struct pathname *path)
 {
-	int i, n;
-
-	/* nothing to match, extract */
-	if(paths == NULL) {
-		*new = NULL;
-		return TRUE;
-	}
+	int i, type = no_wildcards ? MATCH_LITERAL : use_regex ? MATCH_REGEX :
+								MATCH_WILDCARD;
 
-	*new = init_subdir();
-
-	for(n = 0; n < paths->count; n++) {
-		struct pathname *path = paths->path[n];
-		for(i = 0; i < path->names; i++) {
-			int match;
+	path->index = match_index_create(path->names);
+	if(path->index == NULL)
+		MEM_ERROR();
 
-			if(no_wildcards)
-				match = strcmp(path->name[i].name, name) == 0;
-			else if(use_regex)
-				match = regexec(path->name[i].preg, name,
-					(size_t) 0, NULL, 0) == 0;
-			else
-				match = fnmatch(path->name[i].name,
-					name, FNM_PATHNAME|FNM_PERIOD|
-					FNM_EXTMATCH) == 0;
+	for(i = 0; i < path->names; i++)
+		if(!match_index_add(path->index, path->name[i].name, i, type))
+			MEM_ERROR();
+}
 
-			if(match && path->name[i].type == PATH_TYPE_EXTRACT)
-				/*
-				 * match on a leaf component, any subdirectories
-				 * will implicitly match, therefore return an
-				 * empty new search set
-				 */
-				goto empty_set;
 
-			if(match)
-				/*
-				 * match on a non-leaf component, add any
-				 * subdirectories to the new set of
-				 * subdirectories to scan for this name
-				 */
-				*new = add_subdir(*new, path->name[i].paths);
-		}
-	}
-
-	if((*new)->count == 0) {
+static int match_entry(struct path_entry *entry, int type,
+	struct pathnames **new)
+{
+	if(entry->type == type)
 		/*
-		 * no matching names found, delete empty search set, and return
-		 * FALSE
+		 * match on a leaf component, any subdirectories
+		 * will implicitly match
 		 */
-		free_subdir(*new);
-		*new = NULL;
-		return FALSE;
-	}
-
-	/*
-	 * one or more matches with sub-directories found (no leaf matches),
-	 * return new search set and return TRUE
-	 */
-	return TRUE;
+		return TRUE;
 
-empty_set:
 	/*
-	 * found matching leaf extract, return empty search set and return TRUE
+	 * match on a non-leaf component, add any
+	 * subdirectories to the new set of
+	 * subdirectories to scan for this name
 	 */
-	free_subdir(*new);
-	*new = NULL;
-	return TRUE;
+	if(*new == NULL)
+		*new = init_subdir();
+	*new = add_subdir(*new, entry->paths);
+	return FALSE;
 }
 
 
-int exclude_matches(struct pathnames *paths, char *name, struct pathnames **new)
+/*
+ * Match name against the search set paths.  Returns TRUE if it matches a
+ * leaf component of type, otherwise *new is set to the new search set of
+ * the matching non-leaf components, or NULL if nothing matched
+ */
+static int name_matches(struct pathnames *paths, char *name, int type,
+	struct pathnames **new)
 {
 	int i, n;
 
-	/* nothing to match, don't exclude */
-	if(paths == NULL) {
-		*new = NULL;
-		return FALSE;
-	}
-
-	*new = init_subdir();
+	*new = NULL;
 
 	for(n = 0; n < paths->count; n++) {
 		struct pathname *path = paths->path[n];
-		for(i = 0; i < path->names; i++) {
+
+		if(path->index == NULL)
+			index_path(path);
+
+		/* any literal name is found with one lookup */
+		i = match_index_lookup(path->index, name);
+		if(i != -1 && match_entry(&path->name[i], type, new))
+			goto leaf;
+
+		for(i = 0; i < path->index->wilds; i++) {
+			struct path_entry *entry =
+				&path->name[path->index->wild[i]];
 			int match;
 
-			if(no_wildcards)
-				match = strcmp(path->name[i].name, name) == 0;
-			else if(use_regex)
-				match = regexec(path->name[i].preg, name,
+			if(use_regex)
+				match = regexec(entry->preg, name,
 					(size_t) 0, NULL, 0) == 0;
 			else
-				match = fnmatch(path->name[i].name,
+				match = fnmatch(entry->name,
 					name, FNM_PATHNAME|FNM_PERIOD|
 					FNM_EXTMATCH) == 0;
 
-			if(match && path->name[i].type == PATH_TYPE_EXCLUDE)
-				/*
-				 * match on a leaf component, any subdirectories
-				 * will implicitly match, therefore return an
-				 * empty new search set
-				 */
-				goto empty_set;
-
-			if(match)
-				/*
-				 * match on a non-leaf component, add any
-				 * subdirectories to the new set of
-				 * subdirectories to scan for this name
-				 */
-				*new = add_subdir(*new, path->name[i].paths);
+			if(match && match_entry(entry, type, new))
+				goto leaf;
 		}
 	}
 
-	if((*new)->count == 0) {
-		/*
-		 * no matching names found, don't exclude.  Delete empty search
-		 * set, and return FALSE
-		 */
-		free_subdir(*new);
+	return FALSE;
+
+leaf:
+	free_subdir(*new);
+	*new = NULL;
+	return TRUE;
+}
+
+
+int extract_matches(struct pathnames *paths, char *name, struct pathnames **new)
+{
+	/* nothing to match, extract */
+	if(paths == NULL) {
 		*new = NULL;
-		return FALSE;
+		return TRUE;
 	}
 
 	/*
-	 * one or more matches with sub-directories found (no leaf matches),
-	 * return new search set and return FALSE
+	 * Extract if name matches a leaf extract, in which case any
+	 * subdirectories will implicitly match, and the new search set is
+	 * empty, or if it matches one or more non-leaf components
 	 */
-	return FALSE;
+	return name_matches(paths, name, PATH_TYPE_EXTRACT, new) || *new;
+}
+
+
+int exclude_matches(struct pathnames *paths, char *name, struct pathnames **new)
+{
+	/* nothing to match, don't exclude */
+	if(paths == NULL) {
+		*new = NULL;
+		return FALSE;
+	}
 
-empty_set:
 	/*
-	 * found matching leaf exclude, delete search set and return TRUE
+	 * Only exclude if name matches a leaf exclude.  Matches with
+	 * sub-directories return the new search set, and don't exclude
 	 */
-	free_subdir(*new);
-	*new = NULL;
-	return TRUE;
+	return name_matches(paths, name, PATH_TYPE_EXCLUDE, new);
 }
 
 
@@ -2446,6 +2565,31 @@ void *writer(void *arg)
 		for(i = 0; i < file->blocks; i++, cur_blocks ++) {
 			struct file_entry *block = queue_get(to_writer);
 
+			if(block->copy) {
+				/* uncompressed block, copy from filesystem */
+				if(local_fail == FALSE) {
+					res = write_block(file_fd, NULL, 0,
+						hole, file->sparse);
+
+					if(res)
+						res = copy_block(file_fd,
+							block->start,
+							block->size);
+
+					if(res == FALSE) {
+						EXIT_UNSQUASH_IGNORE("writer: "
+							"failed to copy file "
+							"%s\n",
+							file->pathname);
+						exit_code = local_fail = TRUE;
+					}
+				}
+
+				hole = 0;
+				free(block);
+				continue;
+			}
+
 			if(block->buffer == 0) { /* sparse file */
 				hole += block->size;
 				free(block);
@@ -2599,6 +2743,43 @@ void *cat_writer(void *arg)
 }
 
 
+/*
+ * verify writer thread.  This waits for the blocks queued by
+ * verify_filesystem() to be read and decompressed, and reports the
+ * files referencing any which are corrupt.  Nothing is written.
+ */
+void *verify_writer(void *arg)
+{
+	long exit_code = FALSE;
+
+	while(1) {
+		struct verify_entry *entry = queue_get(to_writer);
+		int i;
+
+		if(entry == NULL) {
+			queue_put(from_writer, (void *) exit_code);
+			continue;
+		}
+
+		cache_block_wait(entry->buffer);
+
+		if(entry->buffer->error) {
+			ERROR("verify: %s block @0x%llx, size %d, is corrupt."
+				"  Referenced by:\n", entry->block->fragment ?
+				"fragment" : "data", entry->block->start,
+				SQUASHFS_COMPRESSED_SIZE_BLOCK(entry->block->size));
+			for(i = 0; i < entry->count; i++)
+				ERROR("\t%s\n", entry->block[i].pathname);
+			exit_code = TRUE;
+		}
+
+		cache_block_put(entry->buffer);
+		free(entry);
+		cur_blocks ++;
+	}
+}
+
+
 /*
  * decompress thread.  This decompresses buffers queued by the read thread
  */
@@ -2851,6 +3032,10 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size, int cat_
 		init_info();
 	} else if(cat_files)
 		pthread_create(&thread[1], NULL, cat_writer, NULL);
+	else if(tar_output)
+		pthread_create(&thread[1], NULL, tar_writer, NULL);
+	else if(verify)
+		pthread_create(&thread[1], NULL, verify_writer, NULL);
 	else {
 		pthread_create(&thread[1], NULL, writer, NULL);
 		init_info();
@@ -3723,6 +3908,211 @@ failed:
 }
 
 
+void add_verify_block(long long start, unsigned int size, int fragment,
+	char *pathname)
+{
+	if(verify_count == verify_size) {
+		verify_size = verify_size ? verify_size * 2 : 1024;
+		verify_blocks = realloc(verify_blocks, verify_size *
+						sizeof(struct verify_block));
+		if(verify_blocks == NULL)
+			MEM_ERROR();
+	}
+
+	verify_blocks[verify_count].start = start;
+	verify_blocks[verify_count].size = size;
+	verify_blocks[verify_count].fragment = fragment;
+	verify_blocks[verify_count ++].pathname = pathname;
+}
+
+
+/*
+ * Walk the filesystem reading every directory and inode, and recording
+ * the data blocks and fragment referenced by each regular file
+ */
+int verify_scan(char *parent_name, unsigned int start_block,
+	unsigned int offset)
+{
+	unsigned int type;
+	int scan_res = TRUE;
+	char *name;
+	struct inode *i;
+	struct dir *dir = s_ops->opendir(start_block, offset, &i);
+
+	if(dir == NULL) {
+		ERROR("verify: failed to read directory %s\n", parent_name);
+		return FALSE;
+	}
+
+	while(squashfs_readdir(dir, &name, &start_block, &offset, &type)) {
+		char *pathname;
+		int res;
+
+		res = asprintf(&pathname, "%s/%s", parent_name, name);
+		if(res == -1)
+			MEM_ERROR();
+
+		total_inodes ++;
+
+		if(type == SQUASHFS_DIR_TYPE) {
+			res = verify_scan(pathname, start_block, offset);
+			if(res == FALSE)
+				scan_res = FALSE;
+			free(pathname);
+			continue;
+		}
+
+		i = s_ops->read_inode(start_block, offset);
+
+		if(i->type == SQUASHFS_SYMLINK_TYPE ||
+				i->type == SQUASHFS_LSYMLINK_TYPE)
+			free(i->symlink);
+
+		if(type != SQUASHFS_FILE_TYPE ||
+				created_inode[i->inode_number - 1]) {
+			/* no data, or a hard link to an already seen file */
+			free(pathname);
+			continue;
+		}
+
+		/* pathname is referenced by the verify blocks */
+		created_inode[i->inode_number - 1] = pathname;
+		file_count ++;
+
+		if(i->blocks) {
+			unsigned int *block_list;
+			long long start = i->start;
+			int n;
+
+			block_list = malloc(i->blocks * sizeof(unsigned int));
+			if(block_list == NULL)
+				MEM_ERROR();
+
+			s_ops->read_block_list(block_list, i->block_start,
+				i->block_offset, i->blocks);
+
+			for(n = 0; n < i->blocks; n++) {
+				if(block_list[n] == 0) /* sparse block */
+					continue;
+
+				add_verify_block(start, block_list[n], FALSE,
+					pathname);
+				start += SQUASHFS_COMPRESSED_SIZE_BLOCK(
+								block_list[n]);
+			}
+
+			free(block_list);
+		}
+
+		if(i->frag_bytes) {
+			long long start;
+			int size;
+
+			s_ops->read_fragment(i->fragment, &start, &size);
+			add_verify_block(start, size, TRUE, pathname);
+		}
+	}
+
+	squashfs_closedir(dir);
+	dir_count ++;
+
+	return scan_res;
+}
+
+
+int compare_verify_block(const void *a, const void *b)
+{
+	const struct verify_block *va = a, *vb = b;
+
+	return va->start < vb->start ? -1 : va->start > vb->start;
+}
+
+
+/*
+ * Verify the filesystem, by reading all the metadata and then reading and
+ * decompressing every referenced data block and fragment block once, in
+ * on disk order, using the reader and inflator threads
+ */
+int verify_filesystem()
+{
+	int i, j, res, exit_code = 0;
+	long long bytes = 0;
+	struct timeval start, end;
+	double seconds;
+
+	res = verify_scan("", SQUASHFS_INODE_BLK(sBlk.s.root_inode),
+		SQUASHFS_INODE_OFFSET(sBlk.s.root_inode));
+	if(res == FALSE)
+		exit_code = 2;
+
+	qsort(verify_blocks, verify_count, sizeof(struct verify_block),
+		compare_verify_block);
+
+	for(i = 0; i < verify_count; i = j) {
+		for(j = i + 1; j < verify_count && verify_blocks[j].start ==
+					verify_blocks[i].start; j++);
+		total_blocks ++;
+		bytes += SQUASHFS_COMPRESSED_SIZE_BLOCK(verify_blocks[i].size);
+	}
+
+	if(!quiet) {
+		printf("Parallel unsquashfs: Using %d processor%s\n",
+			processors, processors == 1 ? "" : "s");
+		printf("%u inodes, %lld blocks (%.2f Mbytes) to verify\n\n",
+			total_inodes + 1, total_blocks, bytes / 1048576.0);
+	}
+
+	/* the progress bar only tracks the blocks being verified */
+	total_files = total_inodes;
+
+	gettimeofday(&start, NULL);
+	enable_progress_bar();
+
+	for(i = 0; i < verify_count; i = j) {
+		struct verify_entry *entry = malloc(sizeof(struct verify_entry));
+
+		if(entry == NULL)
+			MEM_ERROR();
+
+		for(j = i + 1; j < verify_count && verify_blocks[j].start ==
+					verify_blocks[i].start; j++);
+
+		entry->block = &verify_blocks[i];
+		entry->count = j - i;
+		entry->buffer = cache_get(verify_blocks[i].fragment ?
+			fragment_cache : data_cache, verify_blocks[i].start,
+			verify_blocks[i].size);
+		queue_put(to_writer, entry);
+	}
+
+	queue_put(to_writer, NULL);
+	res = (long) queue_get(from_writer);
+	if(res == TRUE)
+		exit_code = 2;
+
+	disable_progress_bar();
+	gettimeofday(&end, NULL);
+
+	seconds = (end.tv_sec - start.tv_sec) +
+				(end.tv_usec - start.tv_usec) / 1000000.0;
+
+	if(!quiet) {
+		printf("\n");
+		printf("verified %d %s\n", file_count, file_count == 1 ? "file" : "files");
+		printf("verified %d %s\n", dir_count, dir_count == 1 ? "directory" : "directories");
+		printf("verified %lld %s (%.2f Mbytes) in %.2f seconds, %.2f "
+			"Mbytes/s\n", total_blocks, total_blocks == 1 ? "block"
+			: "blocks", bytes / 1048576.0, seconds, seconds ?
+			bytes / (1048576.0 * seconds) : 0);
+
+		if(exit_code)
+			printf("Filesystem is corrupt\n");
+	}
+
+	return set_exit_code ? exit_code : 0;
+}
+
+
 int parse_excludes(int argc, char *argv[], struct pathname **exclude)
 {
 	int i;
@@ -3749,6 +4139,12 @@ static void print_cat_options(FILE *stream, char *name)
 	fprintf(stream, "Optionally a\n\t\t\t\tsuffix of K, M or G can be given to ");
 	fprintf(stream, "specify\n\t\t\t\tKbytes, Mbytes or Gbytes respectively ");
 	fprintf(stream, "(default\n\t\t\t\t0 bytes).\n");
+	fprintf(stream, "\t-file-offset <bytes>\tstart output <bytes> into ");
+	fprintf(stream, "each file.  Optionally\n\t\t\t\ta suffix of K, M or G ");
+	fprintf(stream, "can be given (default\n\t\t\t\t0 bytes)\n");
+	fprintf(stream, "\t-file-length <bytes>\toutput at most <bytes> of each ");
+	fprintf(stream, "file.  Optionally\n\t\t\t\ta suffix of K, M or G can ");
+	fprintf(stream, "be given (default\n\t\t\t\tto end of file)\n");
 	fprintf(stream, "\t-ig[nore-errors]\ttreat errors writing files to output ");
 	fprintf(stream, "as\n\t\t\t\tnon-fatal\n");
 	fprintf(stream, "\t-st[rict-errors]\ttreat all errors as fatal\n");
@@ -3777,6 +4173,15 @@ static void print_options(FILE *stream, char *name)
 	fprintf(stream, "\t-v[ersion]\t\tprint version, licence and copyright ");
 	fprintf(stream, "information\n");
 	fprintf(stream, "\t-cat\t\t\tcat the listed files to stdout\n");
+	fprintf(stream, "\t-verify\t\t\tcheck the filesystem by reading and ");
+	fprintf(stream, "decompressing\n\t\t\t\tevery data and fragment block, ");
+	fprintf(stream, "without writing\n\t\t\t\tanything.  Metadata is only ");
+	fprintf(stream, "checked as far as\n\t\t\t\tit is read to walk the ");
+	fprintf(stream, "filesystem, and xattrs\n\t\t\t\tnot at all with ");
+	fprintf(stream, "-no-xattrs\n");
+	fprintf(stream, "\t-tar\t\t\toutput the filesystem (or the files to ");
+	fprintf(stream, "extract) to\n\t\t\t\tstdout as a POSIX (PAX) tar ");
+	fprintf(stream, "archive\n");
 	fprintf(stream, "\t-d[est] <pathname>\tunsquash to <pathname>, default ");
 	fprintf(stream, "\"squashfs-root\"\n");
 	fprintf(stream, "\t-max[-depth] <levels>\tdescend at most <levels> of ");
@@ -3816,6 +4221,9 @@ static void print_options(FILE *stream, char *name)
 	fprintf(stream, "specify\n\t\t\t\tKbytes, Mbytes or Gbytes respectively ");
 	fprintf(stream, "(default\n\t\t\t\t0 bytes).\n");
 	fprintf(stream, "\t-f[orce]\t\tif file already exists then overwrite\n");
+	fprintf(stream, "\t-no-copy-range\t\tdon't use copy_file_range() to copy ");
+	fprintf(stream, "uncompressed\n\t\t\t\tblocks, always read and write ");
+	fprintf(stream, "them\n");
 	fprintf(stream, "\t-ig[nore-errors]\ttreat errors writing files to output ");
 	fprintf(stream, "as\n\t\t\t\tnon-fatal\n");
 	fprintf(stream, "\t-st[rict-errors]\ttreat all errors as fatal\n");
@@ -3977,6 +4385,22 @@ int parse_cat_options(int argc, char *argv[])
 							argv[0], argv[i - 1]);
 				exit(1);
 			}
+		} else if(strcmp(argv[i], "-file-offset") == 0) {
+			if((++i == argc) ||
+					!parse_numberll(argv[i], &cat_offset,
+									1)) {
+				ERROR("%s: -file-offset missing or invalid "
+					"offset\n", argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-file-length") == 0) {
+			if((++i == argc) ||
+					!parse_numberll(argv[i], &cat_length,
+									1)) {
+				ERROR("%s: -file-length missing or invalid "
+					"length\n", argv[0]);
+				exit(1);
+			}
 		} else {
 			print_cat_options(stderr, argv[0]);
 			exit(1);
@@ -4024,6 +4448,10 @@ int parse_options(int argc, char *argv[])
 			pseudo_file = TRUE;
 		} else if(strcmp(argv[i], "-cat") == 0)
 			cat_files = TRUE;
+		else if(strcmp(argv[i], "-verify") == 0)
+			verify = TRUE;
+		else if(strcmp(argv[i], "-tar") == 0)
+			tar_output = TRUE;
 		else if(strcmp(argv[i], "-excludes") == 0)
 			treat_as_excludes = TRUE;
 		else if(strcmp(argv[i], "-exclude-list") == 0 ||
@@ -4160,6 +4588,8 @@ int parse_options(int argc, char *argv[])
 		} else if(strcmp(argv[i], "-force") == 0 ||
 				strcmp(argv[i], "-f") == 0)
 			force = TRUE;
+		else if(strcmp(argv[i], "-no-copy-range") == 0)
+			copy_range = FALSE;
 		else if(strcmp(argv[i], "-stat") == 0 ||
 				strcmp(argv[i], "-s") == 0)
 			stat_sys = TRUE;
@@ -4236,6 +4666,21 @@ int parse_options(int argc, char *argv[])
 		EXIT_UNSQUASH("Both -no-wildcards and -regex should not be "
 								"set\n");
 
+	if(verify && lsonly)
+		EXIT_UNSQUASH("-verify and the listing options (-ls, -lls, -lc "
+			"etc.) should not be set together\n");
+
+	if(verify && (cat_files || tar_output || pseudo_file))
+		EXIT_UNSQUASH("-verify should not be set with -cat, -tar or "
+			"-pf\n");
+
+	if(tar_output && lsonly)
+		EXIT_UNSQUASH("-tar and the listing options (-ls, -lls, -lc "
+			"etc.) should not be set together\n");
+
+	if(tar_output && (cat_files || pseudo_file))
+		EXIT_UNSQUASH("-tar should not be set with -cat or -pf\n");
+
 	if(missing_symlinks && !follow_symlinks) {
 		follow_symlinks = TRUE;
 		no_wildcards = TRUE;
@@ -4256,6 +4701,10 @@ int parse_options(int argc, char *argv[])
 		exit(1);
 	}
 
+	if(verify && (i + 1 < argc || extract || exclude))
+		EXIT_UNSQUASH("-verify checks the whole filesystem, files to "
+			"extract or exclude should not be given\n");
+
 	return i;
 }
 
@@ -4381,6 +4830,12 @@ int main(int argc, char *argv[])
 	if(pseudo_file)
 		return generate_pseudo(pseudo_name);
 
+	if(tar_output)
+		return generate_tar();
+
+	if(verify)
+		return verify_filesystem();
+
 	if(!quiet || progress) {
 		res = pre_scan(dest, SQUASHFS_INODE_BLK(sBlk.s.root_inode),
 			SQUASHFS_INODE_OFFSET(sBlk.s.root_inode), extracts,
@@ -185,7 +185,10 @@ struct dir {
 struct file_entry {
 	int		offset;
 	int		size;
+	/* copy the block directly from the filesystem at start */
+	int		copy;
 	struct cache_entry *buffer;
+	long long	start;
 };
 
 
@@ -200,6 +203,21 @@ struct squashfs_file {
 	char		*pathname;
 	char		sparse;
 	unsigned int	xattr;
+	char		*header;
+	int		header_size;
+};
+
+struct verify_block {
+	long long	start;
+	unsigned int	size;
+	int		fragment;
+	char		*pathname;
+};
+
+struct verify_entry {
+	struct verify_block	*block;
+	int			count;
+	struct cache_entry	*buffer;
 };
 
 struct path_entry {
@@ -212,6 +230,10 @@ struct path_entry {
 struct pathname {
 	int			names;
 	struct path_entry	*name;
+	/* the names, to find duplicates when adding */
+	struct match_index	*lookup;
+	/* built the first time the names are matched */
+	struct match_index	*index;
 };
 
 struct pathnames {
@@ -271,6 +293,18 @@ extern void enable_progress_bar();
 extern void disable_progress_bar();
 extern void dump_queue(struct queue *);
 extern void dump_cache(struct cache *);
+extern void queue_put(struct queue *, void *);
+extern void *queue_get(struct queue *);
+extern void cache_block_wait(struct cache_entry *);
+extern void cache_block_put(struct cache_entry *);
+extern int write_bytes(int, char *, int);
+extern int write_block(int, char *, int, long long, int);
+extern int cat_file(struct inode *, char *);
+extern int squashfs_readdir(struct dir *, char **, unsigned int *,
+	unsigned int *, unsigned int *);
+extern int extract_matches(struct pathnames *, char *, struct pathnames **);
+extern int exclude_matches(struct pathnames *, char *, struct pathnames **);
+extern void free_subdir(struct pathnames *);
 
 /* unsquash-1.c */
 int read_super_1(squashfs_operations **, void *);
@@ -297,4 +331,8 @@ extern int check_directory(struct dir *);
 
 /* unsquash-12.c */
 extern void sort_directory(struct dir *);
+
+/* unsquashfs_tar.c */
+extern void *tar_writer(void *);
+extern int generate_tar();
 #endif
@@ -0,0 +1,625 @@
+/*
+ * Unsquash a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2026
+ * agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * unsquashfs_tar.c
+ *
+ * Output the filesystem (or the files selected for extraction) to stdout
+ * as a POSIX (PAX) tar archive.  Nothing is written to disk, file data
+ * is read and decompressed by the reader and inflator threads as usual,
+ * and the tar writer thread writes it out behind the tar headers
+ * generated here.
+ */
+
+#include "unsquashfs.h"
+#include "xattr.h"
+#include "tar.h"
+
+#define TAR_BLOCK_SIZE		512
+#define TAR_ROUND(a)		(((a) + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1))
+
+extern struct squashfs_operations *s_ops;
+extern char **created_inode;
+extern int writer_fd;
+extern int max_depth;
+extern int user_xattrs;
+extern int ignore_errors;
+extern int set_exit_code;
+extern struct queue *from_writer;
+extern struct pathnames *extracts, *excludes;
+extern long long cur_blocks;
+extern unsigned int block_size;
+
+struct pax {
+	char	*data;
+	int	size;
+	int	bytes;
+};
+
+struct sparse_map {
+	long long	offset;
+	long long	number;
+};
+
+
+/*
+ * Add a "<length> <keyword>=<value>\n" record to the PAX extended header.
+ * The length includes the digits of the length itself
+ */
+static void pax_record(struct pax *pax, char *keyword, void *value, int vsize)
+{
+	int len = strlen(keyword) + vsize + 3, total, res;
+
+	for(total = len + 1; total != len + snprintf(NULL, 0, "%d", total);
+			total = len + snprintf(NULL, 0, "%d", total));
+
+	if(pax->bytes + total + 1 > pax->size) {
+		pax->size = pax->bytes + total + 1 + TAR_BLOCK_SIZE;
+		pax->data = realloc(pax->data, pax->size);
+		if(pax->data == NULL)
+			MEM_ERROR();
+	}
+
+	res = sprintf(pax->data + pax->bytes, "%d %s=", total, keyword);
+	memcpy(pax->data + pax->bytes + res, value, vsize);
+	pax->data[pax->bytes + total - 1] = '\n';
+	pax->bytes += total;
+}
+
+
+static void pax_number(struct pax *pax, char *keyword, long long value)
+{
+	char buffer[24];
+	int res = sprintf(buffer, "%lld", value);
+
+	pax_record(pax, keyword, buffer, res);
+}
+
+
+/*
+ * Store <value> in a tar header octal field of <size> bytes, returning
+ * FALSE if it doesn't fit (in which case it is stored in the PAX header)
+ */
+static int octal(char *field, int size, long long value)
+{
+	if(value < 0 || value >> (3 * (size - 1)))
+		return FALSE;
+
+	sprintf(field, "%0*llo", size - 1, value);
+	return TRUE;
+}
+
+
+/* Copy a string to a tar header field, it isn't NUL terminated if it fills it */
+static void string(char *field, int size, char *str)
+{
+	int len = strlen(str);
+
+	memcpy(field, str, len > size ? size : len);
+}
+
+
+static void checksum(struct tar_header *header)
+{
+	unsigned int i, sum = 0;
+
+	memset(header->checksum, ' ', sizeof(header->checksum));
+
+	for(i = 0; i < TAR_BLOCK_SIZE; i++)
+		sum += header->udata[i];
+
+	sprintf(header->checksum, "%06o", sum);
+}
+
+
+static void header_block(struct tar_header *header, char *name, int mode,
+	uid_t uid, gid_t gid, long long size, time_t mtime, char type)
+{
+	memset(header, 0, sizeof(struct tar_header));
+
+	string(header->name, sizeof(header->name), name);
+	octal(header->mode, sizeof(header->mode), mode & 07777);
+	octal(header->uid, sizeof(header->uid), uid);
+	octal(header->gid, sizeof(header->gid), gid);
+	octal(header->size, sizeof(header->size), size);
+	octal(header->mtime, sizeof(header->mtime), mtime);
+	header->type = type;
+	memcpy(header->magic, USTAR_MAGIC, sizeof(header->magic));
+}
+
+
+#ifdef XATTR_SUPPORT
+static int pax_xattrs(struct pax *pax, char *pathname, unsigned int xattr)
+{
+	struct xattr_list *xattr_list;
+	unsigned int count;
+	int i, failed;
+
+	if(no_xattrs || xattr == SQUASHFS_INVALID_XATTR ||
+			sBlk.s.xattr_id_table_start == SQUASHFS_INVALID_BLK)
+		return TRUE;
+
+	xattr_list = get_xattr(xattr, &count, &failed);
+	if(xattr_list == NULL && failed == FALSE)
+		exit(1);
+
+	if(failed)
+		ERROR("tar: Failed to read one or more xattrs for %s\n",
+			pathname);
+
+	for(i = 0; i < count; i++) {
+		int prefix = xattr_list[i].type & SQUASHFS_XATTR_PREFIX_MASK;
+		char *keyword;
+
+		if(user_xattrs && prefix != SQUASHFS_XATTR_USER)
+			continue;
+
+		if(asprintf(&keyword, "SCHILY.xattr.%s",
+					xattr_list[i].full_name) == -1)
+			MEM_ERROR();
+
+		pax_record(pax, keyword, xattr_list[i].value,
+			xattr_list[i].vsize);
+		free(keyword);
+	}
+
+	free_xattr(xattr_list, count);
+
+	return !failed;
+}
+#else
+#define pax_xattrs(pax, pathname, xattr) TRUE
+#endif
+
+
+/*
+ * Build the sparse map of a regular file from its block list, returning
+ * the number of map entries, or 0 if the file has no holes.  Data blocks
+ * stored as sparse (all zeros) are holes, and are not stored in the
+ * archive
+ */
+static int get_sparse_map(struct inode *i, struct sparse_map **map,
+	long long *bytes)
+{
+	unsigned int *block_list;
+	struct sparse_map *entries;
+	int b, count = 0, holes = FALSE;
+
+	if(i->blocks == 0)
+		return 0;
+
+	block_list = malloc(i->blocks * sizeof(unsigned int));
+	entries = malloc((i->blocks + 2) * sizeof(struct sparse_map));
+	if(block_list == NULL || entries == NULL)
+		MEM_ERROR();
+
+	s_ops->read_block_list(block_list, i->block_start, i->block_offset,
+		i->blocks);
+
+	*bytes = 0;
+	for(b = 0; b < i->blocks; b++) {
+		long long start = (long long) b * block_size;
+		long long size = i->data - start > block_size ? block_size :
+			i->data - start;
+
+		if(block_list[b] == 0)
+			holes = TRUE;
+		else if(count && entries[count - 1].offset +
+				entries[count - 1].number == start)
+			entries[count - 1].number += size;
+		else {
+			entries[count].offset = start;
+			entries[count++].number = size;
+		}
+	}
+
+	if(holes == FALSE) {
+		free(block_list);
+		free(entries);
+		return 0;
+	}
+
+	if(i->frag_bytes) {
+		long long start = (long long) i->blocks * block_size;
+
+		if(count && entries[count - 1].offset +
+				entries[count - 1].number == start)
+			entries[count - 1].number += i->frag_bytes;
+		else {
+			entries[count].offset = start;
+			entries[count++].number = i->frag_bytes;
+		}
+	}
+
+	/*
+	 * Like GNU tar the map is terminated by a zero length entry at the
+	 * end of the file, which also covers a hole extending to the end
+	 */
+	entries[count].offset = i->data;
+	entries[count++].number = 0;
+
+	for(b = 0; b < count; b++)
+		*bytes += entries[b].number;
+
+	free(block_list);
+	*map = entries;
+	return count;
+}
+
+
+/*
+ * Generate the header blocks for an entry, which are an optional PAX
+ * extended header, the ustar header, and for sparse files the sparse map
+ * (GNU sparse format 1.0), and queue them to the tar writer thread
+ */
+static int queue_header(char *pathname, struct inode *i, char type,
+	char *link)
+{
+	struct pax pax = { NULL, 0, 0 };
+	struct sparse_map *map = NULL;
+	struct tar_header header;
+	struct squashfs_file *file;
+	char *name = pathname, *sparse_name = NULL, *map_data = NULL;
+	long long size = 0, data_size = 0;
+	int map_entries = 0, map_bytes = 0, res = TRUE, bytes, n;
+
+	if(type == TAR_NORMAL1) {
+		data_size = size = i->data;
+		map_entries = get_sparse_map(i, &map, &data_size);
+	}
+
+	if(map_entries) {
+		/* map is "<entries>\n" followed by "<offset>\n<size>\n" pairs */
+		map_data = malloc(24 * (map_entries * 2 + 1));
+		if(map_data == NULL)
+			MEM_ERROR();
+
+		map_bytes = sprintf(map_data, "%d\n", map_entries);
+		for(n = 0; n < map_entries; n++)
+			map_bytes += sprintf(map_data + map_bytes,
+				"%lld\n%lld\n", map[n].offset, map[n].number);
+
+		pax_record(&pax, "GNU.sparse.major", "1", 1);
+		pax_record(&pax, "GNU.sparse.minor", "0", 1);
+		pax_record(&pax, "GNU.sparse.name", pathname, strlen(pathname));
+		pax_number(&pax, "GNU.sparse.realsize", i->data);
+
+		if(asprintf(&sparse_name, "GNUSparseFile.0/%s", pathname) == -1)
+			MEM_ERROR();
+		name = sparse_name;
+		size = TAR_ROUND(map_bytes) + data_size;
+		free(map);
+	}
+
+	header_block(&header, name, i->mode, i->uid, i->gid, size, i->time,
+		type);
+
+	if(strlen(name) > sizeof(header.name) && sparse_name == NULL)
+		pax_record(&pax, "path", pathname, strlen(pathname));
+
+	if(link) {
+		string(header.link, sizeof(header.link), link);
+		if(strlen(link) > sizeof(header.link))
+			pax_record(&pax, "linkpath", link, strlen(link));
+	}
+
+	if(!octal(header.uid, sizeof(header.uid), i->uid))
+		pax_number(&pax, "uid", i->uid);
+
+	if(!octal(header.gid, sizeof(header.gid), i->gid))
+		pax_number(&pax, "gid", i->gid);
+
+	if(!octal(header.size, sizeof(header.size), size))
+		pax_number(&pax, "size", size);
+
+	if(!octal(header.mtime, sizeof(header.mtime), i->time))
+		pax_number(&pax, "mtime", i->time);
+
+	if(type == TAR_CHAR || type == TAR_BLOCK) {
+		/* Based on new_decode_dev() in kernel source */
+		octal(header.major, sizeof(header.major),
+			(i->data & 0xfff00) >> 8);
+		octal(header.minor, sizeof(header.minor),
+			(i->data & 0xff) | ((i->data >> 12) & 0xfff00));
+	}
+
+	if(type != TAR_HARD)
+		res = pax_xattrs(&pax, pathname, i->xattr);
+
+	checksum(&header);
+
+	/*
+	 * Build the header blocks
+	 */
+	bytes = (pax.bytes ? TAR_BLOCK_SIZE + TAR_ROUND(pax.bytes) : 0) +
+		TAR_BLOCK_SIZE + TAR_ROUND(map_bytes);
+
+	file = malloc(sizeof(struct squashfs_file));
+	if(file == NULL)
+		MEM_ERROR();
+
+	file->header = calloc(1, bytes);
+	if(file->header == NULL)
+		MEM_ERROR();
+
+	n = 0;
+	if(pax.bytes) {
+		struct tar_header pax_header;
+
+		header_block(&pax_header, "././@PaxHeader", 0644, 0, 0,
+			pax.bytes, i->time, TAR_XHDR);
+		checksum(&pax_header);
+		memcpy(file->header, &pax_header, TAR_BLOCK_SIZE);
+		memcpy(file->header + TAR_BLOCK_SIZE, pax.data, pax.bytes);
+		n = TAR_BLOCK_SIZE + TAR_ROUND(pax.bytes);
+	}
+
+	memcpy(file->header + n, &header, TAR_BLOCK_SIZE);
+	if(map_bytes)
+		memcpy(file->header + n + TAR_BLOCK_SIZE, map_data, map_bytes);
+
+	file->header_size = bytes;
+	file->sparse = map_entries != 0;
+	file->blocks = 0;
+	file->pathname = strdup(pathname);
+	queue_put(to_writer, file);
+
+	free(pax.data);
+	free(map_data);
+	free(sparse_name);
+
+	return res;
+}
+
+
+static int tar_inode(char *pathname, struct inode *i)
+{
+	char *link = created_inode[i->inode_number - 1];
+	int res;
+
+	if(link)
+		return queue_header(pathname, i, TAR_HARD, link);
+
+	switch(i->type) {
+	case SQUASHFS_FILE_TYPE:
+	case SQUASHFS_LREG_TYPE:
+		res = queue_header(pathname, i, TAR_NORMAL1, NULL);
+		if(cat_file(i, pathname) == FALSE)
+			res = FALSE;
+		break;
+	case SQUASHFS_SYMLINK_TYPE:
+	case SQUASHFS_LSYMLINK_TYPE:
+		res = queue_header(pathname, i, TAR_SYM, i->symlink);
+		free(i->symlink);
+		break;
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_LBLKDEV_TYPE:
+		res = queue_header(pathname, i, TAR_BLOCK, NULL);
+		break;
+	case SQUASHFS_CHRDEV_TYPE:
+	case SQUASHFS_LCHRDEV_TYPE:
+		res = queue_header(pathname, i, TAR_CHAR, NULL);
+		break;
+	case SQUASHFS_FIFO_TYPE:
+	case SQUASHFS_LFIFO_TYPE:
+		res = queue_header(pathname, i, TAR_FIFO, NULL);
+		break;
+	case SQUASHFS_SOCKET_TYPE:
+	case SQUASHFS_LSOCKET_TYPE:
+		ERROR("tar: %s: socket ignored\n", pathname);
+		return TRUE;
+	default:
+		ERROR("tar: unknown inode type %d for %s\n", i->type,
+			pathname);
+		return FALSE;
+	}
+
+	created_inode[i->inode_number - 1] = strdup(pathname);
+	return res;
+}
+
+
+static int tar_scan(char *parent_name, unsigned int start_block,
+	unsigned int offset, struct pathnames *extracts,
+	struct pathnames *excludes, int depth)
+{
+	unsigned int type;
+	char *name;
+	struct pathnames *newt, *newc = NULL;
+	struct inode *i;
+	struct dir *dir = s_ops->opendir(start_block, offset, &i);
+	int failed = FALSE;
+
+	if(dir == NULL) {
+		ERROR("tar: failed to read directory %s\n", parent_name);
+		return FALSE;
+	}
+
+	/* The root directory isn't stored in the archive */
+	if(depth > 1) {
+		char *dirname;
+
+		if(asprintf(&dirname, "%s/", parent_name) == -1)
+			MEM_ERROR();
+
+		if(queue_header(dirname, i, TAR_DIR, NULL) == FALSE)
+			failed = TRUE;
+		free(dirname);
+	}
+
+	if(max_depth != -1 && depth > max_depth)
+		goto finish;
+
+	while(squashfs_readdir(dir, &name, &start_block, &offset, &type)) {
+		char *pathname;
+		int res;
+
+		TRACE("tar_scan: name %s, start_block %d, offset %d, type %d\n",
+			name, start_block, offset, type);
+
+		if(!extract_matches(extracts, name, &newt))
+			continue;
+
+		if(exclude_matches(excludes, name, &newc)) {
+			free_subdir(newt);
+			continue;
+		}
+
+		res = asprintf(&pathname, depth == 1 ? "%s%s" : "%s/%s",
+			parent_name, name);
+		if(res == -1)
+			MEM_ERROR();
+
+		if(type == SQUASHFS_DIR_TYPE)
+			res = tar_scan(pathname, start_block, offset, newt,
+							newc, depth + 1);
+		else if(newt == NULL)
+			res = tar_inode(pathname, s_ops->read_inode(start_block,
+								offset));
+		else
+			res = TRUE;
+
+		if(res == FALSE)
+			failed = TRUE;
+
+		free_subdir(newt);
+		free_subdir(newc);
+		free(pathname);
+	}
+
+finish:
+	squashfs_closedir(dir);
+
+	return !failed;
+}
+
+
+/*
+ * tar writer thread.  This is cat_writer() with the addition of writing
+ * the tar headers queued by tar_scan(), and padding file data to the tar
+ * block size.  Holes in sparse files are described by the sparse map, and
+ * are not written
+ */
+void *tar_writer(void *arg)
+{
+	char *zero = calloc(1, block_size);
+	long exit_code = FALSE;
+	int i, sparse = FALSE;
+
+	if(zero == NULL)
+		MEM_ERROR();
+
+	while(1) {
+		struct squashfs_file *file = queue_get(to_writer);
+		long long hole = 0, written = 0;
+		int local_fail = FALSE;
+
+		if(file == NULL) {
+			queue_put(from_writer, (void *) exit_code);
+			continue;
+		}
+
+		if(file->header) {
+			if(write_bytes(writer_fd, file->header,
+					file->header_size) == -1) {
+				EXIT_UNSQUASH_IGNORE("tar: failed to write "
+					"header for %s\n", file->pathname);
+				exit_code = TRUE;
+			}
+
+			sparse = file->sparse;
+			free(file->header);
+			free(file->pathname);
+			free(file);
+			continue;
+		}
+
+		for(i = 0; i < file->blocks; i++, cur_blocks ++) {
+			struct file_entry *block = queue_get(to_writer);
+			char *data;
+
+			if(block->buffer == 0) { /* sparse file */
+				if(sparse == FALSE)
+					hole += block->size;
+				free(block);
+				continue;
+			}
+
+			cache_block_wait(block->buffer);
+
+			/*
+			 * If the block is corrupt write zeros, so the
+			 * archive stays in step with the headers
+			 */
+			if(block->buffer->error) {
+				EXIT_UNSQUASH_IGNORE("tar: failed to "
+					"read/uncompress file %s\n",
+					file->pathname);
+				exit_code = TRUE;
+				data = zero;
+			} else
+				data = block->buffer->data + block->offset;
+
+			if(local_fail == FALSE && write_block(writer_fd, data,
+					block->size, hole, FALSE) == FALSE) {
+				EXIT_UNSQUASH_IGNORE("tar: failed to write "
+					"file %s\n", file->pathname);
+				exit_code = local_fail = TRUE;
+			}
+
+			written += hole + block->size;
+			hole = 0;
+			cache_block_put(block->buffer);
+			free(block);
+		}
+
+		/* corner case for hole extending to end of file, and padding */
+		hole += TAR_ROUND(written + hole) - (written + hole);
+		if(hole && local_fail == FALSE && write_block(writer_fd, "", 0,
+							hole, FALSE) == FALSE) {
+			EXIT_UNSQUASH_IGNORE("tar: failed to write file %s\n",
+				file->pathname);
+			exit_code = TRUE;
+		}
+
+		free(file->pathname);
+		free(file);
+	}
+}
+
+
+int generate_tar()
+{
+	char trailer[TAR_BLOCK_SIZE * 2];
+	int res, failed;
+
+	failed = !tar_scan("", SQUASHFS_INODE_BLK(sBlk.s.root_inode),
+		SQUASHFS_INODE_OFFSET(sBlk.s.root_inode), extracts, excludes, 1);
+
+	queue_put(to_writer, NULL);
+	res = (long) queue_get(from_writer);
+
+	/* end of archive is two zero filled blocks */
+	memset(trailer, 0, sizeof(trailer));
+	if(write_bytes(writer_fd, trailer, sizeof(trailer)) == -1)
+		failed = TRUE;
+
+	return (failed == TRUE || res == TRUE) && set_exit_code ? 2 : 0;
+}
@@ -44,6 +44,8 @@
 #include "progressbar.h"
 #include "pseudo.h"
 #include "tar.h"
+#include "image.h"
+#include "fnv.h"
 
 /* compressed xattr table */
 static char *xattr_table = NULL;
@@ -68,10 +70,10 @@ static int scache_bytes = 0;
 static int sxattr_ids = 0;
 
 /* xattr hash table for value duplicate detection */
-static struct xattr_list *dupl_value[65536];
+static struct dupl_table dupl_value;
 
 /* xattr hash table for id duplicate detection */
-static struct dupl_id *dupl_id[65536];
+static struct dupl_table dupl_id;
 
 /* file system globals from mksquashfs.c */
 extern int no_xattrs, noX;
@@ -80,7 +82,6 @@ extern int fd;
 extern unsigned int xattr_bytes, total_xattr_bytes;
 
 /* helper functions from mksquashfs.c */
-extern unsigned short get_checksum(char *, int, unsigned short);
 extern void write_destination(int, long long, long long, void *);
 extern long long generic_write_table(long long, void *, int, void *, int);
 extern int mangle(char *, char *, int, int, int, int);
@@ -113,7 +114,12 @@ int xattr_get_prefix(struct xattr_list *xattr, char *name)
 }
 
 	
-static int read_xattrs_from_system(char *filename, struct xattr_list **xattrs)
+/*
+ * Read the xattrs of the file at path.  Filename is the name used in
+ * error messages
+ */
+static int read_xattrs_from_path(char *path, char *filename,
+	struct xattr_list **xattrs)
 {
 	ssize_t size, vsize;
 	char *xattr_names, *p;
@@ -121,7 +127,7 @@ static int read_xattrs_from_system(char *filename, struct xattr_list **xattrs)
 	struct xattr_list *xattr_list = NULL;
 
 	while(1) {
-		size = llistxattr(filename, NULL, 0);
+		size = llistxattr(path, NULL, 0);
 		if(size <= 0) {
 			if(size < 0 && errno != ENOTSUP) {
 				ERROR_START("llistxattr for %s failed in "
@@ -136,7 +142,7 @@ static int read_xattrs_from_system(char *filename, struct xattr_list **xattrs)
 		if(xattr_names == NULL)
 			MEM_ERROR();
 
-		size = llistxattr(filename, xattr_names, size);
+		size = llistxattr(path, xattr_names, size);
 		if(size < 0) {
 			free(xattr_names);
 			if(errno == ERANGE)
@@ -172,7 +178,7 @@ static int read_xattrs_from_system(char *filename, struct xattr_list **xattrs)
 		}
 
 		while(1) {
-			vsize = lgetxattr(filename, xattr_list[i].full_name,
+			vsize = lgetxattr(path, xattr_list[i].full_name,
 								NULL, 0);
 			if(vsize < 0) {
 				ERROR_START("lgetxattr failed for %s in "
@@ -187,7 +193,7 @@ static int read_xattrs_from_system(char *filename, struct xattr_list **xattrs)
 			if(xattr_list[i].value == NULL)
 				MEM_ERROR();
 
-			vsize = lgetxattr(filename, xattr_list[i].full_name,
+			vsize = lgetxattr(path, xattr_list[i].full_name,
 						xattr_list[i].value, vsize);
 			if(vsize < 0) {
 				free(xattr_list[i].value);
@@ -230,6 +236,36 @@ failed:
 }
 
 
+int read_xattrs_from_system(char *filename, struct xattr_list **xattrs)
+{
+	return read_xattrs_from_path(filename, filename, xattrs);
+}
+
+
+/*
+ * Read the xattrs of name in the open directory dir_fd.  There are no *at()
+ * variants of the xattr system calls, but going through the directory's
+ * /proc/self/fd link only walks the last component, rather than the whole
+ * of filename (which is used in messages).  The caller should check
+ * /proc/self/fd is available, and otherwise use read_xattrs_from_system()
+ */
+int read_xattrs_from_dir_fd(int dir_fd, char *name, char *filename,
+	struct xattr_list **xattrs)
+{
+	char *path;
+	int res;
+
+	res = asprintf(&path, "/proc/self/fd/%d/%s", dir_fd, name);
+	if(res == -1)
+		BAD_ERROR("asprintf failed in read_xattrs_from_dir_fd\n");
+
+	res = read_xattrs_from_path(path, filename, xattrs);
+	free(path);
+
+	return res;
+}
+
+
 static int get_xattr_size(struct xattr_list *xattr)
 {
 	int size = sizeof(struct squashfs_xattr_entry) +
@@ -293,23 +329,88 @@ static void *get_xattr_space(unsigned int req_size, long long *disk)
 }
 
 
+static unsigned long long get_hash(void *data, int bytes,
+	unsigned long long hash)
+{
+	unsigned char *b = data;
+
+	while(bytes --)
+		hash = FNV_HASH(hash, *b++);
+
+	return hash;
+}
+
+
+/*
+ * Return the first slot to look at for <hash>, growing the table if
+ * necessary to keep it no more than half full
+ */
+static unsigned int dupl_start(struct dupl_table *table,
+	unsigned long long hash)
+{
+	if(table->count >= table->size / 2) {
+		struct dupl_slot *old = table->slot;
+		unsigned int i, size = table->size;
+
+		table->size = size ? size * 2 : DUPL_TABLE_SIZE;
+		table->slot = calloc(table->size, sizeof(struct dupl_slot));
+		if(table->slot == NULL)
+			MEM_ERROR();
+
+		for(i = 0; i < size; i++) {
+			unsigned int j = old[i].hash & (table->size - 1);
+
+			if(old[i].entry == NULL)
+				continue;
+
+			while(table->slot[j].entry)
+				j = (j + 1) & (table->size - 1);
+			table->slot[j] = old[i];
+		}
+
+		free(old);
+	}
+
+	return hash & (table->size - 1);
+}
+
+
+static void dupl_add(struct dupl_table *table, unsigned int i,
+	unsigned long long hash, void *entry)
+{
+	table->slot[i].hash = hash;
+	table->slot[i].entry = entry;
+	table->count ++;
+}
+
+
 static struct dupl_id *check_id_dupl(struct xattr_list *xattr_list, int xattrs)
 {
-	struct dupl_id *entry;
+	struct dupl_id *entry = NULL;
+	unsigned long long hash = FNV_OFFSET;
+	unsigned int slot;
 	int i;
-	unsigned short checksum = 0;
 
-	/* compute checksum over all xattrs */
+	/* compute hash over all xattrs */
 	for(i = 0; i < xattrs; i++) {
 		struct xattr_list *xattr = &xattr_list[i];
 
-		checksum = get_checksum(xattr->full_name,
-					strlen(xattr->full_name), checksum);
-		checksum = get_checksum(xattr->value,
-					xattr->vsize, checksum);
+		hash = get_hash(xattr->full_name, strlen(xattr->full_name) + 1,
+									hash);
+		hash = get_hash(&xattr->vsize, sizeof(xattr->vsize), hash);
+		hash = get_hash(xattr->value, xattr->vsize, hash);
 	}
 
-	for(entry = dupl_id[checksum]; entry; entry = entry->next) {
+	/*
+	 * The hash is only used to find the candidate, the xattrs are still
+	 * compared to rule out a collision
+	 */
+	for(slot = dupl_start(&dupl_id, hash); dupl_id.slot[slot].entry;
+				slot = (slot + 1) & (dupl_id.size - 1)) {
+		if(dupl_id.slot[slot].hash != hash)
+			continue;
+
+		entry = dupl_id.slot[slot].entry;
 		if (entry->xattrs != xattrs)
 			continue;
 
@@ -328,40 +429,44 @@ static struct dupl_id *check_id_dupl(struct xattr_list *xattr_list, int xattrs)
 		}
 		
 		if(i == xattrs)
-			break;
+			return entry;
 	}
 
-	if(entry == NULL) {
-		/* no duplicate exists */
-		entry = malloc(sizeof(*entry));
-		if(entry == NULL)
-			MEM_ERROR();
-		entry->xattrs = xattrs;
-		entry->xattr_list = xattr_list;
-		entry->xattr_id = SQUASHFS_INVALID_XATTR;
-		entry->next = dupl_id[checksum];
-		dupl_id[checksum] = entry;
-	}
-		
+	/* no duplicate exists */
+	entry = malloc(sizeof(*entry));
+	if(entry == NULL)
+		MEM_ERROR();
+	entry->xattrs = xattrs;
+	entry->xattr_list = xattr_list;
+	entry->xattr_id = SQUASHFS_INVALID_XATTR;
+	dupl_add(&dupl_id, slot, hash, entry);
+
 	return entry;
 }
 
 
 static void check_value_dupl(struct xattr_list *xattr)
 {
-	struct xattr_list *entry;
+	struct xattr_list *entry = NULL;
+	unsigned long long hash;
+	unsigned int slot;
 
 	if(xattr->vsize < XATTR_VALUE_OOL_SIZE)
 		return;
 
 	/* Check if this is a duplicate of an existing value */
-	xattr->vchecksum = get_checksum(xattr->value, xattr->vsize, 0);
-	for(entry = dupl_value[xattr->vchecksum]; entry; entry = entry->vnext) {
-		if(entry->vsize != xattr->vsize)
+	hash = get_hash(xattr->value, xattr->vsize, FNV_OFFSET);
+	for(slot = dupl_start(&dupl_value, hash); dupl_value.slot[slot].entry;
+				slot = (slot + 1) & (dupl_value.size - 1)) {
+		if(dupl_value.slot[slot].hash != hash)
 			continue;
-		
-		if(memcmp(entry->value, xattr->value, xattr->vsize) == 0)
+
+		entry = dupl_value.slot[slot].entry;
+		if(entry->vsize == xattr->vsize &&
+			memcmp(entry->value, xattr->value, xattr->vsize) == 0)
 			break;
+
+		entry = NULL;
 	}
 
 	if(entry == NULL) {
@@ -369,8 +474,7 @@ static void check_value_dupl(struct xattr_list *xattr)
 		 * No duplicate exists, add to hash table, and mark as
 		 * requiring writing
 		 */
-		xattr->vnext = dupl_value[xattr->vchecksum];
-		dupl_value[xattr->vchecksum] = xattr;
+		dupl_add(&dupl_value, slot, hash, xattr);
 		xattr->ool_value = SQUASHFS_INVALID_BLK;
 	} else {
 		/*
@@ -624,7 +728,15 @@ int read_xattrs(void *d)
 
 	if(IS_TARFILE(inode))
 		xattrs = read_xattrs_from_tarfile(inode, &xattr_list);
-	else
+	else if(IS_IMAGE(inode))
+		xattrs = read_xattrs_from_image(inode, &xattr_list);
+	else if(inode->xattrs != -1) {
+		/* already read by the scanner threads */
+		xattrs = inode->xattrs;
+		xattr_list = inode->xattr_list;
+		inode->xattr_list = NULL;
+		inode->xattrs = -1;
+	} else
 		xattrs = read_xattrs_from_system(filename, &xattr_list);
 	if(xattrs == 0)
 		return SQUASHFS_INVALID_XATTR;
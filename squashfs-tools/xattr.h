@@ -47,17 +47,28 @@ struct xattr_list {
 	void			*value;
 	int			type;
 	long long		ool_value;
-	unsigned short		vchecksum;
-	struct xattr_list	*vnext;
 };
 
 struct dupl_id {
 	struct xattr_list	*xattr_list;
 	int			xattrs;
 	int			xattr_id;
-	struct dupl_id		*next;
 };
 
+/* open addressed hash table used for xattr duplicate detection */
+struct dupl_slot {
+	unsigned long long	hash;
+	void			*entry;
+};
+
+struct dupl_table {
+	struct dupl_slot	*slot;
+	unsigned int		size;
+	unsigned int		count;
+};
+
+#define DUPL_TABLE_SIZE		1024
+
 struct prefix {
 	char			*prefix;
 	int			type;
@@ -76,6 +87,8 @@ extern int write_xattr(char *, unsigned int);
 extern int read_xattrs_from_disk(int, struct squashfs_super_block *, int, long long *);
 extern struct xattr_list *get_xattr(int, unsigned int *, int *);
 extern void free_xattr(struct xattr_list *, int);
+extern int read_xattrs_from_system(char *, struct xattr_list **);
+extern int read_xattrs_from_dir_fd(int, char *, char *, struct xattr_list **);
 #else
 static inline int get_xattrs(int fd, struct squashfs_super_block *sBlk)
 {
@@ -131,6 +144,20 @@ static inline struct xattr_list *get_xattr(int i, unsigned int *count, int j)
 {
 	return NULL;
 }
+
+
+static inline int read_xattrs_from_system(char *filename,
+	struct xattr_list **xattrs)
+{
+	return 0;
+}
+
+
+static inline int read_xattrs_from_dir_fd(int dir_fd, char *name,
+	char *filename, struct xattr_list **xattrs)
+{
+	return 0;
+}
 #endif
 
 #ifdef XATTR_SUPPORT